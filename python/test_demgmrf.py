@@ -0,0 +1,69 @@
+# +---------------------------------------------------------------------------+
+# |                                DEM-GMRF                                   |
+# |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+# |                                                                           |
+# | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+# | Released under GNU GPL v3 License. See LICENSE file                       |
+# +---------------------------------------------------------------------------+
+# Tests of the demgmrf module, run by ctest (PYTHONPATH=<build>/python).
+
+import array
+import math
+import unittest
+
+import demgmrf
+
+
+def make_points(n=2000):
+    """Nx3 float32 memoryview over a tilted, wavy surface."""
+    a = array.array('f')
+    for i in range(n):
+        x, y = (i * 7919 % 997) * 0.05, (i * 104729 % 991) * 0.04
+        a.extend([x, y, 10 + math.sin(x / 7) + 0.1 * y])
+    return a, memoryview(a).cast('B').cast('f', shape=[n, 3])
+
+
+def grid_values(view):
+    """Rows of a grid view, with NaN (masked cells) as None so they compare equal."""
+    return [[None if v != v else v for v in row] for row in view.tolist()]
+
+
+class TestStages(unittest.TestCase):
+    def run_pipeline(self, mv, first_stages):
+        dem = demgmrf.Pipeline(resolution=1.0, solver='native', grid_storage='soa',
+                               rotate_grid=True, aoi=[(0, 0), (40, 0), (45, 38), (2, 36)])
+        dem.set_points(mv)
+        first_stages(dem)
+        dem.run()
+        return dem
+
+    def test_run_after_compute_bbox(self):
+        a, mv = make_points()
+        ref = self.run_pipeline(mv, lambda dem: None)
+        dem = self.run_pipeline(mv, lambda dem: dem.compute_bbox())
+        self.assertEqual((dem.size_x, dem.size_y), (ref.size_x, ref.size_y))
+        self.assertEqual((dem.x_min, dem.y_min), (ref.x_min, ref.y_min))
+        self.assertEqual(dem.points, ref.points)
+        self.assertEqual(grid_values(dem.mean), grid_values(ref.mean))
+
+    def test_compute_bbox_twice(self):
+        a, mv = make_points()
+        dem = demgmrf.Pipeline(solver='native', grid_storage='soa')
+        dem.set_points(mv)
+        dem.compute_bbox()
+        self.assertRaises(RuntimeError, dem.compute_bbox)
+        dem.set_points(mv)  # Restarts the pipeline
+        dem.compute_bbox()
+
+    def test_run_twice(self):
+        a, mv = make_points()
+        dem = demgmrf.Pipeline(solver='native', grid_storage='soa')
+        dem.set_points(mv)
+        dem.run()
+        mean = dem.mean
+        dem.run()  # Nothing left to run: the grid (and its views) stay
+        self.assertEqual(grid_values(mean), grid_values(dem.mean))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,194 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "active_mask.h"
+#include "parallel_for.h"
+#include "xyz_loader.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+void TPolygon2D::loadFromTextFile(const std::string &file)
+{
+	mrpt::math::CMatrix m;
+	TPointsBBox bb;
+	load_xyz_file(file,m,bb);
+	if (m.cols()<2 || m.rows()<3)
+		THROW_EXCEPTION(std::string("Polygon file must have at least 3 rows with X Y columns: ")+file);
+	xs.resize(m.rows()); ys.resize(m.rows());
+	for (size_t i=0;i<xs.size();i++) { xs[i]=m(i,0); ys[i]=m(i,1); }
+}
+
+bool TPolygon2D::contains(double x, double y) const
+{
+	bool in = false;
+	const size_t n = xs.size();
+	for (size_t i=0, j=n-1; i<n; j=i++)
+	{
+		if ( ((ys[i]>y) != (ys[j]>y)) &&
+			 (x < (xs[j]-xs[i]) * (y-ys[i]) / (ys[j]-ys[i]) + xs[i]) )
+			in = !in;
+	}
+	return in;
+}
+
+double TPolygon2D::area() const
+{
+	double a = 0;
+	for (size_t i=0, j=xs.size()-1; i<xs.size(); j=i++)
+		a += (xs[j]+xs[i])*(ys[j]-ys[i]);
+	return 0.5*std::abs(a);
+}
+
+// Distance from each cell to the nearest cell with data, in cell units.
+static void distance_transform(size_t nx, size_t ny, std::vector<float> &d)
+{
+	// Two-pass 8-neighbor chamfer distance transform (weights 1, sqrt(2)):
+	const float A = 1.0f, B = 1.41421356f;
+	for (size_t cy=0;cy<ny;cy++)
+		for (size_t cx=0;cx<nx;cx++)
+		{
+			float &v = d[cx+cy*nx];
+			if (cx>0)              v = std::min(v, d[cx-1+cy*nx]+A);
+			if (cy>0)              v = std::min(v, d[cx+(cy-1)*nx]+A);
+			if (cx>0 && cy>0)      v = std::min(v, d[cx-1+(cy-1)*nx]+B);
+			if (cx+1<nx && cy>0)   v = std::min(v, d[cx+1+(cy-1)*nx]+B);
+		}
+	for (size_t cy=ny;cy-->0;)
+		for (size_t cx=nx;cx-->0;)
+		{
+			float &v = d[cx+cy*nx];
+			if (cx+1<nx)            v = std::min(v, d[cx+1+cy*nx]+A);
+			if (cy+1<ny)            v = std::min(v, d[cx+(cy+1)*nx]+A);
+			if (cx+1<nx && cy+1<ny) v = std::min(v, d[cx+1+(cy+1)*nx]+B);
+			if (cx>0 && cy+1<ny)    v = std::min(v, d[cx-1+(cy+1)*nx]+B);
+		}
+}
+
+// Mask of grid `g` from its cells with data (see compute_active_mask()):
+static void mask_from_data(const TGridGeometry &g, const std::vector<uint8_t> &has_data, double max_dist, const TPolygon2D *aoi, std::vector<uint8_t> &mask)
+{
+	const size_t nx = g.size_x, ny = g.size_y;
+	mask.assign(nx*ny, 1);
+	if (max_dist>0)
+	{
+		std::vector<float> d(nx*ny);
+		for (size_t c=0;c<nx*ny;c++) d[c] = has_data[c] ? 0.0f : std::numeric_limits<float>::max();
+		distance_transform(nx,ny,d);
+		const float max_d_cells = static_cast<float>(max_dist/g.resolution);
+		for (size_t c=0;c<nx*ny;c++) mask[c] = d[c]<=max_d_cells ? 1 : 0;
+	}
+
+	if (aoi)
+	{
+		parallel_for(ny, [&](size_t cy0, size_t cy1)
+		{
+			for (size_t cy=cy0;cy<cy1;cy++)
+			{
+				const double y = g.y_min + (cy+0.5)*g.resolution;
+				for (size_t cx=0;cx<nx;cx++)
+				{
+					uint8_t &m = mask[cx+cy*nx];
+					if (m && !has_data[cx+cy*nx] && !aoi->contains(g.x_min + (cx+0.5)*g.resolution, y))
+						m = 0;
+				}
+			}
+		}, 16);
+	}
+}
+
+void compute_active_mask(const TGridGeometry &g, const TPointsView &xyz, double max_dist, const TPolygon2D *aoi, std::vector<uint8_t> &mask)
+{
+	const size_t nx = g.size_x, ny = g.size_y;
+	std::vector<uint8_t> has_data(nx*ny, 0);
+	for (size_t i=0;i<size_t(xyz.rows());i++)
+	{
+		const double fx = (xyz(i,0)-g.x_min)/g.resolution, fy = (xyz(i,1)-g.y_min)/g.resolution;
+		if (fx<0 || fy<0 || fx>=nx || fy>=ny) continue;
+		has_data[size_t(fx)+size_t(fy)*nx] = 1;
+	}
+	mask_from_data(g, has_data, max_dist, aoi, mask);
+}
+
+void filter_active_cells(const TGridGeometry &g, const TPointsView &xyz, double max_dist, const TPolygon2D *aoi, std::vector<size_t> &cells)
+{
+	const size_t nx = g.size_x, ny = g.size_y;
+	std::vector<size_t> data; // Sorted indices of the cells with data
+	data.reserve(xyz.rows());
+	for (size_t i=0;i<size_t(xyz.rows());i++)
+	{
+		const double fx = (xyz(i,0)-g.x_min)/g.resolution, fy = (xyz(i,1)-g.y_min)/g.resolution;
+		if (fx<0 || fy<0 || fx>=nx || fy>=ny) continue;
+		data.push_back(size_t(fx)+size_t(fy)*nx);
+	}
+	std::sort(data.begin(), data.end());
+	data.erase(std::unique(data.begin(), data.end()), data.end());
+
+	// Windows of WIN x WIN cells holding some of the listed cells. The mask of
+	// each one is computed on a local grid with a margin of `max_dist`, which
+	// has all the data cells that may be within that distance of it:
+	const size_t WIN = 64, n_wx = (nx+WIN-1)/WIN;
+	const size_t R = max_dist>0 ? size_t(std::ceil(max_dist/g.resolution))+1 : 0;
+	std::vector<size_t> wins(cells.size());
+	for (size_t i=0;i<cells.size();i++)
+		wins[i] = (cells[i]%nx)/WIN + ((cells[i]/nx)/WIN)*n_wx;
+	std::sort(wins.begin(), wins.end());
+	wins.erase(std::unique(wins.begin(), wins.end()), wins.end());
+
+	std::vector<std::vector<uint8_t> > win_masks(wins.size());
+	parallel_for(wins.size(), [&](size_t w0, size_t w1)
+	{
+		std::vector<uint8_t> has_data, mask;
+		for (size_t w=w0;w<w1;w++)
+		{
+			const size_t wx = (wins[w]%n_wx)*WIN, wy = (wins[w]/n_wx)*WIN;
+			const size_t x0 = wx>R ? wx-R : 0, x1 = std::min(nx, wx+WIN+R);
+			const size_t y0 = wy>R ? wy-R : 0, y1 = std::min(ny, wy+WIN+R);
+			TGridGeometry lg = g;
+			lg.x_min = g.x_min + x0*g.resolution; lg.size_x = x1-x0;
+			lg.y_min = g.y_min + y0*g.resolution; lg.size_y = y1-y0;
+			has_data.assign(lg.size_x*lg.size_y, 0);
+			for (size_t cy=y0;cy<y1;cy++)
+				for (std::vector<size_t>::const_iterator it=std::lower_bound(data.begin(), data.end(), x0+cy*nx); it!=data.end() && *it<x1+cy*nx; ++it)
+					has_data[*it-cy*nx-x0 + (cy-y0)*lg.size_x] = 1;
+			mask_from_data(lg, has_data, max_dist, aoi, mask);
+
+			std::vector<uint8_t> &wm = win_masks[w];
+			wm.assign(WIN*WIN, 0);
+			for (size_t cy=wy;cy<std::min(ny,wy+WIN);cy++)
+				for (size_t cx=wx;cx<std::min(nx,wx+WIN);cx++)
+					wm[cx-wx + (cy-wy)*WIN] = mask[cx-x0 + (cy-y0)*lg.size_x];
+		}
+	}, 1);
+
+	size_t n = 0;
+	for (size_t i=0;i<cells.size();i++)
+	{
+		const size_t cx = cells[i]%nx, cy = cells[i]/nx;
+		const size_t w = std::lower_bound(wins.begin(), wins.end(), cx/WIN + (cy/WIN)*n_wx) - wins.begin();
+		if (win_masks[w][cx%WIN + (cy%WIN)*WIN]) cells[n++] = cells[i];
+	}
+	cells.resize(n);
+}
+
+void filter_points_by_polygon(mrpt::math::CMatrix &xyz, const TPolygon2D &aoi)
+{
+	const size_t N = xyz.rows(), nCols = xyz.cols();
+	std::vector<uint8_t> keep(N);
+	parallel_for(N, [&](size_t i0, size_t i1) {
+		for (size_t i=i0;i<i1;i++) keep[i] = aoi.contains(xyz(i,0),xyz(i,1)) ? 1 : 0;
+	});
+	size_t n = 0;
+	for (size_t i=0;i<N;i++)
+	{
+		if (!keep[i]) continue;
+		if (n!=i) for (size_t k=0;k<nCols;k++) xyz(n,k) = xyz(i,k);
+		n++;
+	}
+	xyz.conservativeResize(n,nCols);
+}
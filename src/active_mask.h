@@ -0,0 +1,63 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/math/CMatrix.h>
+#include "xyz_loader.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cmath>
+
+/** Geometry of a DEM grid: cell (cx,cy) spans [x_min+cx*res, x_min+(cx+1)*res) */
+struct TGridGeometry
+{
+	double x_min, y_min, resolution;
+	size_t size_x, size_y;
+
+	/** Geometry for the given limits, rounded to multiples of the resolution
+	  * as CDynamicGridMap2D::setSize() does. */
+	static TGridGeometry FromLimits(double x_min, double x_max, double y_min, double y_max, double resolution)
+	{
+		TGridGeometry g;
+		g.resolution = resolution;
+		g.x_min = resolution*std::floor(x_min/resolution+0.5);
+		g.y_min = resolution*std::floor(y_min/resolution+0.5);
+		g.size_x = static_cast<size_t>(std::floor((resolution*std::floor(x_max/resolution+0.5)-g.x_min)/resolution+0.5));
+		g.size_y = static_cast<size_t>(std::floor((resolution*std::floor(y_max/resolution+0.5)-g.y_min)/resolution+0.5));
+		return g;
+	}
+};
+
+/** Closed polygon in the XY plane, e.g. a user area of interest (AOI) */
+struct TPolygon2D
+{
+	std::vector<double> xs, ys;
+
+	/** Loads vertices from a text file, one `X Y` pair per row. */
+	void loadFromTextFile(const std::string &file);
+	/** Even-odd rule point-in-polygon test */
+	bool contains(double x, double y) const;
+	/** Enclosed area (shoelace formula; assumes a simple polygon) */
+	double area() const;
+};
+
+/** Computes the active-cell mask of a grid (1=active): cells whose center lies
+  * within `max_dist` meters of any point in `xyz` (from a chamfer distance
+  * transform; max_dist<=0 means no distance limit) and, if `aoi` is not NULL,
+  * inside that polygon. Cells containing a point are always active. */
+void compute_active_mask(const TGridGeometry &g, const TPointsView &xyz, double max_dist, const TPolygon2D *aoi, std::vector<uint8_t> &mask);
+
+/** Keeps in `cells` (linear indices cx+cy*size_x, ascending) only those that
+  * compute_active_mask() would mark active, without a mask of the whole grid:
+  * for sparse grids, whose bbox may be much larger than the cells listed. */
+void filter_active_cells(const TGridGeometry &g, const TPointsView &xyz, double max_dist, const TPolygon2D *aoi, std::vector<size_t> &cells);
+
+/** Removes the rows of `xyz` whose XY falls outside `aoi`, in place. */
+void filter_points_by_polygon(mrpt::math::CMatrix &xyz, const TPolygon2D &aoi);
@@ -0,0 +1,84 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#if defined(_MSC_VER)
+#	include <malloc.h>
+#endif
+
+/** STL allocator returning memory aligned to ALIGN bytes (a cache line by
+  * default), so vectorized loops over a plane never straddle cache lines at
+  * its start and can use aligned loads. */
+template <class T, size_t ALIGN = 64>
+struct TAlignedAllocator
+{
+	typedef T value_type;
+	template <class U> struct rebind { typedef TAlignedAllocator<U,ALIGN> other; };
+
+	TAlignedAllocator() {}
+	template <class U> TAlignedAllocator(const TAlignedAllocator<U,ALIGN> &) {}
+
+	T *allocate(size_t n)
+	{
+		if (!n) return NULL;
+		void *p = NULL;
+#if defined(_MSC_VER)
+		p = _aligned_malloc(n*sizeof(T), ALIGN);
+#else
+		if (posix_memalign(&p, ALIGN, n*sizeof(T))) p = NULL;
+#endif
+		if (!p) throw std::bad_alloc();
+		return static_cast<T*>(p);
+	}
+	void deallocate(T *p, size_t)
+	{
+#if defined(_MSC_VER)
+		_aligned_free(p);
+#else
+		free(p);
+#endif
+	}
+
+	template <class U> bool operator==(const TAlignedAllocator<U,ALIGN> &) const { return true; }
+	template <class U> bool operator!=(const TAlignedAllocator<U,ALIGN> &) const { return false; }
+};
+
+/** A std::vector whose buffer starts at a 64-byte boundary */
+template <class T>
+using aligned_vector = std::vector<T, TAlignedAllocator<T> >;
+
+/** Non-owning view of `size()` contiguous elements (a minimal std::span) */
+template <class T>
+class TSpan
+{
+public:
+	TSpan() : m_data(NULL), m_size(0) {}
+	TSpan(T *data, size_t size) : m_data(data), m_size(size) {}
+	template <class A> TSpan(std::vector<typename std::remove_const<T>::type,A> &v) : m_data(v.empty() ? NULL : &v[0]), m_size(v.size()) {}
+	template <class A> TSpan(const std::vector<typename std::remove_const<T>::type,A> &v) : m_data(v.empty() ? NULL : &v[0]), m_size(v.size()) {}
+
+	T *data() const { return m_data; }
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size==0; }
+	T *begin() const { return m_data; }
+	T *end() const { return m_data+m_size; }
+	T &operator[](size_t i) const { return m_data[i]; }
+
+	/** Elements [offset, offset+count) */
+	TSpan subspan(size_t offset, size_t count) const { return TSpan(m_data+offset, count); }
+
+private:
+	T *m_data;
+	size_t m_size;
+};
@@ -0,0 +1,118 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "checkpoints.h"
+#include "point_grid_index.h"
+#include <mrpt/math/utils.h>
+#include <mrpt/utils/round.h>
+#include <algorithm> // std::shuffle
+
+using namespace std;
+
+TCheckpointMode checkpoint_mode_from_string(const std::string &s)
+{
+	if (s=="random") return chkRandom;
+	if (s=="stratified") return chkStratified;
+	if (s=="blocks") return chkBlocks;
+	THROW_EXCEPTION(std::string("Unknown checkpoint mode: `")+s+std::string("` (valid: random|stratified|blocks)"));
+}
+
+// Puts the points flagged in `is_chk` last in `pts_indices`. Returns their count.
+static size_t partition_indices(const std::vector<bool> &is_chk, std::vector<size_t> &pts_indices)
+{
+	const size_t N = is_chk.size();
+	pts_indices.clear();
+	pts_indices.reserve(N);
+	for (size_t i=0;i<N;i++) if (!is_chk[i]) pts_indices.push_back(i);
+	const size_t N_insert = pts_indices.size();
+	for (size_t i=0;i<N;i++) if (is_chk[i]) pts_indices.push_back(i);
+	return N-N_insert;
+}
+
+size_t select_checkpoints(
+	const TPointsView &xyz,
+	double minx, double maxx, double miny, double maxy,
+	const TCheckpointOptions &opts,
+	std::mt19937 &rng,
+	std::vector<size_t> &pts_indices,
+	double *out_cell_size)
+{
+	const size_t N = xyz.rows();
+	const double ratio = opts.ratio;
+	ASSERT_(ratio>=0.0 && ratio<=1.0);
+	if (out_cell_size) *out_cell_size = 0;
+
+	const size_t N_chk_target = mrpt::utils::round( ratio * N );
+	if (opts.mode==chkRandom || !N_chk_target || N_chk_target==N)
+	{
+		// Generate a list with all indices, then keep the first "N-Nchk" for insertion in the map, "Nchk" as checkpoints
+		mrpt::math::linspace((size_t)0,N-1,N, pts_indices);
+		std::shuffle(pts_indices.begin(), pts_indices.end(), rng);
+		return N_chk_target;
+	}
+
+	const double area = std::max(1e-9, (maxx-minx)*(maxy-miny));
+	CPointGridIndex idx;
+	std::vector<bool> is_chk(N,false);
+
+	if (opts.mode==chkStratified)
+	{
+		const size_t K = std::max<size_t>(1,opts.per_cell);
+		double cell = opts.cell_size;
+		if (cell<=0)
+		{
+			// Aim at N_chk/K non-empty strata. Empty cells (gaps, irregular footprints)
+			// make the first guess too fine, so refine it with the observed occupancy:
+			const double n_strata = std::max(1.0, double(N_chk_target)/K);
+			cell = std::sqrt(area/n_strata);
+			for (int iter=0;iter<3;iter++)
+			{
+				idx.build(xyz,minx,maxx,miny,maxy,cell);
+				const double occupied = std::max<size_t>(1,idx.countNonEmptyCells());
+				if (occupied>=0.9*n_strata) break;
+				cell*= std::sqrt(occupied/n_strata);
+			}
+		}
+		idx.build(xyz,minx,maxx,miny,maxy,cell);
+		if (out_cell_size) *out_cell_size = cell;
+
+		std::vector<size_t> cell_pts;
+		for (size_t c=0;c<idx.getCellCount();c++)
+		{
+			const size_t n = idx.cellPointCount(c);
+			if (!n) continue;
+			cell_pts.assign(idx.cellBegin(c),idx.cellEnd(c));
+			std::shuffle(cell_pts.begin(), cell_pts.end(), rng);
+			// Never take all the points of a stratum, or it would be left without data:
+			const size_t n_pick = std::min(K, n>1 ? n-1 : size_t(0));
+			for (size_t k=0;k<n_pick;k++) is_chk[cell_pts[k]]=true;
+		}
+	}
+	else if (opts.mode==chkBlocks)
+	{
+		double cell = opts.cell_size;
+		if (cell<=0) cell = std::sqrt(area/100.0); // ~10x10 blocks
+		idx.build(xyz,minx,maxx,miny,maxy,cell);
+		if (out_cell_size) *out_cell_size = cell;
+
+		std::vector<size_t> blocks;
+		for (size_t c=0;c<idx.getCellCount();c++)
+			if (idx.cellPointCount(c)) blocks.push_back(c);
+		std::shuffle(blocks.begin(), blocks.end(), rng);
+
+		size_t n_held = 0;
+		for (size_t b=0;b<blocks.size() && n_held<N_chk_target;b++)
+		{
+			for (const size_t *it=idx.cellBegin(blocks[b]);it!=idx.cellEnd(blocks[b]);++it)
+				is_chk[*it]=true;
+			n_held+=idx.cellPointCount(blocks[b]);
+		}
+	}
+
+	return partition_indices(is_chk,pts_indices);
+}
@@ -0,0 +1,49 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/math/CMatrix.h>
+#include "xyz_loader.h"
+#include <random>
+#include <string>
+#include <vector>
+
+/** How checkpoints (points held out of the DEM for validation) are chosen */
+enum TCheckpointMode
+{
+	chkRandom = 0,   //!< Uniform random subset of all points (clumps in dense areas)
+	chkStratified,   //!< K random points per non-empty cell of a coarse grid
+	chkBlocks        //!< Whole grid blocks held out (spatial cross-validation)
+};
+
+TCheckpointMode checkpoint_mode_from_string(const std::string &s);
+
+struct TCheckpointOptions
+{
+	TCheckpointOptions() : mode(chkRandom), ratio(0.01), cell_size(0), per_cell(1) {}
+
+	TCheckpointMode mode;
+	double ratio;      //!< Target fraction of checkpoints (0.0=none, 1.0=all)
+	double cell_size;  //!< Stratum/block side length [m]. 0=automatic, from `ratio`
+	size_t per_cell;   //!< Checkpoints per stratum (chkStratified only)
+};
+
+/** Builds a permutation of [0,N-1] into `pts_indices` such that its last
+  * entries are the selected checkpoints and the first ones are the points to
+  * be inserted into the DEM. Returns the number of checkpoints. The bbox limits
+  * are those of the XY coordinates in `xyz`. Random choices are drawn from
+  * `rng` only, so that concurrent pipelines are reproducible from their seeds.
+  */
+size_t select_checkpoints(
+	const TPointsView &xyz,
+	double minx, double maxx, double miny, double maxy,
+	const TCheckpointOptions &opts,
+	std::mt19937 &rng,
+	std::vector<size_t> &pts_indices,
+	double *out_cell_size = NULL);
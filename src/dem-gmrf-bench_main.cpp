@@ -0,0 +1,295 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+// Scalability benchmark of the dem-gmrf pipeline over synthetic fractal
+// terrain, generated in memory, with the exact ground truth at hand.
+
+#include <mrpt/math/CMatrix.h>
+#include <mrpt/otherlibs/tclap/CmdLine.h>
+#include <mrpt/system/os.h>
+#include <mrpt/utils/CFileOutputStream.h>
+#include <mrpt/utils/round.h>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+#include "synthetic_terrain.h"
+#include "checkpoints.h"
+#include "dem_predict.h"
+#include "dem_grid_io.h"
+#include "gmrf_solver.h"
+#include "parallel_for.h"
+#include "perf_report.h"
+#include "soa_dem_grid.h"
+#include "thread_pool.h"
+#include "xyz_loader.h"
+
+using namespace mrpt;
+using namespace mrpt::utils;
+using namespace std;
+
+// Declare the supported options.
+TCLAP::CmdLine cmd("dem-gmrf-bench", ' ', mrpt::system::MRPT_getVersion().c_str());
+
+TCLAP::ValueArg<std::string>  arg_points("","points","Comma-separated list of point counts to benchmark (Default=1e5,1e6)",false,"1e5,1e6","1e5,1e6,1e7",cmd);
+TCLAP::ValueArg<double>       arg_density("","density","Point density [points/m^2] (Default=2.0)",false,2.0,"2.0",cmd);
+TCLAP::ValueArg<double>       arg_amplitude("","amplitude","Height range of the largest terrain octave [m] (Default=50)",false,50.0,"50.0",cmd);
+TCLAP::ValueArg<double>       arg_wavelength("","wavelength","Wavelength of the largest terrain octave [m] (Default=500)",false,500.0,"500.0",cmd);
+TCLAP::ValueArg<double>       arg_hurst("","hurst","Hurst exponent of the fractal terrain, (0,1]: lower is rougher (Default=0.8)",false,0.8,"0.8",cmd);
+TCLAP::ValueArg<double>       arg_noise("","noise","Standard deviation of the noise added to each point height [m] (Default=0.05)",false,0.05,"0.05",cmd);
+TCLAP::ValueArg<double>       arg_gaps("","gaps","Fraction of the footprint covered by data gaps (Default=0)",false,0.0,"0.0",cmd);
+TCLAP::ValueArg<std::string>  arg_footprint("","footprint","Survey footprint: `rect`, `disc` or `corridor` (Default=rect)",false,"rect","rect",cmd);
+TCLAP::ValueArg<unsigned int> arg_seed("","seed","Seed of the terrain and point generator (Default=1234)",false,1234,"1234",cmd);
+
+TCLAP::ValueArg<double>       arg_resolution("r","resolution","Resolution (cell size) of the DEM [meters] (Default=1.0)",false,1.0,"1.0",cmd);
+TCLAP::ValueArg<double>       arg_std_prior("","std-prior","Standard deviation of the prior constraints [meters] (Default=1.0)",false,1.0,"1.0",cmd);
+TCLAP::ValueArg<double>       arg_std_observations("","std-obs","Standard deviation of each point observation [meters] (Default=0.20)",false,0.20,"0.20",cmd);
+TCLAP::ValueArg<double>       arg_checkpoints_ratio("c","checkpoint-ratio","Ratio of points held out as checkpoints (Default=0.01)",false,0.01,"0.01",cmd);
+TCLAP::ValueArg<std::string>  arg_solver("","solver","GMRF solver: `native` or `mixed` (Default=native)",false,"native","native",cmd);
+TCLAP::SwitchArg              arg_skip_variance("","skip-variance", "Skip variance estimation",cmd);
+TCLAP::ValueArg<unsigned int> arg_last_stage("","last-stage","Stop after this pipeline stage (2-9), to benchmark the first stages alone (Default=9)",false,9,"9",cmd);
+
+TCLAP::ValueArg<std::string>  arg_out_prefix("o","output-prefix","Prefix for files written with --with-io / --save-dem (Default=demgmrf_bench)",false,"demgmrf_bench","demgmrf_bench",cmd);
+TCLAP::SwitchArg              arg_with_io("","with-io","Also benchmark stage [1]: write the points to `<prefix>_synthetic.xyz` and load them back",cmd);
+TCLAP::SwitchArg              arg_save_dem("","save-dem","Also benchmark stage [9]: save the DEM grid to `<prefix>_<N>_grmf_*`",cmd);
+TCLAP::ValueArg<unsigned int> arg_threads("","threads","Number of threads (Default=0, one per hardware thread)",false,0,"0",cmd);
+TCLAP::SwitchArg              arg_pin_threads("","pin-threads","Bind each thread to one CPU of the process affinity mask",cmd);
+TCLAP::ValueArg<std::string>  arg_perf_report("","perf-report","Save all measurements to this JSON file",false,"","bench.json",cmd);
+
+static std::vector<size_t> parse_scales(const std::string &s)
+{
+	std::vector<size_t> r;
+	std::stringstream ss(s);
+	std::string tok;
+	while (std::getline(ss,tok,','))
+	{
+		const double v = atof(tok.c_str());
+		if (v<1) THROW_EXCEPTION(std::string("Invalid point count in --points: ")+tok);
+		r.push_back(size_t(v));
+	}
+	return r;
+}
+
+static void save_xyz(const mrpt::math::CMatrix &xyz, const std::string &file)
+{
+	CFileOutputStream f(file);
+	for (size_t i=0;i<size_t(xyz.rows());i++)
+		f.printf("%.3f %.3f %.3f\n", xyz(i,0), xyz(i,1), xyz(i,2));
+}
+
+// Accuracy of the DEM against the known terrain:
+struct TAccuracy
+{
+	TAccuracy() : rmse_chk_truth(0), rmse_chk_obs(0), rmse_grid_truth(0), mean_std(0), n_chk(0), n_cells(0) {}
+	double rmse_chk_truth, rmse_chk_obs; //!< Bilinear prediction at checkpoints vs. true / observed height
+	double rmse_grid_truth;              //!< Cell means vs. true height at cell centers (surveyed cells)
+	double mean_std;                     //!< Mean posterior std of the surveyed cells
+	size_t n_chk, n_cells;
+};
+
+static void run_scale(size_t N, CPerfReport &perf, TAccuracy &acc)
+{
+	const unsigned last_stage = arg_last_stage.getValue();
+	char tag[32];
+	snprintf(tag,sizeof(tag),"%.0e:",double(N));
+	const std::string sTag(tag);
+	auto stage_enter = [&](const char *stage) { perf.enter(sTag+stage); };
+	auto stage_leave = [&](const char *stage, double items, const char *unit) { perf.leave(sTag+stage, items, unit); };
+
+	TSyntheticTerrainOptions topts;
+	topts.num_points   = N;
+	topts.density      = arg_density.getValue();
+	topts.amplitude    = arg_amplitude.getValue();
+	topts.wavelength   = arg_wavelength.getValue();
+	topts.hurst        = arg_hurst.getValue();
+	topts.noise_std    = arg_noise.getValue();
+	topts.gap_fraction = arg_gaps.getValue();
+	topts.footprint    = footprint_from_string(arg_footprint.getValue());
+	topts.seed         = arg_seed.getValue();
+	const CSyntheticTerrain terrain(topts);
+
+	printf("\n== %.0e points: %.0fx%.0f m square, %s footprint, %.0f%% gaps\n", double(N), terrain.getSide(), terrain.getSide(),
+		arg_footprint.getValue().c_str(), 100*topts.gap_fraction);
+
+	mrpt::math::CMatrix xyz;
+	stage_enter("0.generate");
+	terrain.generatePoints(xyz);
+	stage_leave("0.generate", N, "points");
+
+	if (arg_with_io.isSet())
+	{
+		const std::string sFile = arg_out_prefix.getValue() + std::string("_synthetic.xyz");
+		save_xyz(xyz, sFile);
+		mrpt::math::CMatrix().swap(xyz);
+		TPointsBBox bb;
+		stage_enter("1.load_dataset");
+		load_xyz_file(sFile, xyz, bb);
+		stage_leave("1.load_dataset", N, "points");
+	}
+
+	stage_enter("2.bbox");
+	const TPointsBBox bbox = compute_bbox(xyz);
+	stage_leave("2.bbox", N, "points");
+	if (last_stage<3) return;
+
+	stage_enter("3.select_chkpts");
+	TCheckpointOptions chk_opts;
+	chk_opts.ratio = arg_checkpoints_ratio.getValue();
+	std::mt19937 rng(topts.seed);
+	std::vector<size_t> pts_indices;
+	const size_t N_chk_pts = select_checkpoints(xyz, bbox.minx,bbox.maxx,bbox.miny,bbox.maxy, chk_opts, rng, pts_indices);
+	const size_t N_insert_pts = N - N_chk_pts;
+	stage_leave("3.select_chkpts", N, "points");
+	if (last_stage<4) return;
+
+	stage_enter("4.dem_map_init");
+	const double RESOLUTION = arg_resolution.getValue();
+	const TGridGeometry geom = TGridGeometry::FromLimits(bbox.minx-RESOLUTION,bbox.maxx+RESOLUTION,bbox.miny-RESOLUTION,bbox.maxy+RESOLUTION,RESOLUTION);
+	const double total_cells = double(geom.size_x)*geom.size_y;
+	CGmrfDemSolver solver(geom.size_x, geom.size_y);
+	stage_leave("4.dem_map_init", total_cells, "cells");
+	if (last_stage<5) return;
+
+	stage_enter("5.dem_map_insert_points");
+	const double lambda_obs = 1.0/mrpt::utils::square(arg_std_observations.getValue());
+	for (size_t k=0;k<N_insert_pts;k++)
+	{
+		const size_t i = pts_indices[k];
+		solver.addObservation(size_t((xyz(i,0)-geom.x_min)/geom.resolution), size_t((xyz(i,1)-geom.y_min)/geom.resolution), xyz(i,2), lambda_obs);
+	}
+	stage_leave("5.dem_map_insert_points", N_insert_pts, "points");
+	if (last_stage<6) return;
+
+	stage_enter("6.dem_map_update_gmrf");
+	CGmrfDemSolver::TOptions sopts;
+	sopts.lambda_prior    = 1.0/mrpt::utils::square(arg_std_prior.getValue());
+	sopts.skip_variance   = arg_skip_variance.isSet();
+	sopts.mixed_precision = arg_solver.getValue()=="mixed";
+	solver.solve(sopts);
+	CSoADemGrid<double> dem;
+	dem.setSize(geom);
+	{
+		const std::vector<size_t> &cells = solver.getUnknownCells();
+		for (size_t v=0;v<cells.size();v++)
+			dem.setCell(cells[v], solver.getMean()[v], solver.getStd()[v]);
+	}
+	stage_leave("6.dem_map_update_gmrf", total_cells, "cells");
+	for (size_t i=0;i<solver.getProfile().size();i++)
+		perf.addNested(solver.getProfile()[i].name, solver.getProfile()[i].wall);
+	if (last_stage<7) return;
+
+	stage_enter("7.eval_chkpts");
+	const TDemGridView view = dem.getView();
+	std::vector<double> xs(N_chk_pts), ys(N_chk_pts);
+	for (size_t k=0;k<N_chk_pts;k++)
+	{
+		const size_t i = pts_indices[N_insert_pts+k];
+		xs[k] = xyz(i,0); ys[k] = xyz(i,1);
+	}
+	TBatchPrediction pred;
+	if (N_chk_pts) predict_batch(view, &xs[0], &ys[0], N_chk_pts, pred);
+	stage_leave("7.eval_chkpts", N_chk_pts, "points");
+
+	// Accuracy (not timed):
+	double se_truth=0, se_obs=0;
+	for (size_t k=0;k<N_chk_pts;k++)
+	{
+		const double z_obs = xyz(pts_indices[N_insert_pts+k],2);
+		se_truth += mrpt::utils::square(pred.z_bi[k]-terrain.height(xs[k],ys[k]));
+		se_obs   += mrpt::utils::square(pred.z_bi[k]-z_obs);
+	}
+	acc.n_chk = N_chk_pts;
+	acc.rmse_chk_truth = N_chk_pts ? std::sqrt(se_truth/N_chk_pts) : 0;
+	acc.rmse_chk_obs   = N_chk_pts ? std::sqrt(se_obs/N_chk_pts) : 0;
+	{
+		// Surveyed cells, subsampled to at most ~1e6:
+		const size_t step = std::max<size_t>(1, size_t(std::sqrt(total_cells/1e6)));
+		double se=0, sum_std=0;
+		size_t n=0;
+		for (size_t cy=0;cy<geom.size_y;cy+=step)
+			for (size_t cx=0;cx<geom.size_x;cx+=step)
+			{
+				const double x = geom.x_min+(cx+0.5)*geom.resolution, y = geom.y_min+(cy+0.5)*geom.resolution;
+				if (!terrain.isSurveyed(x,y)) continue;
+				const size_t c = cx+cy*geom.size_x;
+				se += mrpt::utils::square(dem.getCellMean(c)-terrain.height(x,y));
+				sum_std += dem.getCellStd(c);
+				n++;
+			}
+		acc.n_cells = n;
+		acc.rmse_grid_truth = n ? std::sqrt(se/n) : 0;
+		acc.mean_std = n ? sum_std/n : 0;
+	}
+
+	if (arg_save_dem.isSet() && last_stage>=9)
+	{
+		stage_enter("9.save_points");
+		save_dem_grid_text(view, arg_out_prefix.getValue() + std::string("_") + sTag.substr(0,sTag.size()-1) + std::string("_grmf"), -9999);
+		stage_leave("9.save_points", total_cells, "cells");
+	}
+}
+
+int dem_gmrf_bench_main(int argc, char **argv)
+{
+	if (!cmd.parse( argc, argv )) // Parse arguments:
+		return 1; // should exit.
+
+	printf(" dem-gmrf-bench (C) University of Almeria\n");
+	printf("-------------------------------------------------------------------\n");
+
+	CThreadPool::Instance().setup(arg_threads.getValue(), arg_pin_threads.isSet());
+	printf("Threads: %u%s\n", (unsigned)CThreadPool::Instance().getConcurrency(), CThreadPool::Instance().isPinned() ? " (pinned)" : "");
+	if (arg_solver.getValue()!="native" && arg_solver.getValue()!="mixed")
+		THROW_EXCEPTION(std::string("Unknown solver: ")+arg_solver.getValue());
+
+	const std::vector<size_t> scales = parse_scales(arg_points.getValue());
+	CPerfReport perf;
+	for (size_t s=0;s<scales.size();s++)
+	{
+		const size_t first = perf.getStages().size();
+		TAccuracy acc;
+		run_scale(scales[s], perf, acc);
+
+		printf("%-30s %10s %10s %12s %14s\n", "stage", "wall[s]", "cpu[s]", "peakRSS[MB]", "throughput[/s]");
+		for (size_t i=first;i<perf.getStages().size();i++)
+		{
+			const CPerfReport::TEntry &e = perf.getStages()[i];
+			printf("%-30s %10.3f %10.3f %12.1f %14.4e %s\n", e.name.c_str(), e.wall, e.cpu, e.rss_peak/1048576.0,
+				e.wall>0 ? e.items/e.wall : 0.0, e.items_unit.c_str());
+			for (size_t j=0;j<e.children.size();j++)
+				printf("  %-28s %10.3f\n", e.children[j].name.c_str(), e.children[j].wall);
+		}
+		if (acc.n_chk || acc.n_cells)
+			printf("Accuracy: RMSE chk-truth=%.4f  chk-obs=%.4f (%u chkpts)  grid-truth=%.4f  mean std=%.4f (%u cells) [m]\n",
+				acc.rmse_chk_truth, acc.rmse_chk_obs, (unsigned)acc.n_chk, acc.rmse_grid_truth, acc.mean_std, (unsigned)acc.n_cells);
+
+		char key[64];
+		snprintf(key,sizeof(key),"%.0e:accuracy",double(scales[s]));
+		char val[256];
+		snprintf(val,sizeof(val),"rmse_chk_truth=%.6f rmse_chk_obs=%.6f rmse_grid_truth=%.6f mean_std=%.6f",
+			acc.rmse_chk_truth, acc.rmse_chk_obs, acc.rmse_grid_truth, acc.mean_std);
+		perf.setInfo(key, val);
+	}
+
+	if (arg_perf_report.isSet())
+	{
+		perf.saveToJSON(arg_perf_report.getValue());
+		printf("\nReport saved to `%s`\n", arg_perf_report.getValue().c_str());
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	try {
+		return dem_gmrf_bench_main(argc,argv);
+	} catch (exception &e) {
+		cerr << "Exception:\n" << e.what() << endl;
+		return 1;
+	}
+}
@@ -0,0 +1,258 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+// Microbenchmarks of the hot kernels of dem-gmrf over fixed-size fixtures:
+// each kernel is timed over several repetitions and reported in ns/op, where
+// an "op" is one point or one cell, so runs at different sizes are comparable.
+
+#include <mrpt/maps/CHeightGridMap2D_MRF.h>
+#include <mrpt/math/CMatrix.h>
+#include <mrpt/otherlibs/tclap/CmdLine.h>
+#include <mrpt/system/filesystem.h>
+#include <mrpt/system/os.h>
+#include <mrpt/utils/CFileOutputStream.h>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <functional>
+
+#include "synthetic_terrain.h"
+#include "dem_predict.h"
+#include "dem_grid_io.h"
+#include "gmrf_solver.h"
+#include "soa_dem_grid.h"
+#include "thread_pool.h"
+#include "xyz_loader.h"
+
+using namespace mrpt;
+using namespace mrpt::maps;
+using namespace mrpt::utils;
+using namespace std;
+
+// Declare the supported options.
+TCLAP::CmdLine cmd("dem-gmrf-microbench", ' ', mrpt::system::MRPT_getVersion().c_str());
+
+TCLAP::ValueArg<std::string>  arg_filter("","filter","Only run the kernels whose name contains this text",false,"","solve",cmd);
+TCLAP::ValueArg<unsigned int> arg_reps("","reps","Timed repetitions of each kernel (Default=10)",false,10,"10",cmd);
+TCLAP::ValueArg<unsigned int> arg_threads("","threads","Number of threads (Default=1, so that per-op times are comparable)",false,1,"1",cmd);
+TCLAP::SwitchArg              arg_quick("","quick","Small fixtures and 3 repetitions (smoke test, e.g. under CTest)",cmd);
+
+static double now_s()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool selected(const std::string &name)
+{
+	return arg_filter.getValue().empty() || name.find(arg_filter.getValue())!=std::string::npos;
+}
+
+// Temporary file name, whose file is deleted when it goes out of scope:
+struct TTempFile
+{
+	const std::string name;
+	TTempFile() : name(mrpt::system::getTempFileName()) {}
+	~TTempFile() { mrpt::system::deleteFile(name); }
+};
+
+/** Times `func` (after one warm-up run) over `reps` repetitions, each one
+  * processing `ops` points or cells, and prints the ns/op statistics. `setup`
+  * runs before each repetition, out of the timed region. */
+static void bench(const std::string &name, double ops, const std::function<void()> &func, const std::function<void()> &setup = std::function<void()>())
+{
+	if (!selected(name))
+		return;
+	const unsigned reps = arg_quick.isSet() ? 3 : std::max(1u,arg_reps.getValue());
+	std::vector<double> ns_op;
+	for (unsigned r=0;r<=reps;r++)
+	{
+		if (setup) setup();
+		const double t0 = now_s();
+		func();
+		const double dt = now_s()-t0;
+		if (r>0) ns_op.push_back(1e9*dt/ops); // r=0: warm-up
+	}
+	double mean=0, var=0, mn=ns_op[0];
+	for (size_t i=0;i<ns_op.size();i++) { mean+=ns_op[i]; mn=std::min(mn,ns_op[i]); }
+	mean/=ns_op.size();
+	for (size_t i=0;i<ns_op.size();i++) var+=mrpt::utils::square(ns_op[i]-mean);
+	var/= std::max<size_t>(1,ns_op.size()-1);
+	printf("%-38s %12.2f %10.2f %12.2f %10.0f\n", name.c_str(), mean, std::sqrt(var), mn, ops);
+}
+
+// Square grid of `side` cells with one observation per cell, solved:
+static void make_solved_grid(size_t side, const CSyntheticTerrain &terrain, CSoADemGrid<double> &dem)
+{
+	TGridGeometry g;
+	g.x_min = 0; g.y_min = 0; g.resolution = 1.0; g.size_x = g.size_y = side;
+	CGmrfDemSolver solver(side,side);
+	for (size_t cy=0;cy<side;cy++)
+		for (size_t cx=0;cx<side;cx++)
+			solver.addObservation(cx,cy,terrain.height(cx+0.5,cy+0.5),25.0);
+	CGmrfDemSolver::TOptions opts;
+	solver.solve(opts);
+	dem.setSize(g);
+	for (size_t v=0;v<solver.getUnknownCells().size();v++)
+		dem.setCell(solver.getUnknownCells()[v], solver.getMean()[v], solver.getStd()[v]);
+}
+
+int dem_gmrf_microbench_main(int argc, char **argv)
+{
+	if (!cmd.parse( argc, argv )) // Parse arguments:
+		return 1; // should exit.
+
+	CThreadPool::Instance().setup(arg_threads.getValue(), false);
+	const bool quick = arg_quick.isSet();
+	const size_t N_PTS = quick ? 20000 : 1000000;
+
+	// Fixtures:
+	TSyntheticTerrainOptions topts;
+	topts.num_points = N_PTS;
+	topts.density = 1.0;
+	const CSyntheticTerrain terrain(topts);
+	mrpt::math::CMatrix xyz;
+	terrain.generatePoints(xyz);
+
+	printf("dem-gmrf-microbench: %u thread(s), %u repetitions\n", (unsigned)CThreadPool::Instance().getConcurrency(), quick ? 3u : arg_reps.getValue());
+	printf("%-38s %12s %10s %12s %10s\n", "kernel", "ns/op", "std", "min", "ops");
+
+	// --- Parsing & bbox (op = point) ---
+	if (selected("parse/load_xyz_file"))
+	{
+		// The text fixture is only written if needed, to a temporary file:
+		const TTempFile fixture;
+		{
+			CFileOutputStream f(fixture.name);
+			for (size_t i=0;i<N_PTS;i++) f.printf("%.3f %.3f %.3f\n", xyz(i,0), xyz(i,1), xyz(i,2));
+		}
+		mrpt::math::CMatrix m;
+		TPointsBBox bb;
+		bench("parse/load_xyz_file", N_PTS, [&]() { load_xyz_file(fixture.name, m, bb); });
+	}
+	bench("bbox/compute_bbox", N_PTS, [&]() { compute_bbox(xyz); });
+
+	// --- Insertion at several densities (op = point) ---
+	const double densities[] = { 0.5, 2.0, 8.0 }; // points per cell
+	for (size_t d=0;d<sizeof(densities)/sizeof(densities[0]);d++)
+	{
+		const size_t side = std::max<size_t>(2, size_t(std::sqrt(N_PTS/densities[d])));
+		const double scale = side/terrain.getSide();
+		std::unique_ptr<CGmrfDemSolver> solver;
+		char name[64];
+		snprintf(name,sizeof(name),"insert/native/%.1f_pts_per_cell", densities[d]);
+		bench(name, N_PTS,
+			[&]() {
+				for (size_t i=0;i<N_PTS;i++)
+					solver->addObservation(std::min(side-1,size_t(xyz(i,0)*scale)), std::min(side-1,size_t(xyz(i,1)*scale)), xyz(i,2), 25.0);
+			},
+			[&]() { solver.reset(new CGmrfDemSolver(side,side)); });
+	}
+	{
+		const size_t N_MRPT = N_PTS/10;
+		const size_t side = std::max<size_t>(2, size_t(std::sqrt(N_MRPT/2.0)));
+		const double scale = side/terrain.getSide();
+		std::unique_ptr<CHeightGridMap2D_MRF> map;
+		bench("insert/mrpt/2.0_pts_per_cell", N_MRPT,
+			[&]() {
+				for (size_t i=0;i<N_MRPT;i++)
+					map->insertIndividualReading(xyz(i,2), mrpt::math::TPoint2D(xyz(i,0)*scale,xyz(i,1)*scale), false, true, 0.2);
+			},
+			[&]() {
+				map.reset(new CHeightGridMap2D_MRF(CRandomFieldGridMap2D::mrGMRF_SD, 0,1, 0,1, 0.5, false));
+				const TRandomFieldCell def(0,0);
+				map->setSize(0,side,0,side,1.0,&def);
+			});
+	}
+
+	// --- Solve at several grid sizes (op = cell) ---
+	const size_t sides[] = { 64, 128, 256 };
+	for (size_t k=0;k<sizeof(sides)/sizeof(sides[0]);k++)
+	{
+		const size_t side = quick ? sides[k]/4 : sides[k];
+		for (int with_var=0;with_var<2;with_var++)
+		{
+			std::unique_ptr<CGmrfDemSolver> solver;
+			char name[64];
+			snprintf(name,sizeof(name),"solve/native/%ux%u%s", (unsigned)side, (unsigned)side, with_var ? "+var" : "");
+			CGmrfDemSolver::TOptions opts;
+			opts.skip_variance = !with_var;
+			bench(name, double(side*side),
+				[&]() { solver->solve(opts); },
+				[&]() {
+					solver.reset(new CGmrfDemSolver(side,side));
+					for (size_t c=0;c<side*side;c+=3) // One observation every 3 cells
+						solver->addObservation(c%side, c/side, terrain.height(c%side,c/side), 25.0);
+				});
+		}
+		if (side>128) continue; // The MRPT solver always computes the variance
+		std::unique_ptr<CHeightGridMap2D_MRF> map;
+		char name[64];
+		snprintf(name,sizeof(name),"solve/mrpt/%ux%u+var", (unsigned)side, (unsigned)side);
+		bench(name, double(side*side),
+			[&]() { map->updateMapEstimation(); },
+			[&]() {
+				map.reset(new CHeightGridMap2D_MRF(CRandomFieldGridMap2D::mrGMRF_SD, 0,1, 0,1, 0.5, false));
+				map->insertionOptions.GMRF_lambdaObs = 25.0;
+				const TRandomFieldCell def(0,0);
+				map->setSize(0,side,0,side,1.0,&def);
+				for (size_t c=0;c<side*side;c+=3)
+					map->insertIndividualReading(terrain.height(c%side,c/side), mrpt::math::TPoint2D(c%side+0.5,c/side+0.5), false, true, 0.2);
+			});
+	}
+
+	// --- Batch prediction (op = point) and serialization (op = cell) ---
+	{
+		const size_t side = quick ? 64 : 512;
+		CSoADemGrid<double> dem;
+		make_solved_grid(side, terrain, dem);
+		const size_t N_PRED = N_PTS/10;
+		std::vector<double> xs(N_PRED), ys(N_PRED);
+		for (size_t i=0;i<N_PRED;i++) {
+			xs[i] = xyz(i,0)*side/terrain.getSide();
+			ys[i] = xyz(i,1)*side/terrain.getSide();
+		}
+		TBatchPrediction pred;
+		bench("predict/batch/soa", N_PRED, [&]() { predict_batch(dem.getView(), &xs[0], &ys[0], N_PRED, pred); });
+
+		CHeightGridMap2D_MRF map(CRandomFieldGridMap2D::mrGMRF_SD, 0,1, 0,1, 0.5, false);
+		const TRandomFieldCell def(0,0);
+		map.setSize(0,side,0,side,1.0,&def);
+		for (size_t c=0;c<side*side;c++) {
+			map.cellByIndex(c%side,c/side)->gmrf_mean = dem.getCellMean(c);
+			map.cellByIndex(c%side,c/side)->gmrf_std  = dem.getCellStd(c);
+		}
+		bench("predict/batch/mrpt_cells", N_PRED, [&]() { predict_batch(TDemGridView::FromMap(map), &xs[0], &ys[0], N_PRED, pred); });
+		bench("predict/mrpt/predictMeasurement", N_PRED, [&]()
+		{
+			double m, s;
+			for (size_t i=0;i<N_PRED;i++) {
+				map.predictMeasurement(xs[i],ys[i],m,s,false,CRandomFieldGridMap2D::gimNearest);
+				map.predictMeasurement(xs[i],ys[i],m,s,false,CRandomFieldGridMap2D::gimBilinear);
+			}
+		});
+
+		const TTempFile out; // Prefix of the output files, also temporary
+		const std::string &sOut = out.name;
+		bench("write/save_dem_grid_text", double(side*side), [&]() { save_dem_grid_text(dem.getView(), sOut, -9999); });
+		bench("write/mrpt/saveMetricMapRepresentation", double(side*side), [&]() { map.saveMetricMapRepresentationToFile(sOut); });
+		const char *files[] = { "_grid_limits.txt", "_mean.txt", "_mean_std.txt" };
+		for (size_t i=0;i<sizeof(files)/sizeof(files[0]);i++)
+			remove((sOut+files[i]).c_str());
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	try {
+		return dem_gmrf_microbench_main(argc,argv);
+	} catch (exception &e) {
+		cerr << "Exception:\n" << e.what() << endl;
+		return 1;
+	}
+}
@@ -0,0 +1,233 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+// Long-running DEM service: accepts one JSON job per line on a Unix domain
+// socket and answers each with one JSON line, keeping parsed point clouds,
+// solver orderings and the planner calibration warm between jobs.
+
+#include <mrpt/otherlibs/tclap/CmdLine.h>
+#include <mrpt/system/os.h>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dem_jobs.h"
+#include "json_value.h"
+#include "thread_pool.h"
+
+using namespace std;
+
+// Declare the supported options.
+TCLAP::CmdLine cmd("dem-gmrf-server", ' ', mrpt::system::MRPT_getVersion().c_str());
+
+TCLAP::ValueArg<std::string>  arg_socket("s","socket","Path of the Unix domain socket to listen on (Default=/tmp/dem-gmrf.sock)",false,"/tmp/dem-gmrf.sock","/tmp/dem-gmrf.sock",cmd);
+TCLAP::ValueArg<unsigned int> arg_max_jobs("","max-jobs","Maximum number of jobs solved at once; the rest wait in arrival order (Default=2)",false,2,"2",cmd);
+TCLAP::ValueArg<double>       arg_mem_budget("","mem-budget",
+	"Memory for running jobs [GB], as estimated by the resource planner: jobs wait until theirs fits, and jobs larger "
+	"than the whole budget are rejected (Default=0, 3/4 of the physical memory minus the point cache)",false,0.0,"0",cmd);
+TCLAP::ValueArg<double>       arg_point_cache("","point-cache","Memory for parsed point clouds kept between jobs [GB] (Default=4)",false,4.0,"4",cmd);
+TCLAP::ValueArg<unsigned int> arg_ordering_cache("","ordering-cache","Number of solver orderings (one per grid size and set of active cells) kept between jobs (Default=64)",false,64,"64",cmd);
+TCLAP::ValueArg<std::string>  arg_solver("","solver","Default GMRF solver of the jobs: `mrpt`, `native` or `mixed` (Default=native)",false,"native","native",cmd);
+TCLAP::ValueArg<std::string>  arg_grid_storage("","grid-storage","Default DEM grid storage of the jobs: `dense`, `soa`, `compact` or `sparse` (Default=soa)",false,"soa","soa",cmd);
+TCLAP::ValueArg<unsigned int> arg_threads("","threads","Number of threads shared by all jobs (Default=0, one per hardware thread)",false,0,"0",cmd);
+TCLAP::SwitchArg              arg_pin_threads("","pin-threads","Bind each thread to one CPU of the process affinity mask",cmd);
+
+static std::atomic<bool> g_stop(false);
+
+static void on_signal(int)
+{
+	g_stop = true;
+}
+
+// Open client connections, shut down at exit to unblock their readers:
+static std::mutex g_conns_mtx;
+static std::condition_variable g_conns_cv;
+static std::set<int> g_conns;
+
+static bool send_line(int fd, const std::string &line)
+{
+	const std::string msg = line + "\n";
+	size_t sent = 0;
+	while (sent<msg.size())
+	{
+		const ssize_t n = ::send(fd, msg.data()+sent, msg.size()-sent, 0);
+		if (n<=0) return false;
+		sent += size_t(n);
+	}
+	return true;
+}
+
+static std::string handle_request(CDemJobRunner &runner, const TDemGmrfOptions &defaults, const std::string &line)
+{
+	std::string id;
+	try
+	{
+		const CJsonValue req = CJsonValue::Parse(line);
+		if (!req.isObject())
+			throw std::runtime_error("A request must be a JSON object");
+		id = req.get("id", "");
+		const std::string cmd_name = req.get("cmd", "job");
+		if (cmd_name=="ping")
+			return "{\"ok\": true}";
+		if (cmd_name=="stats")
+			return runner.getStatsJSON();
+		if (cmd_name=="shutdown") {
+			g_stop = true;
+			return "{\"ok\": true}";
+		}
+		if (cmd_name!="job")
+			throw std::runtime_error("Unknown command `"+cmd_name+"`");
+
+		const TDemJob job = TDemJob::FromJSON(req, defaults);
+		const TDemJobResult r = runner.run(job);
+		printf("[server] Job `%s`: %u points, %ux%u cells, %.3f s (queued %.3f s)%s%s\n", job.id.c_str(),
+			(unsigned)r.points, (unsigned)r.size_x, (unsigned)r.size_y, r.wall_s, r.queued_s,
+			r.points_cached ? " [cached points]" : "", r.ordering_reused ? " [cached ordering]" : "");
+		return r.toJSON();
+	}
+	catch (std::exception &e)
+	{
+		printf("[server] Request `%s` failed: %s\n", id.c_str(), e.what());
+		return "{\"ok\": false, \"id\": " + json_quote(id) + ", \"error\": " + json_quote(e.what()) + "}";
+	}
+}
+
+static void serve_connection(int fd, CDemJobRunner &runner, const TDemGmrfOptions &defaults)
+{
+	std::string buf;
+	char chunk[4096];
+	bool open = true;
+	while (open)
+	{
+		const ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+		if (n<=0) break;
+		buf.append(chunk, size_t(n));
+		size_t eol;
+		while (open && (eol = buf.find('\n'))!=std::string::npos)
+		{
+			const std::string line = buf.substr(0,eol);
+			buf.erase(0,eol+1);
+			if (line.find_first_not_of(" \t\r")==std::string::npos) continue;
+			open = send_line(fd, handle_request(runner, defaults, line));
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lk(g_conns_mtx); // Before close(): the fd number may be reused at once
+		g_conns.erase(fd);
+		g_conns_cv.notify_all();
+	}
+	::close(fd);
+}
+
+int dem_gmrf_server_main(int argc, char **argv)
+{
+	if (!cmd.parse( argc, argv )) // Parse arguments:
+		return 1; // should exit.
+
+	printf(" dem-gmrf-server (C) University of Almeria\n");
+	printf(" Powered by %s - BUILD DATE %s\n", mrpt::system::MRPT_getVersion().c_str(), mrpt::system::MRPT_getCompilationDate().c_str());
+	printf("-------------------------------------------------------------------\n");
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	TDemGmrfOptions defaults;
+	defaults.solver = arg_solver.getValue();
+	defaults.grid_storage = arg_grid_storage.getValue();
+	CDemGmrfPipeline check_defaults(defaults); // Validates them
+
+	CThreadPool::Instance().setup(arg_threads.getValue(), arg_pin_threads.isSet());
+	Eigen::setNbThreads(int(CThreadPool::Instance().getConcurrency()));
+
+	const double GB = 1024.0*1024.0*1024.0;
+	CDemJobRunner::TOptions ropts;
+	ropts.max_jobs = arg_max_jobs.getValue();
+	ropts.point_cache_bytes = uint64_t(arg_point_cache.getValue()*GB);
+	ropts.max_orderings = arg_ordering_cache.getValue();
+	if (arg_mem_budget.getValue()>0)
+		ropts.mem_budget_bytes = uint64_t(arg_mem_budget.getValue()*GB);
+	else ropts.mem_budget_bytes = uint64_t(std::max(0.0, 0.75*CResourcePlanner::PhysicalMemory()-double(ropts.point_cache_bytes)));
+	printf("Threads: %u%s  Max. jobs: %u  Memory budget: %.2f GB  Point cache: %.2f GB\n",
+		(unsigned)CThreadPool::Instance().getConcurrency(), CThreadPool::Instance().isPinned() ? " (pinned)" : "",
+		(unsigned)ropts.max_jobs, ropts.mem_budget_bytes/GB, ropts.point_cache_bytes/GB);
+
+	CDemJobRunner runner(ropts);
+	printf("[server] Calibrating the resource planner...\n");
+	runner.calibrate();
+
+	const std::string sock_path = arg_socket.getValue();
+	sockaddr_un addr;
+	memset(&addr,0,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (sock_path.size()>=sizeof(addr.sun_path))
+		THROW_EXCEPTION("--socket path too long");
+	strcpy(addr.sun_path, sock_path.c_str());
+
+	// A stale socket of a previous server is replaced; any other file is not:
+	struct stat st;
+	if (::lstat(sock_path.c_str(), &st)==0)
+	{
+		if (!S_ISSOCK(st.st_mode))
+			THROW_EXCEPTION(std::string("--socket: `")+sock_path+"` exists and is not a socket");
+		::unlink(sock_path.c_str());
+	}
+	const int listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd<0 || ::bind(listen_fd, (sockaddr*)&addr, sizeof(addr))!=0 || ::listen(listen_fd, 64)!=0)
+		THROW_EXCEPTION(std::string("Cannot listen on `")+sock_path+"`: "+strerror(errno));
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+	printf("[server] Listening on `%s`\n", sock_path.c_str());
+
+	while (!g_stop)
+	{
+		pollfd pfd;
+		pfd.fd = listen_fd;
+		pfd.events = POLLIN;
+		if (::poll(&pfd, 1, 200)<=0) continue;
+		const int fd = ::accept(listen_fd, NULL, NULL);
+		if (fd<0) continue;
+		{
+			std::lock_guard<std::mutex> lk(g_conns_mtx);
+			g_conns.insert(fd);
+		}
+		std::thread(serve_connection, fd, std::ref(runner), std::cref(defaults)).detach();
+	}
+
+	printf("[server] Shutting down: waiting for running jobs...\n");
+	::close(listen_fd);
+	::unlink(sock_path.c_str());
+	{
+		// Running jobs still send their result; idle connections are closed:
+		std::unique_lock<std::mutex> lk(g_conns_mtx);
+		for (std::set<int>::const_iterator it=g_conns.begin();it!=g_conns.end();++it)
+			::shutdown(*it, SHUT_RD);
+		g_conns_cv.wait(lk, []() { return g_conns.empty(); });
+	}
+	printf("[server] %s\n", runner.getStatsJSON().c_str());
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	try {
+		return dem_gmrf_server_main(argc,argv);
+	} catch (exception &e) {
+		cerr << "Exception:\n" << e.what() << endl;
+		return 1;
+	}
+}
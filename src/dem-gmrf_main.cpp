@@ -6,22 +6,27 @@
    | Released under GNU GPL v3 License. See LICENSE file                       |
    +---------------------------------------------------------------------------+ */
 
-#include <mrpt/maps/CHeightGridMap2D_MRF.h>
 #include <mrpt/gui.h>
-#include <mrpt/random.h>
-#include <mrpt/math/CMatrix.h>
 #include <mrpt/otherlibs/tclap/CmdLine.h>
 #include <mrpt/system/os.h>
 #include <mrpt/system/filesystem.h>
+#include <mrpt/utils/CTicTac.h>
 #include <mrpt/utils/CTimeLogger.h>
-#include <mrpt/math/utils.h>
-#include <mrpt/utils/round.h>
-#include <mrpt/utils/CFileOutputStream.h>
-#include <mrpt/math/ops_containers.h>
-#include <mrpt/math/ops_vectors.h>
-#include <algorithm> // std::random_shuffle
-#include <ctime>     // std::time
-#include <cstdlib>   // std::rand, std::srand
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <set>
+#include <thread>
+
+#include "dem_gmrf_pipeline.h"
+#include "dem_grid_io.h"
+#include "dem_jobs.h"
+#include "dem_lod_mesh.h"
+#include "json_value.h"
+#include "thread_pool.h"
+#include "perf_report.h"
+#include "hw_counters.h"
 
 using namespace mrpt;
 using namespace mrpt::maps;
@@ -34,21 +39,189 @@ using namespace std;
 // Declare the supported options.
 TCLAP::CmdLine cmd("dem-gmrf", ' ', mrpt::system::MRPT_getVersion().c_str());
 
-TCLAP::ValueArg<std::string>  arg_in_file("i","input","Input dataset file: X,Y,Z points in plain text format",true,"","xyz.txt",cmd);
+TCLAP::ValueArg<std::string>  arg_in_file("i","input","Input dataset file: X,Y,Z points in plain text format (required unless --jobs)",false,"","xyz.txt",cmd);
 TCLAP::ValueArg<double>       arg_dem_resolution("r","resolution","Resolution (side length) of each cell in the DEM (meters)",false,1.0,"1.0",cmd);
 TCLAP::ValueArg<std::string>  arg_out_prefix("o","output-prefix","Prefix for all output filenames",false,"demgmrf_out","demgmrf_out",cmd);
 
 TCLAP::ValueArg<double>       arg_checkpoints_ratio("c","checkpoint-ratio",
 	"Ratio (1.0=all,0.0=none) of data points to use as checkpoints. "
 	"They will not be inserted in the DEM. (Default=0.01)",false,0.01,"0.01",cmd);
+TCLAP::ValueArg<std::string>  arg_checkpoints_mode("","chk-mode",
+	"Checkpoint selection: `random` (uniform), `stratified` (K points per cell of a coarse grid), "
+	"`blocks` (hold out whole grid blocks, for spatial cross-validation). (Default=random)",false,"random","random",cmd);
+TCLAP::ValueArg<double>       arg_checkpoints_cell("","chk-cell",
+	"Side length of the strata/blocks for `--chk-mode stratified|blocks` [meters]. "
+	"(Default=0, automatic from the checkpoint ratio)",false,0.0,"0.0",cmd);
+TCLAP::ValueArg<unsigned int> arg_checkpoints_per_cell("","chk-per-cell","Number of checkpoints per stratum for `--chk-mode stratified` (Default=1)",false,1,"1",cmd);
 
 TCLAP::ValueArg<double>       arg_std_prior("","std-prior","Standard deviation of the prior constraints (`smoothness` or `tolerance`of the terrain) [meters]",false,1.0,"1.0",cmd);
 TCLAP::ValueArg<double>       arg_std_observations("","std-obs","Default standard deviation of each XYZ point observation [meters]",false,0.20,"0.20",cmd);
 
+TCLAP::ValueArg<std::string>  arg_solver("","solver",
+	"GMRF solver: `mrpt` (CHeightGridMap2D_MRF::updateMapEstimation), `native` (same model, only active cells "
+	"are unknowns) or `mixed` (native, with a float32 factorization and double precision iterative refinement). "
+	"Active-cell masking implies `native`. (Default=mrpt)",false,"mrpt","mrpt",cmd);
+TCLAP::ValueArg<double>       arg_border("","border","Margin added around the bbox of the data [meters] (Default=10.0)",false,10.0,"10.0",cmd);
+TCLAP::ValueArg<double>       arg_mask_dist("","mask-dist",
+	"Only solve cells within this distance of some data point; the rest are written as no-data (omitted with sparse storage) [meters]. "
+	"(Default=0, no distance mask)",false,0.0,"0.0",cmd);
+TCLAP::ValueArg<std::string>  arg_aoi("","aoi","Area of interest polygon: text file with one `X Y` vertex per row. Points and cells outside it are discarded",false,"","aoi.txt",cmd);
+TCLAP::ValueArg<std::string>  arg_grid_storage("","grid-storage",
+	"DEM grid storage: `dense` (whole bbox), `soa` (whole bbox, as separate mean/std planes; implies `--solver native`) "
+	"or `sparse` (only 64x64 cell blocks containing or bordering data, for corridor surveys; implies `--solver native`). "
+	"(Default=dense)",false,"dense","dense",cmd);
+TCLAP::SwitchArg              arg_rotate_grid("","rotate-grid",
+	"Build the DEM grid aligned with the principal axes of the XY point cloud, to minimize its area for oblique "
+	"survey blocks. The transform is saved to `<prefix>_grmf_georef.txt`",cmd);
+TCLAP::SwitchArg              arg_north_up("","north-up","With --rotate-grid, also resample the DEM to a north-up grid (`<prefix>_grmf_northup_*`)",cmd);
+TCLAP::ValueArg<double>       arg_tin("","tin",
+	"Also export the DEM as a triangulated irregular network (TIN) whose height differs from the mean grid by at most "
+	"this vertical tolerance at every cell center [meters] (`<prefix>_grmf_tin.ply`) (Default=0, no TIN)",false,0.0,"0.05",cmd);
+TCLAP::ValueArg<std::string>  arg_tin_format("","tin-format","File format of --tin: `ply` (binary), `obj` or `both` (Default=ply)",false,"ply","ply",cmd);
+TCLAP::ValueArg<std::string>  arg_derivatives("","derivatives",
+	"Also write terrain derivatives of the mean, computed in one pass over the grid: comma-separated list of `slope`, `aspect`, "
+	"`curvature`, `hillshade` and `slope_std`, or `all` (`<prefix>_grmf_slope.txt`...). See README",false,"","slope,hillshade",cmd);
+TCLAP::ValueArg<double>       arg_sun_azimuth("","sun-azimuth","Sun azimuth for --derivatives hillshade [deg, clockwise from north] (Default=315)",false,315.0,"315",cmd);
+TCLAP::ValueArg<double>       arg_sun_elevation("","sun-elevation","Sun elevation for --derivatives hillshade [deg] (Default=45)",false,45.0,"45",cmd);
+TCLAP::SwitchArg              arg_compact_grid("","compact-grid",
+	"Store the DEM as float32 mean/std planes relative to a Z origin (8 bytes/cell instead of 40). "
+	"Implies `--grid-storage soa`",cmd);
+TCLAP::ValueArg<double>       arg_nodata("","nodata","Value written for cells outside the active mask (Default=-9999)",false,-9999.0,"-9999",cmd);
+
+TCLAP::ValueArg<unsigned int> arg_threads("","threads","Number of threads shared by all pipeline stages (Default=0, one per hardware thread)",false,0,"0",cmd);
+TCLAP::SwitchArg              arg_pin_threads("","pin-threads",
+	"Bind each thread to one CPU of the process affinity mask, to pack several jobs on a node "
+	"(e.g. `taskset -c 0-15 dem-gmrf --threads 16 --pin-threads ...`)",cmd);
+
+TCLAP::ValueArg<std::string>  arg_perf_report("","perf-report",
+	"Save wall/CPU time, peak RSS, I/O bytes and throughput of each stage to this JSON file. "
+	"With --jobs, each job writes its own report to `<job output prefix>_perf.json` instead",false,"","perf.json",cmd);
+TCLAP::SwitchArg              arg_hw_counters("","hw-counters",
+	"Count cycles, instructions, LLC/dTLB/branch misses of each stage and thread (Linux perf_event_open), "
+	"print IPC and miss rates, and add them to --perf-report",cmd);
+
+TCLAP::SwitchArg              arg_plan("","plan",
+	"Load the points, print the predicted unknowns, factor fill, peak memory and run time of each solver/storage "
+	"strategy, and exit without solving",cmd);
+TCLAP::ValueArg<double>       arg_mem_budget("","mem-budget",
+	"Memory budget [GB]. If the requested --solver/--grid-storage is predicted to exceed it, the fastest strategy "
+	"with the same outputs that fits is used instead; if none fits, the job stops before building the DEM. (Default=0, no budget). "
+	"With --jobs, the memory shared by the running jobs (Default=0, 3/4 of the physical memory)",false,0.0,"0",cmd);
+
+TCLAP::ValueArg<std::string>  arg_jobs("","jobs",
+	"Batch mode: run the DEM jobs listed in this JSON manifest in one process, several at once, instead of --input. "
+	"The other options are the defaults of the jobs. See README",false,"","manifest.json",cmd);
+TCLAP::ValueArg<unsigned int> arg_max_jobs("","max-jobs","With --jobs: maximum number of jobs solved at once (Default=2)",false,2,"2",cmd);
+
 TCLAP::SwitchArg              arg_skip_variance("","skip-variance", "Skip variance estimation",cmd);
+TCLAP::SwitchArg              arg_loo("","loo",
+	"Analytic leave-one-out cross-validation: all points are inserted in the DEM (no checkpoints) "
+	"and the LOO residual of each one is obtained in closed form from the GMRF posterior. Requires variance estimation.",cmd);
+TCLAP::SwitchArg              arg_no_residual_files("","no-residual-files", "Do not write the per-checkpoint residuals; only their statistics (streaming evaluation, residuals are never stored in memory)",cmd);
 TCLAP::SwitchArg              arg_no_gui("","no-gui", "Do not show the graphical window with the 3D visualization at end.",cmd);
 
-void do_residuals_stats(const Eigen::VectorXd & r, Eigen::VectorXd &stats, std::string & file_hdr);
+// --jobs: runs the jobs of a manifest with CDemJobRunner, sharing the thread
+// pool, the parsed points and the solver orderings between them. Up to
+// --max-jobs jobs run at once, admitted in manifest order by their planned
+// memory, so single-threaded stages of one job overlap the others.
+static int run_jobs_manifest(const TDemGmrfOptions &cmdline_opts)
+{
+	const std::string manifest_file = arg_jobs.getValue();
+	const CJsonValue manifest = CJsonValue::ParseFile(manifest_file);
+
+	// Either [job, ...] or {"defaults": {...}, "jobs": [job, ...]}:
+	TDemJob defaults;
+	defaults.opts = cmdline_opts;
+	defaults.residual_files = !arg_no_residual_files.isSet();
+	const CJsonValue *job_list = &manifest;
+	if (manifest.isObject())
+	{
+		for (size_t i=0;i<manifest.members().size();i++)
+			if (manifest.members()[i].first!="defaults" && manifest.members()[i].first!="jobs")
+				THROW_EXCEPTION(manifest_file+": unknown member `"+manifest.members()[i].first+"` (expected `defaults` and `jobs`)");
+		if (manifest.has("defaults"))
+			defaults = TDemJob::FromJSON(manifest["defaults"], defaults);
+		job_list = &manifest["jobs"];
+	}
+	if (!job_list->isArray())
+		THROW_EXCEPTION(manifest_file+": expected an array of jobs");
+
+	// All jobs are checked before running any:
+	std::vector<TDemJob> jobs(job_list->size());
+	std::set<std::string> prefixes;
+	for (size_t k=0;k<jobs.size();k++)
+	{
+		TDemJob &job = jobs[k];
+		try
+		{
+			job = TDemJob::FromJSON((*job_list)[k], defaults);
+			if (job.input.empty())
+				throw std::runtime_error("missing `input`");
+			if (job.id.empty())
+				job.id = mrpt::format("job%u", (unsigned)k);
+			if (job.output_prefix.empty())
+				job.output_prefix = arg_out_prefix.getValue() + "_" + job.id;
+			if (!prefixes.insert(job.output_prefix).second)
+				throw std::runtime_error("`output_prefix` used by another job: `"+job.output_prefix+"`");
+			if (job.perf_report.empty() && arg_perf_report.isSet())
+				job.perf_report = job.output_prefix + "_perf.json";
+			if (job.opts.loo && job.opts.skip_variance)
+				throw std::runtime_error("`loo` requires the posterior variance");
+			CDemGmrfPipeline check(job.opts); // Validates the solver and grid storage
+		}
+		catch (std::exception &e)
+		{
+			THROW_EXCEPTION(mrpt::format("%s: job #%u: %s", manifest_file.c_str(), (unsigned)k, e.what()));
+		}
+	}
+
+	const double GB = 1024.0*1024.0*1024.0;
+	CDemJobRunner::TOptions ropts;
+	ropts.max_jobs = std::max(1u, arg_max_jobs.getValue());
+	if (arg_mem_budget.getValue()>0)
+		ropts.mem_budget_bytes = uint64_t(arg_mem_budget.getValue()*GB);
+	else if (CResourcePlanner::PhysicalMemory())
+		ropts.mem_budget_bytes = uint64_t(0.75*CResourcePlanner::PhysicalMemory());
+	else ropts.mem_budget_bytes = std::numeric_limits<uint64_t>::max();
+	// Tiles cut from the same input reuse its parsed points:
+	ropts.point_cache_bytes = ropts.mem_budget_bytes/8;
+	ropts.mem_budget_bytes -= ropts.point_cache_bytes;
+
+	printf("\n[jobs] %u jobs from `%s`. Max. concurrent jobs: %u  Memory budget: %.2f GB\n",
+		(unsigned)jobs.size(), manifest_file.c_str(), (unsigned)ropts.max_jobs, ropts.mem_budget_bytes/GB);
+	CDemJobRunner runner(ropts);
+	printf("[jobs] Calibrating the resource planner...\n");
+	runner.calibrate();
+
+	CTicTac batch_timer;
+	std::atomic<size_t> next_job(0), failed(0);
+	std::vector<std::thread> workers;
+	for (size_t w=0;w<std::min(ropts.max_jobs, jobs.size());w++)
+		workers.push_back(std::thread([&]()
+		{
+			for (size_t k; (k = next_job++)<jobs.size(); )
+			{
+				const TDemJob &job = jobs[k];
+				try
+				{
+					const TDemJobResult r = runner.run(job);
+					printf("[jobs] %u/%u `%s`: %u points, %ux%u cells, %s/%s, %.2f GB planned, %.3f s (queued %.3f s)%s\n",
+						(unsigned)k+1, (unsigned)jobs.size(), job.id.c_str(), (unsigned)r.points, (unsigned)r.size_x, (unsigned)r.size_y,
+						r.solver.c_str(), r.grid_storage.c_str(), r.job_bytes/GB, r.wall_s, r.queued_s, r.points_cached ? " [cached points]" : "");
+				}
+				catch (std::exception &e)
+				{
+					failed++;
+					printf("[jobs] %u/%u `%s` failed: %s\n", (unsigned)k+1, (unsigned)jobs.size(), job.id.c_str(), e.what());
+				}
+			}
+		}));
+	for (size_t w=0;w<workers.size();w++)
+		workers[w].join();
+
+	printf("[jobs] Done: %u succeeded, %u failed in %.3f s\n", (unsigned)(jobs.size()-failed), (unsigned)failed, batch_timer.Tac());
+	return failed ? 1 : 0;
+}
 
 int dem_gmrf_main(int argc, char **argv)
 {
@@ -56,220 +229,277 @@ int dem_gmrf_main(int argc, char **argv)
 		return 1; // should exit.
 
 	mrpt::utils::CTimeLogger timlog;
+	CPerfReport perf;
+	CHwCounters hw_counters;
+	bool perf_report = arg_perf_report.isSet();
+	CDemGmrfPipeline::TStageHooks hooks;
+	hooks.enter = [&](const char *stage)
+	{
+		timlog.enter(stage);
+		if (perf_report) perf.enter(stage);
+	};
+	hooks.leave = [&](const char *stage, double items, const char *items_unit)
+	{
+		timlog.leave(stage);
+		if (perf_report) perf.leave(stage, items, items_unit);
+	};
 
 	printf(" dem-gmrf (C) University of Almeria\n");
 	printf(" Powered by %s - BUILD DATE %s\n", MRPT_getVersion().c_str(), MRPT_getCompilationDate().c_str());
 	printf("-------------------------------------------------------------------\n");
 
+	if (arg_loo.isSet() && arg_skip_variance.isSet())
+		THROW_EXCEPTION("--loo requires the posterior variance: it cannot be used with --skip-variance");
+	if (arg_loo.isSet() && arg_checkpoints_ratio.isSet())
+		printf("Warning: --checkpoint-ratio ignored in --loo mode: all points are inserted in the DEM.\n");
+	if (arg_north_up.isSet() && (!arg_rotate_grid.isSet() || arg_grid_storage.getValue()=="sparse"))
+		THROW_EXCEPTION("--north-up requires --rotate-grid and non-sparse (dense, soa or compact) grid storage");
+	if (arg_compact_grid.isSet() && arg_grid_storage.getValue()=="sparse")
+		THROW_EXCEPTION("--compact-grid cannot be combined with `--grid-storage sparse`");
+	if (arg_tin.getValue()<0 || (arg_tin.getValue()>0 && arg_grid_storage.getValue()=="sparse"))
+		THROW_EXCEPTION("--tin requires a positive tolerance and dense, soa or compact grid storage");
+	if (arg_tin_format.getValue()!="ply" && arg_tin_format.getValue()!="obj" && arg_tin_format.getValue()!="both")
+		THROW_EXCEPTION("--tin-format must be `ply`, `obj` or `both`");
+	TDemDerivativeOptions deriv_opts;
+	if (arg_derivatives.isSet())
+	{
+		deriv_opts.products = dem_derivatives_from_string(arg_derivatives.getValue());
+		deriv_opts.sun_azimuth = arg_sun_azimuth.getValue();
+		deriv_opts.sun_elevation = arg_sun_elevation.getValue();
+		if (arg_grid_storage.getValue()=="sparse")
+			THROW_EXCEPTION("--derivatives requires dense, soa or compact grid storage");
+		if ((deriv_opts.products & derSlopeStd) && arg_skip_variance.isSet())
+			THROW_EXCEPTION("--derivatives slope_std requires the posterior variance: it cannot be used with --skip-variance");
+	}
+
+	TDemGmrfOptions opts;
+	opts.resolution    = arg_dem_resolution.getValue();
+	opts.border        = arg_border.getValue();
+	opts.std_prior     = arg_std_prior.getValue();
+	opts.std_obs       = arg_std_observations.getValue();
+	opts.checkpoints.mode      = checkpoint_mode_from_string(arg_checkpoints_mode.getValue());
+	opts.checkpoints.ratio     = arg_checkpoints_ratio.getValue();
+	opts.checkpoints.cell_size = arg_checkpoints_cell.getValue();
+	opts.checkpoints.per_cell  = arg_checkpoints_per_cell.getValue();
+	opts.solver        = arg_solver.getValue();
+	opts.grid_storage  = arg_compact_grid.isSet() ? "compact" : arg_grid_storage.getValue();
+	opts.mask_dist     = arg_mask_dist.getValue();
+	if (arg_aoi.isSet())
+		opts.aoi.loadFromTextFile(arg_aoi.getValue());
+	opts.rotate_grid   = arg_rotate_grid.isSet();
+	opts.skip_variance = arg_skip_variance.isSet();
+	opts.loo           = arg_loo.isSet();
+	opts.mem_budget_gb = arg_mem_budget.getValue();
+	opts.nodata        = arg_nodata.getValue();
+
+	// Validates the solver and grid storage, which --mem-budget may change after planning:
+	CDemGmrfPipeline dem(opts);
+	dem.setStageHooks(hooks);
+
+	CThreadPool::Instance().setup(arg_threads.getValue(), arg_pin_threads.isSet());
+	Eigen::setNbThreads(int(CThreadPool::Instance().getConcurrency()));
+	printf("Threads: %u%s\n", (unsigned)CThreadPool::Instance().getConcurrency(), CThreadPool::Instance().isPinned() ? " (pinned)" : "");
+
+	if (arg_jobs.isSet())
+	{
+		if (arg_in_file.isSet())
+			THROW_EXCEPTION("--input and --jobs are exclusive: list the inputs in the manifest");
+		if (arg_plan.isSet() || arg_north_up.isSet() || arg_hw_counters.isSet() || arg_tin.isSet() || arg_derivatives.isSet())
+			printf("Warning: --plan, --north-up, --hw-counters, --tin and --derivatives are ignored with --jobs.\n");
+		return run_jobs_manifest(opts);
+	}
+	if (!arg_in_file.isSet())
+		THROW_EXCEPTION("Either --input or --jobs is required");
+	if (arg_hw_counters.isSet())
+	{
+		if (hw_counters.open(CThreadPool::Instance().getThreadIds())) {
+			perf.setHwCounters(&hw_counters);
+			perf_report = true;
+		}
+		else printf("Warning: --hw-counters: perf_event_open() failed (check /proc/sys/kernel/perf_event_paranoid). Ignoring.\n");
+	}
+
 	const std::string sDataFile = arg_in_file.getValue();
 	ASSERT_FILE_EXISTS_(sDataFile);
 	const string sPrefix = arg_out_prefix.getValue();
 
 	printf("\n[1] Loading `%s`...\n", sDataFile.c_str());
-	timlog.enter("1.load_dataset");
-
-	CMatrix raw_xyz;
-	raw_xyz.loadFromTextFile(sDataFile.c_str());
-	const size_t N = raw_xyz.rows(), nCols = raw_xyz.cols();
-	printf("[1] Done. Points: %7u  Columns: %3u\n", (unsigned int)N, (unsigned int)nCols);
-
-	timlog.leave("1.load_dataset");
-	ASSERT_(nCols>=3);
-
-	// File types: 
-	// * 3 columns: x y z
-	// * 4 columns: x y z stddev 
-	// Z: 1e+38 error en raster (preguntar no data)
-	const bool all_readings_same_stddev = nCols==3;
+	dem.loadPoints(sDataFile);
+	const size_t N_loaded = dem.getPointCount();
+	printf("[1] Done. Points: %7u  Columns: %3u\n", (unsigned int)N_loaded, (unsigned int)dem.getPoints().cols());
 
 	// ---------------
 	printf("\n[2] Determining bounding box...\n");
-	timlog.enter("2.bbox");
-
-	double minx = std::numeric_limits<double>::max();
-	double miny = std::numeric_limits<double>::max();
-	double minz = std::numeric_limits<double>::max();
-	double maxx = -std::numeric_limits<double>::max();
-	double maxy = -std::numeric_limits<double>::max();
-	double maxz = -std::numeric_limits<double>::max();
-
-	for (size_t i=0;i<N;i++)
-	{
-		const mrpt::math::TPoint3D pt( raw_xyz(i,0),raw_xyz(i,1),raw_xyz(i,2) );
-		mrpt::utils::keep_max(maxx,pt.x); mrpt::utils::keep_min(minx,pt.x);
-		mrpt::utils::keep_max(maxy,pt.y); mrpt::utils::keep_min(miny,pt.y);
-		if (std::abs(pt.z)<1e6) {
-			mrpt::utils::keep_max(maxz,pt.z); mrpt::utils::keep_min(minz,pt.z);
-		}
-	}
-
-	const double BORDER = 10.0;
-	minx-= BORDER; maxx += BORDER;
-	miny-= BORDER; maxy += BORDER;
-	minz-= BORDER; maxz += BORDER;
-
-	timlog.leave("2.bbox");
+	dem.computeBBox();
+	const size_t N = dem.getPointCount();
+	if (arg_aoi.isSet())
+		printf("[2] AOI with %u vertices: %u points outside discarded.\n", (unsigned)opts.aoi.xs.size(), (unsigned)dem.getAOIDiscardedCount());
+	if (dem.isRotated())
+		printf("[2] Grid rotated %.02f deg (principal axes). Bbox area: %.03e -> %.03e m^2\n", dem.getGridFrame().angle*180.0/M_PI, dem.getAreaWorld(), dem.getAreaLocal());
+
+	const TPointsBBox &lim = dem.getLimits();
+	const double minx = lim.minx, maxx = lim.maxx;
+	const double miny = lim.miny, maxy = lim.maxy;
+	const double minz = lim.minz, maxz = lim.maxz;
 	printf("[2] Bbox: x=%11.2f <-> %11.2f (D=%11.2f)\n", minx,maxx,maxx-minx);
 	printf("[2] Bbox: y=%11.2f <-> %11.2f (D=%11.2f)\n", miny,maxy,maxy-miny);
 	printf("[2] Bbox: z=%11.2f <-> %11.2f (D=%11.2f)\n", minz,maxz,maxz-minz);
 
-
 	// ---------------
-	printf("\n[3] Picking random checkpoints...\n");
-	timlog.enter("3.select_chkpts");
+	printf("\n[3] Picking checkpoints...\n");
+	dem.selectCheckpoints();
+	const size_t N_chk_pts    = dem.getCheckpointCount();
+	const size_t N_insert_pts = dem.getInsertedCount();
+	if (dem.getCheckpointCellSize()>0)
+		printf("[3] Mode: %s  Cell size: %.02f m\n", arg_checkpoints_mode.getValue().c_str(), dem.getCheckpointCellSize());
+	printf("[3] Checkpoints: %9u (%.02f%%)  Rest of points: %9u\n", (unsigned)N_chk_pts, N ? 100.0*N_chk_pts/N : 0.0, (unsigned)N_insert_pts );
 
-	const double chkpts_ratio = arg_checkpoints_ratio.getValue();
-	ASSERT_(chkpts_ratio>=0.0 && chkpts_ratio <=1.0);
+	// ---------------
+	if (arg_plan.isSet() || arg_mem_budget.getValue()>0)
+	{
+		printf("\n[P] Planning memory and run time...\n");
+		const std::vector<TPlanEstimate> estimates = dem.plan();
+		CResourcePlanner::printTable(dem.getPlanInput(), estimates, arg_mem_budget.getValue()*1024.0*1024.0*1024.0);
 
-	// Generate a list with all indices, then keep the first "N-Nchk" for insertion in the map, "Nchk" as checkpoints
-	std::vector<size_t> pts_indices;
-	mrpt::math::linspace((size_t)0,N-1,N, pts_indices);
+		if (arg_plan.isSet())
+		{
+			printf("\n[P] --plan: exiting without building the DEM.\n");
+			return 0;
+		}
+		if (dem.applyMemBudget(estimates))
+			printf("[P] `%s` exceeds the budget: using `%s/%s` instead.\n", estimates[0].strategy.name().c_str(), dem.getSolver().c_str(), dem.getGridStorage().c_str());
+		else printf("[P] `%s` fits in the budget.\n", estimates[0].strategy.name().c_str());
+	}
 
-	std::srand (unsigned(std::time(0)));
-	std::random_shuffle(pts_indices.begin(), pts_indices.end());
-	const size_t N_chk_pts    = mrpt::utils::round( chkpts_ratio * N );
-	const size_t N_insert_pts = N - N_chk_pts;
+	const bool sparse_grid = dem.getGridStorage()=="sparse";
+	const bool soa_grid = dem.getGridStorage()=="soa" || dem.getGridStorage()=="compact";
 
-	timlog.leave("3.select_chkpts");
-	printf("[3] Checkpoints: %9u (%.02f%%)  Rest of points: %9u\n", (unsigned)N_chk_pts, 100.0*chkpts_ratio, (unsigned)N_insert_pts );
-	
 	// ---------------
 	printf("\n[4] Initializing RMF DEM map estimator...\n");
-	timlog.enter("4.dem_map_init");
-
-	const double RESOLUTION = arg_dem_resolution.getValue();
-
-	mrpt::maps::CHeightGridMap2D_MRF  dem_map( CRandomFieldGridMap2D::mrGMRF_SD /*map type*/, 0,1, 0,1, 0.5, false /* run_first_map_estimation_now */); // dummy initial size
-	
-	// Set map params:
-	dem_map.insertionOptions.GMRF_lambdaPrior = 1.0/ mrpt::utils::square( arg_std_prior.getValue() );
-	dem_map.insertionOptions.GMRF_lambdaObs   = 1.0/ mrpt::utils::square( arg_std_observations.getValue() );
-	dem_map.insertionOptions.GMRF_skip_variance = arg_skip_variance.isSet();
-
-	// Resize to actual map extension:
-	{
-		TRandomFieldCell def(0,0); // mean, std
-		dem_map.setSize(minx,maxx,miny,maxy,RESOLUTION,&def);
-	}
-
-	timlog.leave("4.dem_map_init");
+	dem.buildMap();
+	const double total_cells = dem.getTotalCells();
 	printf("[4] Done.\n");
-
-	dem_map.enableVerbose(true);
-	dem_map.enableProfiler(true);
+	if (sparse_grid)
+		printf("[4] Sparse grid: %u blocks of %ux%u cells\n", (unsigned)dem.getSparseBlockCount(), (unsigned)CSparseDemGrid::BLOCK, (unsigned)CSparseDemGrid::BLOCK);
+	if (dem.usesNativeSolver())
+		printf("[4] Active cells: %.0f of %.0f (%.02f%%)\n", dem.getSolvedCells(), total_cells, 100.0*dem.getSolvedCells()/total_cells);
 
 	// ---------------
 	printf("\n[5] Inserting %u points in DEM map...\n",(unsigned)N_insert_pts);
-	timlog.enter("5.dem_map_insert_points");
-
-	for (size_t k=0;k<N_insert_pts;k++)
-	{
-		const size_t i=pts_indices[k];
-		const mrpt::math::TPoint3D pt( raw_xyz(i,0),raw_xyz(i,1),raw_xyz(i,2) );
-		
-		double reading_stddev;
-		if (all_readings_same_stddev) {
-			reading_stddev = arg_std_observations.getValue();
-		}
-		else {
-			reading_stddev = raw_xyz(i, 3);
-		}
-
-		dem_map.insertIndividualReading(
-			pt.z, 
-			TPoint2D(pt.x,pt.y), 
-			false /* do not update map now */,
-			true /*time invariant*/, 
-			reading_stddev );
-	}
-	timlog.leave("5.dem_map_insert_points");
+	dem.insertPoints();
 	printf("[5] Done.\n");
 
 	// ---------------
-	printf("\n[6] Running GMRF estimator (cell count=%e)...\n",(double)(dem_map.getSizeX()*dem_map.getSizeY()));
-	timlog.enter("6.dem_map_update_gmrf");
-
-	dem_map.updateMapEstimation();
+	printf("\n[6] Running GMRF estimator (cell count=%e)...\n", dem.getSolvedCells());
 
-	timlog.leave("6.dem_map_update_gmrf");
+	// With SoA storage, the mean grid is written to disk while the solver is
+	// still computing the variance:
+	CTaskGroup mean_writer;
+	dem.solve([&](const TDemGridView &view)
+	{
+		mean_writer.run([&,view]() { save_dem_grid_mean_text(view, sPrefix + string("_grmf"), arg_nodata.getValue()); });
+	});
+	const CDemGmrfPipeline::TSolveInfo &si = dem.getSolveInfo();
+	if (si.mixed_requested)
+	{
+		if (si.used_mixed)
+			printf("[6] float32 factor + %d refinement steps, relative residual: %.03e\n", si.refine_iters, si.refine_residual);
+		else printf("[6] Iterative refinement did not converge: solved with a double precision factor.\n");
+	}
+	if (dem.usesNativeSolver())
+		printf("[6] Unknowns: %u  Observations: %u  Factor nnz: %u\n", (unsigned)si.unknowns, (unsigned)si.observations, (unsigned)si.factor_nnz);
+	for (size_t i=0;i<si.profile.size();i++)
+		perf.addNested(si.profile[i].name, si.profile[i].wall);
 	printf("[6] Done.\n");
 
+	const bool save_residuals = !arg_no_residual_files.isSet();
+
 	// ---------------
 	if (N_chk_pts)
 	{
 		printf("\n[7] Eval checkpoints...\n");
-		timlog.enter("7.eval_chkpts");
-
-		Eigen::VectorXd  residuals_NN(N_chk_pts), residuals_Bi(N_chk_pts);
-
-		for (size_t k=0;k<N_chk_pts;k++)
-		{
-			const size_t i=pts_indices[k+N_insert_pts];
-
-			// Neirest neighbor:
-			double dem_z_NN, dem_std_NN;
-			dem_map.predictMeasurement(raw_xyz(i,0),raw_xyz(i,1), dem_z_NN, dem_std_NN, false /* sensor normalization */, CRandomFieldGridMap2D::gimNearest);
-			residuals_NN[k] = raw_xyz(i,2) - dem_z_NN;
-
-			// Bilinear interp:
-			double dem_z_Bi, dem_std_Bi;
-			dem_map.predictMeasurement(raw_xyz(i,0),raw_xyz(i,1), dem_z_Bi, dem_std_Bi, false /* sensor normalization */, CRandomFieldGridMap2D::gimBilinear);
-			residuals_Bi[k] = raw_xyz(i,2) - dem_z_Bi;
-		}
-
-		// Residuals:
-		residuals_NN.saveToTextFile( sPrefix + string("_chkpt_residuals_NN.txt") );
-		residuals_Bi.saveToTextFile( sPrefix + string("_chkpt_residuals_Bi.txt") );
-
-		// Residuals stats:
-		std::string stats_hdr;
-		Eigen::VectorXd residuals_NN_stats,residuals_Bi_stats;
-		do_residuals_stats(residuals_NN, residuals_NN_stats,stats_hdr);
-		do_residuals_stats(residuals_Bi, residuals_Bi_stats,stats_hdr);
-
-		residuals_NN_stats.saveToTextFile( sPrefix + string("_chkpt_residuals_NN_stats.txt"), MATRIX_FORMAT_ENG, false, stats_hdr );
-		residuals_Bi_stats.saveToTextFile( sPrefix + string("_chkpt_residuals_Bi_stats.txt"), MATRIX_FORMAT_ENG, false, stats_hdr );
-
-		timlog.leave("7.eval_chkpts");
+		TResidualSet res_NN, res_Bi;
+		dem.evaluateCheckpoints(save_residuals, res_NN, res_Bi);
+		res_NN.saveToTextFiles(sPrefix + string("_chkpt_residuals_NN.txt"), sPrefix + string("_chkpt_residuals_NN_stats.txt"));
+		res_Bi.saveToTextFiles(sPrefix + string("_chkpt_residuals_Bi.txt"), sPrefix + string("_chkpt_residuals_Bi_stats.txt"));
 		printf("[7] Done.\n");
 	}
+	// ---------------
+	if (arg_loo.isSet() && N_insert_pts)
+	{
+		printf("\n[8] Eval leave-one-out residuals...\n");
+		TResidualSet res_LOO;
+		dem.evaluateLOO(save_residuals, res_LOO);
+		res_LOO.saveToTextFiles(sPrefix + string("_loo_residuals.txt"), sPrefix + string("_loo_residuals_stats.txt"));
+		printf("[8] Done. LOO RMSE: %.04f  Median: %.04f\n", res_LOO.stats[4], res_LOO.stats[5]);
+	}
+
 	// ---------------
 	printf("\n[9] Generate TXT output files...\n");
-	timlog.enter("9.save_points");
+	dem.exportAll(sPrefix, arg_north_up.isSet(), soa_grid /* The mean was written in [6] */);
+	mean_writer.wait();
+	if (arg_tin.getValue()>0 && sparse_grid)
+		printf("Warning: --tin ignored: the memory budget switched to sparse grid storage.\n");
+	else if (arg_tin.getValue()>0)
 	{
-		CFileOutputStream  fil_pts_map( sPrefix + string("_pts_map.txt") );
-		for (size_t k=0;k<N_insert_pts;k++)
-		{
-			const size_t i=pts_indices[k];
-			fil_pts_map.printf("%f, %f, %f\n",raw_xyz(i,0),raw_xyz(i,1),raw_xyz(i,2));
-		}
+		hooks.enter("9.tin");
+		TDemTin tin;
+		dem.buildTin(arg_tin.getValue(), tin);
+		if (arg_tin_format.getValue()!="obj") tin.saveToPLY(sPrefix + string("_grmf_tin.ply"));
+		if (arg_tin_format.getValue()!="ply") tin.saveToOBJ(sPrefix + string("_grmf_tin.obj"));
+		hooks.leave("9.tin", double(tin.getTriangleCount()), "triangles");
+		printf("[9] TIN: %u vertices (%.02f%% of the %u valid cells), %u triangles, max. vertical error %.04f m\n",
+			(unsigned)tin.getVertexCount(), tin.grid_vertices ? 100.0*tin.getVertexCount()/tin.grid_vertices : 0.0,
+			(unsigned)tin.grid_vertices, (unsigned)tin.getTriangleCount(), tin.max_error);
 	}
+	if (deriv_opts.products && sparse_grid)
+		printf("Warning: --derivatives ignored: the memory budget switched to sparse grid storage.\n");
+	else if (deriv_opts.products)
 	{
-		CFileOutputStream  fil_pts_chk( sPrefix + string("_pts_chk.txt") );
-		for (size_t k=0;k<N_chk_pts;k++)
-		{
-			const size_t i=pts_indices[k+N_insert_pts];
-			fil_pts_chk.printf("%f, %f, %f\n",raw_xyz(i,0),raw_xyz(i,1),raw_xyz(i,2));
-		}
+		hooks.enter("9.derivatives");
+		dem.saveDerivatives(sPrefix + string("_grmf"), deriv_opts);
+		hooks.leave("9.derivatives", dem.getTotalCells(), "cells");
+		printf("[9] Terrain derivatives: `%s`\n", arg_derivatives.getValue().c_str());
 	}
-
-	dem_map.saveMetricMapRepresentationToFile(sPrefix + string("_grmf") );
-	dem_map.saveAsMatlab3DGraph(sPrefix + string("_grmf_draw.m") );
-
-	timlog.leave("9.save_points");
 	printf("[9] Done.\n");
 
+	if (hw_counters.isOpen())
+	{
+		printf("\n");
+		perf.printHwSummary();
+	}
+	if (arg_perf_report.isSet())
+	{
+		perf.setInfo("input", sDataFile);
+		perf.setInfo("solver", dem.getSolver());
+		perf.setInfo("grid_storage", dem.getGridStorage());
+		perf.saveToJSON(arg_perf_report.getValue());
+		printf("\nPerformance report saved to `%s`\n", arg_perf_report.getValue().c_str());
+	}
+
 #if MRPT_HAS_WXWIDGETS
-	if (!arg_no_gui.isSet())
+	if (!arg_no_gui.isSet() && sparse_grid)
+		printf("\nThe 3D view is not available with sparse grid storage.\n");
+	else if (!arg_no_gui.isSet())
 	{
 		registerClass( CLASS_ID( CSetOfObjects ) );
 
-		// 3D view:
+		// 3D view: level-of-detail meshes of the grid, refined around the
+		// camera as it moves. The std view is only built once toggled on.
+		// Max. error: 2 pixels of the default 30 deg field of view, 480 px high:
+		const TDemGridView grid = dem.getGridView();
+		const double max_error = 2.0*2.0*tan(0.5*30.0*M_PI/180.0)/480.0;
+		CDemLodMesh lod_mean(grid, false, max_error);
+		std::unique_ptr<CDemLodMesh> lod_std;
+		printf("\n[3D] Level-of-detail mesh: %d levels of %ux%u cell tiles\n", lod_mean.getLevels()+1, (unsigned)CDemLodMesh::TILE, (unsigned)CDemLodMesh::TILE);
+
 		mrpt::opengl::CSetOfObjectsPtr glObj_mean = mrpt::opengl::CSetOfObjects::Create();
 		mrpt::opengl::CSetOfObjectsPtr glObj_var  = mrpt::opengl::CSetOfObjects::Create();
-		dem_map.getAs3DObject( glObj_mean, glObj_var );
-		glObj_mean->setLocation( -0.5*(minx+maxx), -0.5*(miny+maxy), -0.5*(minz+maxz) );
-		glObj_var->setLocation( -0.5*(minx+maxx) + 1.1*(maxx-minx), -0.5*(miny+maxy), -0.5*(minz+maxz) );
+		const double ox = -0.5*(minx+maxx), oy = -0.5*(miny+maxy), oz = -0.5*(minz+maxz);
+		const double var_dx = 1.1*(maxx-minx);
+		glObj_mean->setLocation( ox, oy, oz );
+		glObj_var->setLocation( ox + var_dx, oy, oz );
+		glObj_var->setVisibility(false);
 
 		mrpt::gui::CDisplayWindow3D win("Map",640,480);
 		win.setCameraZoom( mrpt::utils::max3( maxz-minz, maxx-minx, maxy-miny) );
@@ -277,38 +507,50 @@ int dem_gmrf_main(int argc, char **argv)
 		win.setMaxRange(1e7);
 		mrpt::opengl::COpenGLScenePtr &scene = win.get3DSceneAndLock();
 		scene->insert( glObj_mean );
-		//scene->insert( glObj_var );
+		scene->insert( glObj_var );
 		win.unlockAccess3DScene();
-		win.repaint();
 
-		win.waitForKey();
+		printf("[3D] Press `v` to toggle the std view (colored by std), any other key to exit.\n");
+		bool show_std = false, toggled = true;
+		while (win.isOpen())
+		{
+			if (win.keyHit())
+			{
+				const int key = win.getPushedKey();
+				if (key!='v' && key!='V') break;
+				show_std = !show_std;
+				toggled = true;
+				if (show_std && !lod_std)
+					lod_std.reset(new CDemLodMesh(grid, true, max_error));
+			}
+
+			// Camera position, in the frame of each grid object:
+			float px, py, pz;
+			win.getCameraPointingToPoint(px,py,pz);
+			const double az = win.getCameraAzimuthDeg()*M_PI/180.0, el = win.getCameraElevationDeg()*M_PI/180.0;
+			const double dist = win.getCameraZoom();
+			const double cam_x = px + dist*cos(el)*cos(az) - ox, cam_y = py + dist*cos(el)*sin(az) - oy, cam_z = pz + dist*sin(el) - oz;
+			bool changed = lod_mean.update(cam_x, cam_y, cam_z);
+			if (show_std)
+				changed = lod_std->update(cam_x - var_dx, cam_y, cam_z) || changed;
+
+			if (changed || toggled)
+			{
+				win.get3DSceneAndLock();
+				if (lod_mean.hasPendingChanges()) lod_mean.show(*glObj_mean);
+				if (lod_std && lod_std->hasPendingChanges()) lod_std->show(*glObj_var);
+				glObj_var->setVisibility(show_std);
+				win.unlockAccess3DScene();
+				win.repaint();
+				toggled = false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
 	}
 #endif
 	return 0;
 }
 
-void do_residuals_stats(const Eigen::VectorXd & r, Eigen::VectorXd &stats, std::string & file_hdr)
-{
-	file_hdr = "% MAX_ABS_ERR   MIN_ABS_ERR   AVERAGE_ERR   STD_DEV   RMSE    MEDIAN\n";
-
-	const size_t N = r.size();
-	stats.resize(6);
-	if (!N) return;
-
-	stats[0] = r.maxCoeff();
-	stats[1] = r.minCoeff();
-
-	mrpt::math::meanAndStd(r, stats[2], stats[3]);
-	// RMSE:
-	stats[4] = std::sqrt(  r.array().square().sum() / N );
-	
-	std::vector<double> v(N);
-	for (size_t i=0;i<N;i++) v[i]=r[i];
-	nth_element(v.begin(), v.begin()+(N/2), v.end());
-	stats[5] = v[N/2];
-}
-
-
 int main(int argc, char **argv)
 {
 	try {
@@ -0,0 +1,196 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "dem_derivatives.h"
+#include "dem_grid_io.h"
+#include "parallel_for.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+unsigned dem_derivatives_from_string(const std::string &s)
+{
+	unsigned products = 0;
+	size_t start = 0;
+	while (start<=s.size())
+	{
+		const size_t end = std::min(s.find(',',start), s.size());
+		const std::string name = s.substr(start, end-start);
+		if (name=="slope") products |= derSlope;
+		else if (name=="aspect") products |= derAspect;
+		else if (name=="curvature") products |= derCurvature;
+		else if (name=="hillshade") products |= derHillshade;
+		else if (name=="slope_std") products |= derSlopeStd;
+		else if (name=="all") products |= derSlope | derAspect | derCurvature | derHillshade | derSlopeStd;
+		else THROW_EXCEPTION(std::string("Unknown terrain derivative: `")+name+std::string("` (valid: slope|aspect|curvature|hillshade|slope_std|all)"));
+		start = end+1;
+	}
+	return products;
+}
+
+// Copies row `cy` of the mean (and std) into `z` (`s`), leaving one NaN cell
+// of padding at each end; rows outside the grid are all NaN.
+static void load_row(const TDemGridView &g, long cy, std::vector<double> &z, std::vector<double> *s)
+{
+	const double NaN = std::numeric_limits<double>::quiet_NaN();
+	std::fill(z.begin(), z.end(), NaN);
+	if (s) std::fill(s->begin(), s->end(), NaN);
+	if (cy<0 || size_t(cy)>=g.size_y) return;
+	if (g.isPlanar())
+	{
+		// Packed planes: plain loops over the row instead of a fetch() per cell
+		const size_t off = size_t(cy)*g.size_x;
+		if (g.is_float32) {
+			const float *pm = reinterpret_cast<const float*>(g.mean)+off, *ps = reinterpret_cast<const float*>(g.std)+off;
+			for (size_t cx=0;cx<g.size_x;cx++) z[cx+1] = g.z_origin + pm[cx];
+			if (s) for (size_t cx=0;cx<g.size_x;cx++) (*s)[cx+1] = ps[cx];
+		}
+		else {
+			const double *pm = reinterpret_cast<const double*>(g.mean)+off, *ps = reinterpret_cast<const double*>(g.std)+off;
+			for (size_t cx=0;cx<g.size_x;cx++) z[cx+1] = g.z_origin + pm[cx];
+			if (s) std::copy(ps, ps+g.size_x, s->begin()+1);
+		}
+		return;
+	}
+	for (size_t cx=0;cx<g.size_x;cx++)
+	{
+		double m, sd;
+		g.fetch(cx, size_t(cy), m, sd);
+		z[cx+1] = m;
+		if (s) (*s)[cx+1] = sd;
+	}
+}
+
+void compute_dem_derivatives(const TDemGridView &g, const TDemDerivativeOptions &opts, TDemDerivatives &out)
+{
+	if (!g.mean)
+		THROW_EXCEPTION("Terrain derivatives require a dense, SoA or compact grid storage");
+
+	const size_t nx = g.size_x, ny = g.size_y;
+	const float NaN = std::numeric_limits<float>::quiet_NaN();
+	out.size_x = nx;
+	out.size_y = ny;
+	std::vector<float> *planes[5] = { &out.slope, &out.aspect, &out.curvature, &out.hillshade, &out.slope_std };
+	for (unsigned k=0;k<5;k++)
+	{
+		if (opts.products & (1u<<k)) planes[k]->assign(nx*ny, NaN);
+		else std::vector<float>().swap(*planes[k]);
+	}
+	const bool need_std = (opts.products & derSlopeStd)!=0;
+
+	const double RAD2DEG = 180.0/M_PI, L = g.resolution;
+	const double inv_8L = 1.0/(8.0*L), inv_L2 = 1.0/(L*L), inv_64L2 = 1.0/(64.0*L*L);
+	const double rot_deg = opts.grid_rotation*RAD2DEG;
+	// Unit vector towards the sun, in the grid frame (x: +X of the grid, y: +Y):
+	const double sun_az = opts.sun_azimuth/RAD2DEG + opts.grid_rotation, sun_el = opts.sun_elevation/RAD2DEG;
+	const double sun_x = std::sin(sun_az)*std::cos(sun_el), sun_y = std::cos(sun_az)*std::cos(sun_el), sun_z = std::sin(sun_el);
+
+	// Bands of rows in parallel. Stencil (north up, +Y of the grid):
+	//   a b c
+	//   d e f
+	//   g h i
+	parallel_for(ny, [&](size_t y0, size_t y1)
+	{
+		std::vector<double> rz[3], rs[3], gx(nx), gy(nx);
+		for (int r=0;r<3;r++) {
+			rz[r].resize(nx+2);
+			if (need_std) rs[r].resize(nx+2);
+		}
+		int bot = 0, mid = 1, top = 2;
+		load_row(g, long(y0)-1, rz[bot], need_std ? &rs[bot] : NULL);
+		load_row(g, long(y0),   rz[mid], need_std ? &rs[mid] : NULL);
+		for (size_t cy=y0;cy<y1;cy++)
+		{
+			load_row(g, long(cy)+1, rz[top], need_std ? &rs[top] : NULL);
+			const double *N = &rz[top][1], *C = &rz[mid][1], *S = &rz[bot][1];
+			const size_t off = cy*nx;
+
+			// Horn's gradient, NaN unless the whole stencil is valid. Without
+			// branches, so that the loop vectorizes: (C-C) is 0, or NaN if C is.
+			for (size_t x=0;x<nx;x++)
+			{
+				const double nan_c = C[x]-C[x];
+				gx[x] = ((N[x+1]+2*C[x+1]+S[x+1]) - (N[x-1]+2*C[x-1]+S[x-1]))*inv_8L + nan_c;
+				gy[x] = ((N[x-1]+2*N[x]+N[x+1]) - (S[x-1]+2*S[x]+S[x+1]))*inv_8L + nan_c;
+			}
+			if (opts.products & derSlope)
+			{
+				float *o = &out.slope[off];
+				for (size_t x=0;x<nx;x++)
+					o[x] = float(std::atan(std::sqrt(gx[x]*gx[x]+gy[x]*gy[x]))*RAD2DEG);
+			}
+			if (opts.products & derAspect)
+			{
+				float *o = &out.aspect[off];
+				for (size_t x=0;x<nx;x++)
+				{
+					double a = std::fmod(std::atan2(-gx[x], -gy[x])*RAD2DEG - rot_deg + 720.0, 360.0);
+					if (gx[x]==0 && gy[x]==0) a = -1;
+					o[x] = float(a);
+				}
+			}
+			if (opts.products & derCurvature)
+			{
+				float *o = &out.curvature[off];
+				for (size_t x=0;x<nx;x++)
+				{
+					const double lap = (C[x-1]+C[x+1]-2*C[x] + N[x]+S[x]-2*C[x])*inv_L2;
+					o[x] = float(-lap + (gx[x]-gx[x]));
+				}
+			}
+			if (opts.products & derHillshade)
+			{
+				float *o = &out.hillshade[off];
+				for (size_t x=0;x<nx;x++)
+				{
+					const double cos_i = (sun_z - gx[x]*sun_x - gy[x]*sun_y)/std::sqrt(1.0+gx[x]*gx[x]+gy[x]*gy[x]);
+					o[x] = float(255.0*std::max(0.0, cos_i) + (gx[x]-gx[x]));
+				}
+			}
+			if (need_std)
+			{
+				// Variances of the two gradient components and their covariance,
+				// then of the gradient norm to first order, then of atan(norm):
+				const double *sN = &rs[top][1], *sC = &rs[mid][1], *sS = &rs[bot][1];
+				float *o = &out.slope_std[off];
+				for (size_t x=0;x<nx;x++)
+				{
+					const double va = sN[x-1]*sN[x-1], vb = sN[x]*sN[x], vc = sN[x+1]*sN[x+1];
+					const double vd = sC[x-1]*sC[x-1], vf = sC[x+1]*sC[x+1];
+					const double vg = sS[x-1]*sS[x-1], vh = sS[x]*sS[x], vi = sS[x+1]*sS[x+1];
+					const double var_x = (va+4*vd+vg + vc+4*vf+vi)*inv_64L2;
+					const double var_y = (va+4*vb+vc + vg+4*vh+vi)*inv_64L2;
+					const double cov = (vc+vg-va-vi)*inv_64L2;
+					const double g2 = gx[x]*gx[x]+gy[x]*gy[x];
+					const double var_g = g2>0 ? (gx[x]*gx[x]*var_x + gy[x]*gy[x]*var_y + 2*gx[x]*gy[x]*cov)/g2 : 0.5*(var_x+var_y);
+					o[x] = float(std::sqrt(std::max(0.0,var_g))/(1.0+g2)*RAD2DEG + (gx[x]-gx[x]));
+				}
+			}
+			const int old_bot = bot;
+			bot = mid; mid = top; top = old_bot;
+		}
+	}, 16);
+}
+
+void save_dem_derivatives_text(const TDemDerivatives &d, const std::string &prefix, double nodata)
+{
+	const std::vector<float> *planes[5] = { &d.slope, &d.aspect, &d.curvature, &d.hillshade, &d.slope_std };
+	const char *names[5] = { "_slope.txt", "_aspect.txt", "_curvature.txt", "_hillshade.txt", "_slope_std.txt" };
+	CTaskGroup tasks;
+	for (int k=0;k<5;k++)
+	{
+		if (planes[k]->empty()) continue;
+		const std::vector<float> *plane = planes[k];
+		const std::string file = prefix + std::string(names[k]);
+		tasks.run([&d, plane, file, nodata]() { save_grid_plane_text(&(*plane)[0], d.size_x, d.size_y, file, nodata); });
+	}
+	tasks.wait();
+}
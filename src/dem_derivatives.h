@@ -0,0 +1,68 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "dem_predict.h"
+
+/** Terrain products of compute_dem_derivatives(), as bit flags */
+enum TDemDerivative
+{
+	derSlope     = 1,  //!< [deg]
+	derAspect    = 2,  //!< Downslope direction [deg, clockwise from north], -1 on flat cells
+	derCurvature = 4,  //!< Minus the Laplacian of the height [1/m]: positive on convex cells (ridges), negative on concave ones (valleys)
+	derHillshade = 8,  //!< Lambertian shading for a sun at infinity, 0 (dark) to 255
+	derSlopeStd  = 16  //!< Std of the slope [deg], from the std of the cells
+};
+
+/** Parses a comma-separated list of `slope`, `aspect`, `curvature`,
+  * `hillshade` and `slope_std`, or `all`, into TDemDerivative flags */
+unsigned dem_derivatives_from_string(const std::string &s);
+
+struct TDemDerivativeOptions
+{
+	TDemDerivativeOptions() : products(0), sun_azimuth(315), sun_elevation(45), grid_rotation(0) {}
+
+	unsigned products;     //!< TDemDerivative flags
+	double sun_azimuth;    //!< Hillshade illumination: sun azimuth [deg, clockwise from north]
+	double sun_elevation;  //!< Hillshade illumination: sun elevation [deg above the horizon]
+	double grid_rotation;  //!< Angle of the grid +X axis w.r.t. world +X [rad] (TGridFrame::angle), so that aspect and sun azimuth refer to the true north
+};
+
+/** Row-major planes of the products requested (empty for the others), NaN
+  * where undefined */
+struct TDemDerivatives
+{
+	TDemDerivatives() : size_x(0), size_y(0) {}
+	size_t size_x, size_y;
+	std::vector<float> slope, aspect, curvature, hillshade, slope_std;
+};
+
+/** Computes terrain derivatives of the mean of `grid` in one pass over it:
+  * each thread sweeps a band of rows keeping the three rows of a 3x3 stencil
+  * in contiguous buffers, and all the products requested are derived from
+  * the same gradient (Horn's weights) and second differences, in plain loops
+  * over each row. The gradient and curvature loops are branch-free (NaN
+  * cells propagate through the arithmetic) and the compiler vectorizes them;
+  * the slope, aspect, hillshade and slope std loops call sqrt(), atan() or
+  * atan2() per cell, which stay scalar without -ffast-math.
+  *
+  * The slope std propagates the std of the nine cells to first order,
+  * assuming independent errors: since neighboring cells of the GMRF are
+  * positively correlated, it is an upper bound of the actual uncertainty.
+  * Cells whose stencil is incomplete (the grid border, or next to cells with
+  * a NaN mean) are NaN. */
+void compute_dem_derivatives(const TDemGridView &grid, const TDemDerivativeOptions &opts, TDemDerivatives &out);
+
+/** Writes each product computed as `<prefix>_slope.txt`, `_aspect.txt`,
+  * `_curvature.txt`, `_hillshade.txt` and `_slope_std.txt`, in the layout
+  * of `<prefix>_mean.txt` (see save_grid_plane_text()), in parallel */
+void save_dem_derivatives_text(const TDemDerivatives &d, const std::string &prefix, double nodata);
@@ -0,0 +1,625 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "dem_gmrf_pipeline.h"
+#include "dem_grid_io.h"
+#include "parallel_for.h"
+#include "perf_report.h"
+#include "residual_stats.h"
+#include "thread_pool.h"
+#include <mrpt/utils/CFileOutputStream.h>
+#include <mrpt/utils/round.h>
+#include <mrpt/math/ops_containers.h>
+#include <ctime>     // std::time
+#include <limits>
+#include <mutex>
+#include <unordered_set>
+
+using namespace mrpt::maps;
+using namespace mrpt::math;
+using namespace mrpt::utils;
+using namespace std;
+
+void TResidualSet::saveToTextFiles(const std::string &residuals_file, const std::string &stats_file) const
+{
+	if (residuals.size())
+		residuals.saveToTextFile(residuals_file);
+	stats.saveToTextFile(stats_file, MATRIX_FORMAT_ENG, false, CResidualStats::getStatsHeader());
+}
+
+CDemGmrfPipeline::CDemGmrfPipeline(const TDemGmrfOptions &opts) :
+	m_opts(opts),
+	m_ordering_cache(NULL),
+	m_stage(0),
+	m_have_moments(false),
+	m_aoi_discarded(0), m_area_world(0), m_area_local(0),
+	m_n_chk(0), m_chk_cell_size(0),
+	m_map(CRandomFieldGridMap2D::mrGMRF_SD /*map type*/, 0,1, 0,1, 0.5, false /* run_first_map_estimation_now */), // dummy initial size
+	m_use_mask(false)
+{
+	if (m_opts.loo && m_opts.skip_variance)
+		THROW_EXCEPTION("LOO evaluation requires the posterior variance: it cannot be used with skip_variance");
+	m_solver = m_opts.solver;
+	m_storage = m_opts.grid_storage;
+	if (m_solver!="mrpt" && m_solver!="native" && m_solver!="mixed")
+		THROW_EXCEPTION(std::string("Unknown solver: ")+m_solver);
+	if (m_storage!="dense" && m_storage!="soa" && m_storage!="compact" && m_storage!="sparse")
+		THROW_EXCEPTION(std::string("Unknown grid storage: ")+m_storage);
+	if (m_solver=="mrpt" && (m_storage!="dense" || m_opts.mask_dist>0 || !m_opts.aoi.xs.empty()))
+		m_solver = "native"; // Active-cell masking and non-MRPT grids need the native solver
+}
+
+void CDemGmrfPipeline::enterStage(int stage, const char *name)
+{
+	// Evaluation and export stages only need the solution:
+	if (m_stage<std::min(stage-1, 6))
+		THROW_EXCEPTION(mrpt::format("CDemGmrfPipeline: stage `%s` called before the previous ones", name));
+	if (m_hooks.enter) m_hooks.enter(name);
+}
+
+void CDemGmrfPipeline::leaveStage(int stage, const char *name, double items, const char *items_unit)
+{
+	m_stage = std::max(m_stage, stage);
+	if (m_hooks.leave) m_hooks.leave(name, items, items_unit);
+}
+
+void CDemGmrfPipeline::ownPoints()
+{
+	if (m_pts.data==m_owned_pts.data()) return;
+	m_owned_pts.setSize(m_pts.rows(), m_pts.cols());
+	for (size_t i=0;i<m_pts.rows();i++)
+		for (size_t k=0;k<m_pts.cols();k++)
+			m_owned_pts(i,k) = m_pts(i,k);
+	m_pts = TPointsView(m_owned_pts);
+}
+
+void CDemGmrfPipeline::loadPoints(const std::string &file)
+{
+	enterStage(1, "1.load_dataset");
+	// The bbox of the points is accumulated by the parser threads while loading:
+	load_xyz_file(file, m_owned_pts, m_data_bbox, m_opts.rotate_grid ? &m_moments : NULL);
+	m_have_moments = m_opts.rotate_grid;
+	m_pts = TPointsView(m_owned_pts);
+	ASSERT_(m_pts.cols()>=3);
+	m_stage = 0; // New points restart the pipeline
+	leaveStage(1, "1.load_dataset", m_pts.rows(), "points");
+}
+
+void CDemGmrfPipeline::setPoints(const TPointsView &pts)
+{
+	ASSERT_(pts.cols()>=3);
+	mrpt::math::CMatrix().swap(m_owned_pts);
+	m_pts = pts;
+	m_have_moments = false;
+	m_stage = 1; // New points restart the pipeline
+}
+
+void CDemGmrfPipeline::computeBBox()
+{
+	// The points are transformed in place (AOI, rotation): only once per set
+	if (m_stage>=2)
+		THROW_EXCEPTION("CDemGmrfPipeline: computeBBox() already called for these points; set or load them again to restart");
+	enterStage(2, "2.bbox");
+	const size_t N = m_pts.rows();
+	m_aoi_discarded = 0;
+	if (!m_owned_pts.rows() || m_pts.data!=m_owned_pts.data()) // In-memory points: bbox not computed while loading
+	{
+		m_data_bbox = compute_bbox(m_pts, m_opts.rotate_grid ? &m_moments : NULL);
+		m_have_moments = m_opts.rotate_grid;
+	}
+
+	m_aoi = m_opts.aoi;
+	if (!m_aoi.xs.empty())
+	{
+		ownPoints();
+		filter_points_by_polygon(m_owned_pts, m_aoi);
+		m_pts = TPointsView(m_owned_pts);
+		m_aoi_discarded = N-m_pts.rows();
+		m_data_bbox = compute_bbox(m_pts, m_opts.rotate_grid ? &m_moments : NULL);
+	}
+
+	// Optionally, build the grid in the frame of the principal axes of the
+	// data. From here on, all XY coordinates are in that local frame:
+	if (m_opts.rotate_grid)
+	{
+		ASSERT_(m_have_moments);
+		ownPoints();
+		m_frame = TGridFrame(m_moments.mx, m_moments.my, m_moments.principalAxisAngle());
+		m_area_world = (m_data_bbox.maxx-m_data_bbox.minx)*(m_data_bbox.maxy-m_data_bbox.miny);
+		m_frame.pointsToLocal(m_owned_pts);
+		if (!m_aoi.xs.empty()) m_frame.polygonToLocal(m_aoi);
+		m_data_bbox = compute_bbox(m_pts);
+		m_area_local = (m_data_bbox.maxx-m_data_bbox.minx)*(m_data_bbox.maxy-m_data_bbox.miny);
+	}
+
+	const double BORDER = m_opts.border;
+	m_limits = m_data_bbox;
+	m_limits.minx-= BORDER; m_limits.maxx += BORDER;
+	m_limits.miny-= BORDER; m_limits.maxy += BORDER;
+	m_limits.minz-= BORDER; m_limits.maxz += BORDER;
+	m_geom = TGridGeometry::FromLimits(m_limits.minx,m_limits.maxx,m_limits.miny,m_limits.maxy,m_opts.resolution);
+	leaveStage(2, "2.bbox", m_pts.rows(), "points");
+}
+
+std::vector<TPlanEstimate> CDemGmrfPipeline::plan(const CResourcePlanner *planner)
+{
+	enterStage(3, "P.plan");
+	m_plan_in = TPlanInput();
+	m_plan_in.geom = m_geom;
+	m_plan_in.num_obs = m_opts.loo ? m_pts.rows() : size_t(m_pts.rows()*(1.0-m_opts.checkpoints.ratio));
+	if (m_stage>=3) m_plan_in.num_obs = getInsertedCount();
+	m_plan_in.mask_dist = m_opts.mask_dist;
+	m_plan_in.aoi_area = m_aoi.xs.empty() ? 0.0 : m_aoi.area();
+	m_plan_in.skip_variance = m_opts.skip_variance;
+	m_plan_in.baseline_bytes = CPerfReport::TSample::Now().rss;
+	if (!m_plan_in.baseline_bytes) m_plan_in.baseline_bytes = uint64_t(m_pts.rows())*(m_pts.cols()*sizeof(float)+sizeof(size_t));
+	m_plan_in.sampleOccupancy(m_pts);
+
+	CResourcePlanner own_planner;
+	if (!planner) {
+		own_planner.calibrate();
+		planner = &own_planner;
+	}
+	const bool masked = m_storage!="sparse" && (m_opts.mask_dist>0 || !m_aoi.xs.empty());
+	const std::vector<TPlanStrategy> strategies = CResourcePlanner::alternatives(TPlanStrategy(m_solver,m_storage), masked);
+	std::vector<TPlanEstimate> estimates;
+	for (size_t i=0;i<strategies.size();i++)
+		estimates.push_back(planner->estimate(m_plan_in, strategies[i]));
+	if (m_hooks.leave) m_hooks.leave("P.plan", m_pts.rows(), "points");
+	return estimates;
+}
+
+bool CDemGmrfPipeline::applyMemBudget(const std::vector<TPlanEstimate> &estimates)
+{
+	const double budget = m_opts.mem_budget_gb*1024.0*1024.0*1024.0;
+	if (budget<=0 || estimates.empty() || estimates[0].peak_bytes<=budget)
+		return false;
+	// The fastest alternative within the budget:
+	int best = -1;
+	for (size_t i=1;i<estimates.size();i++)
+		if (estimates[i].peak_bytes<=budget && (best<0 || estimates[i].total_s<estimates[best].total_s))
+			best = int(i);
+	if (best<0)
+	{
+		double min_peak = estimates[0].peak_bytes;
+		for (size_t i=1;i<estimates.size();i++) min_peak = std::min(min_peak, estimates[i].peak_bytes);
+		THROW_EXCEPTION(mrpt::format("No solver/storage strategy fits in a memory budget of %.2f GB (the smallest needs %.2f GB). "
+			"Try a coarser resolution, a distance mask, sparse grid storage%s.",
+			m_opts.mem_budget_gb, min_peak/(1024.0*1024.0*1024.0), m_opts.skip_variance ? "" : " or skipping the variance"));
+	}
+	m_solver  = estimates[best].strategy.solver;
+	m_storage = estimates[best].strategy.storage;
+	return true;
+}
+
+void CDemGmrfPipeline::selectCheckpoints()
+{
+	enterStage(3, "3.select_chkpts");
+	TCheckpointOptions chk_opts = m_opts.checkpoints;
+	if (m_opts.loo) chk_opts.ratio = 0.0;
+
+	m_rng.seed(m_opts.seed ? m_opts.seed : unsigned(std::time(0)));
+
+	// Keep the first "N-Nchk" indices for insertion in the map, "Nchk" as checkpoints
+	m_n_chk = select_checkpoints(m_pts, m_limits.minx,m_limits.maxx,m_limits.miny,m_limits.maxy, chk_opts, m_rng, m_pts_indices, &m_chk_cell_size);
+	leaveStage(3, "3.select_chkpts", m_pts.rows(), "points");
+}
+
+void CDemGmrfPipeline::buildMap()
+{
+	enterStage(4, "4.dem_map_init");
+	const double RESOLUTION = m_opts.resolution;
+
+	// Set map params:
+	m_map.insertionOptions.GMRF_lambdaPrior = 1.0/ mrpt::utils::square( m_opts.std_prior );
+	m_map.insertionOptions.GMRF_lambdaObs   = 1.0/ mrpt::utils::square( m_opts.std_obs );
+	m_map.insertionOptions.GMRF_skip_variance = m_opts.skip_variance;
+
+	// Resize to actual map extension. With sparse or SoA storage, the MRPT map
+	// keeps its dummy size and cells live in `m_sparse_dem`, `m_soa_dem` or `m_compact_dem`:
+	const TPointsBBox &L = m_limits;
+	if (isSoA())
+	{
+		m_geom = TGridGeometry::FromLimits(L.minx,L.maxx,L.miny,L.maxy,RESOLUTION);
+		if (isCompact())
+			m_compact_dem.setSize(m_geom, mrpt::utils::round(0.5*(L.minz+L.maxz)) /* Z origin */);
+		else m_soa_dem.setSize(m_geom);
+	}
+	else if (!isSparse())
+	{
+		TRandomFieldCell def(0,0); // mean, std
+		m_map.setSize(L.minx,L.maxx,L.miny,L.maxy,RESOLUTION,&def);
+		m_geom.x_min = m_map.getXMin(); m_geom.y_min = m_map.getYMin();
+		m_geom.resolution = m_map.getResolution();
+		m_geom.size_x = m_map.getSizeX(); m_geom.size_y = m_map.getSizeY();
+	}
+	else
+	{
+		m_sparse_dem.setSize(L.minx,L.maxx,L.miny,L.maxy,RESOLUTION);
+		m_geom.x_min = m_sparse_dem.getXMin(); m_geom.y_min = m_sparse_dem.getYMin();
+		m_geom.resolution = m_sparse_dem.getResolution();
+		m_geom.size_x = m_sparse_dem.getSizeX(); m_geom.size_y = m_sparse_dem.getSizeY();
+	}
+
+	// Active cells: within the max. distance of the data and inside the AOI.
+	std::vector<size_t> active_cells;
+	m_use_mask = m_opts.mask_dist>0 || !m_aoi.xs.empty();
+	if (m_use_mask && !isSparse())
+	{
+		compute_active_mask(m_geom, m_pts, m_opts.mask_dist, m_aoi.xs.empty() ? NULL : &m_aoi, m_active_mask);
+		CGmrfDemSolver::maskToCellList(m_active_mask, active_cells);
+	}
+	if (isSparse())
+	{
+		// Materialize the blocks with data, plus a margin of neighbor blocks
+		// wide enough to cover the distance mask:
+		const double block_side = CSparseDemGrid::BLOCK*RESOLUTION;
+		const int margin = std::max(1, int(std::ceil(m_opts.mask_dist/block_side)));
+		// A block may already exist as the margin of another one: the blocks
+		// with data are tracked apart, so that each one gets its own margin.
+		// Cells left out by the mask stay NaN: they are not solved nor saved.
+		const double NaN = std::numeric_limits<double>::quiet_NaN();
+		const TRandomFieldCell def(m_use_mask ? NaN : 0, m_use_mask ? NaN : 0); // mean, std
+		std::unordered_set<uint64_t> data_blocks;
+		for (size_t i=0;i<m_pts.rows();i++)
+		{
+			const int cx = m_sparse_dem.x2idx(m_pts(i,0)), cy = m_sparse_dem.y2idx(m_pts(i,1));
+			const int bx = cx/int(CSparseDemGrid::BLOCK), by = cy/int(CSparseDemGrid::BLOCK);
+			if (!data_blocks.insert((uint64_t(uint32_t(by))<<32) | uint32_t(bx)).second) continue;
+			for (int dy=-margin;dy<=margin;dy++)
+				for (int dx=-margin;dx<=margin;dx++)
+					if (bx+dx>=0 && by+dy>=0) m_sparse_dem.insertBlock(bx+dx,by+dy,def);
+		}
+		m_sparse_dem.getCellList(active_cells);
+		if (m_use_mask)
+			filter_active_cells(m_geom, m_pts, m_opts.mask_dist, m_aoi.xs.empty() ? NULL : &m_aoi, active_cells);
+	}
+
+	if (usesNativeSolver())
+		m_solver_impl.reset(new CGmrfDemSolver(m_geom.size_x,m_geom.size_y, (m_use_mask || isSparse()) ? &active_cells : NULL));
+
+	m_map.enableVerbose(true);
+	m_map.enableProfiler(true);
+	leaveStage(4, "4.dem_map_init", getTotalCells(), "cells");
+}
+
+void CDemGmrfPipeline::insertPoints()
+{
+	enterStage(5, "5.dem_map_insert_points");
+	const size_t N_insert_pts = getInsertedCount();
+	for (size_t k=0;k<N_insert_pts;k++)
+	{
+		const size_t i=m_pts_indices[k];
+		const mrpt::math::TPoint3D pt( m_pts(i,0),m_pts(i,1),m_pts(i,2) );
+		const double reading_stddev = observationStd(i);
+
+		if (m_solver_impl) {
+			m_solver_impl->addObservation(int((pt.x-m_geom.x_min)/m_geom.resolution), int((pt.y-m_geom.y_min)/m_geom.resolution), pt.z, 1.0/mrpt::utils::square(reading_stddev));
+			continue;
+		}
+
+		m_map.insertIndividualReading(
+			pt.z,
+			mrpt::math::TPoint2D(pt.x,pt.y),
+			false /* do not update map now */,
+			true /*time invariant*/,
+			reading_stddev );
+	}
+	leaveStage(5, "5.dem_map_insert_points", N_insert_pts, "points");
+}
+
+double CDemGmrfPipeline::getSolvedCells() const
+{
+	if (m_solver_impl) return double(m_solver_impl->getUnknownsCount());
+	if (m_solve_info.unknowns) return double(m_solve_info.unknowns);
+	return getTotalCells();
+}
+
+void CDemGmrfPipeline::setInactiveCells(double value)
+{
+	if (!m_use_mask || isSoA() || isSparse()) return;
+	TRandomFieldCell *cells = m_map.cellByIndex(0,0);
+	for (size_t c=0;c<m_active_mask.size();c++)
+		if (!m_active_mask[c]) cells[c].gmrf_mean = cells[c].gmrf_std = value;
+}
+
+void CDemGmrfPipeline::solve(const std::function<void(const TDemGridView &)> &on_mean_ready)
+{
+	enterStage(6, "6.dem_map_update_gmrf");
+	const double solved_cells = getSolvedCells();
+	m_solve_info = TSolveInfo();
+	if (m_solver_impl)
+	{
+		CGmrfDemSolver &solver = *m_solver_impl;
+		CGmrfDemSolver::TOptions sopts;
+		sopts.lambda_prior  = m_map.insertionOptions.GMRF_lambdaPrior;
+		sopts.skip_variance = m_opts.skip_variance;
+		sopts.mixed_precision = m_solver=="mixed";
+		sopts.ordering_cache = m_ordering_cache;
+		if (isSoA())
+			sopts.on_mean_ready = [&]()
+			{
+				const std::vector<size_t> &cells = solver.getUnknownCells();
+				const std::vector<double> &sol_mean = solver.getMean();
+				for (size_t v=0;v<cells.size();v++)
+				{
+					if (isCompact()) m_compact_dem.setCellMean(cells[v], sol_mean[v]);
+					else m_soa_dem.setCellMean(cells[v], sol_mean[v]);
+				}
+				if (on_mean_ready) on_mean_ready(getGridView());
+			};
+		solver.solve(sopts);
+
+		// Copy the solution into the grid cells. Inactive cells are set to NaN,
+		// so predictions ignore them:
+		const std::vector<size_t> &cells = solver.getUnknownCells();
+		const std::vector<double> &sol_mean = solver.getMean(), &sol_std = solver.getStd();
+		if (isCompact())
+		{
+			for (size_t v=0;v<cells.size();v++)
+				m_compact_dem.setCellStd(cells[v], sol_std[v]);
+		}
+		else if (isSoA())
+		{
+			for (size_t v=0;v<cells.size();v++)
+				m_soa_dem.setCellStd(cells[v], sol_std[v]);
+		}
+		else
+		{
+			TRandomFieldCell *map_cells = isSparse() ? NULL : m_map.cellByIndex(0,0);
+			for (size_t v=0;v<cells.size();v++)
+			{
+				TRandomFieldCell *c = isSparse() ?
+					m_sparse_dem.cellByIndex(cells[v] % m_geom.size_x, cells[v] / m_geom.size_x) :
+					&map_cells[cells[v]];
+				c->gmrf_mean = sol_mean[v];
+				c->gmrf_std  = sol_std[v];
+			}
+			setInactiveCells(std::numeric_limits<double>::quiet_NaN());
+		}
+		m_solve_info.unknowns = cells.size();
+		m_solve_info.observations = solver.getObservationsCount();
+		m_solve_info.factor_nnz = solver.getFactorNonZeros();
+		m_solve_info.mixed_requested = sopts.mixed_precision;
+		m_solve_info.used_mixed = solver.usedMixedPrecision();
+		m_solve_info.reused_ordering = solver.reusedOrdering();
+		m_solve_info.refine_iters = solver.getRefinementIterations();
+		m_solve_info.refine_residual = solver.getRefinementResidual();
+		m_solve_info.profile = solver.getProfile();
+		m_solver_impl.reset(); // The solution now lives in the grid
+	}
+	else
+		m_map.updateMapEstimation();
+	leaveStage(6, "6.dem_map_update_gmrf", solved_cells, "cells");
+}
+
+TDemGridView CDemGmrfPipeline::getGridView() const
+{
+	if (isCompact()) return m_compact_dem.getView();
+	if (isSoA()) return m_soa_dem.getView();
+	if (isSparse()) return TDemGridView();
+	return TDemGridView::FromMap(m_map);
+}
+
+void CDemGmrfPipeline::predict(const double *xs, const double *ys, size_t n, TBatchPrediction &out, bool parallel) const
+{
+	if (isSparse())
+		predict_batch(m_sparse_dem, xs, ys, n, out, parallel);
+	else predict_batch(getGridView(), xs, ys, n, out, parallel);
+}
+
+void CDemGmrfPipeline::evaluateCheckpoints(bool keep_residuals, TResidualSet &nn, TResidualSet &bi) const
+{
+	const_cast<CDemGmrfPipeline*>(this)->enterStage(7, "7.eval_chkpts");
+	const size_t N_chk_pts = m_n_chk, N_insert_pts = getInsertedCount();
+
+	// Checkpoints are evaluated in blocks, in parallel. Each thread predicts
+	// both interpolants for a block and feeds the residuals to its own
+	// statistics accumulators, merged at the end:
+	nn.residuals.resize(keep_residuals ? N_chk_pts : 0);
+	bi.residuals.resize(keep_residuals ? N_chk_pts : 0);
+	CResidualStats stats_NN, stats_Bi;
+	std::mutex stats_mtx;
+
+	parallel_for(N_chk_pts, [&](size_t k0, size_t k1)
+	{
+		const size_t BLOCK = 4096;
+		std::vector<double> xs, ys;
+		TBatchPrediction pred;
+		CResidualStats my_stats_NN, my_stats_Bi;
+		for (size_t b=k0;b<k1;b+=BLOCK)
+		{
+			const size_t n = std::min(BLOCK,k1-b);
+			xs.resize(n); ys.resize(n);
+			for (size_t j=0;j<n;j++)
+			{
+				const size_t i=m_pts_indices[b+j+N_insert_pts];
+				xs[j] = m_pts(i,0);
+				ys[j] = m_pts(i,1);
+			}
+			predict(&xs[0], &ys[0], n, pred, false /* already in a worker thread */);
+
+			for (size_t j=0;j<n;j++)
+			{
+				const double z = m_pts(m_pts_indices[b+j+N_insert_pts],2);
+				const double r_NN = z - pred.z_nn[j]; // Neirest neighbor
+				const double r_Bi = z - pred.z_bi[j]; // Bilinear interp
+				my_stats_NN.add(r_NN);
+				my_stats_Bi.add(r_Bi);
+				if (keep_residuals) {
+					nn.residuals[b+j] = r_NN;
+					bi.residuals[b+j] = r_Bi;
+				}
+			}
+		}
+		std::lock_guard<std::mutex> lock(stats_mtx);
+		stats_NN.merge(my_stats_NN);
+		stats_Bi.merge(my_stats_Bi);
+	});
+	stats_NN.getStats(nn.stats);
+	stats_Bi.getStats(bi.stats);
+	const_cast<CDemGmrfPipeline*>(this)->leaveStage(7, "7.eval_chkpts", N_chk_pts, "points");
+}
+
+void CDemGmrfPipeline::evaluateLOO(bool keep_residuals, TResidualSet &loo) const
+{
+	if (m_opts.skip_variance)
+		THROW_EXCEPTION("LOO evaluation requires the posterior variance");
+	const_cast<CDemGmrfPipeline*>(this)->enterStage(8, "8.eval_loo");
+	const size_t N_insert_pts = getInsertedCount();
+
+	// For a linear-Gaussian model, removing observation j (precision
+	// 1/s_j^2, on cell c) from the posterior yields the LOO residual:
+	//   e_j = (z_j - mean_c) / (1 - h_j),  h_j = var_c / s_j^2
+	// with var_c the posterior variance of cell c, i.e. the diagonal of the
+	// inverse of the GMRF precision matrix, already computed by the solver.
+	loo.residuals.resize(keep_residuals ? N_insert_pts : 0);
+	CResidualStats stats_LOO;
+	std::mutex stats_mtx;
+
+	parallel_for(N_insert_pts, [&](size_t k0, size_t k1)
+	{
+		const size_t BLOCK = 4096;
+		std::vector<double> xs, ys;
+		TBatchPrediction pred;
+		CResidualStats my_stats_LOO;
+		for (size_t b=k0;b<k1;b+=BLOCK)
+		{
+			const size_t n = std::min(BLOCK,k1-b);
+			xs.resize(n); ys.resize(n);
+			for (size_t j=0;j<n;j++)
+			{
+				const size_t i=m_pts_indices[b+j];
+				xs[j] = m_pts(i,0);
+				ys[j] = m_pts(i,1);
+			}
+			predict(&xs[0], &ys[0], n, pred, false /* already in a worker thread */);
+
+			for (size_t j=0;j<n;j++)
+			{
+				const size_t i=m_pts_indices[b+j];
+				const double h = std::min(1.0-1e-9, mrpt::utils::square(pred.std_nn[j]/observationStd(i)));
+				const double r_LOO = (m_pts(i,2) - pred.z_nn[j]) / (1.0-h);
+				my_stats_LOO.add(r_LOO);
+				if (keep_residuals)
+					loo.residuals[b+j] = r_LOO;
+			}
+		}
+		std::lock_guard<std::mutex> lock(stats_mtx);
+		stats_LOO.merge(my_stats_LOO);
+	});
+	stats_LOO.getStats(loo.stats);
+	const_cast<CDemGmrfPipeline*>(this)->leaveStage(8, "8.eval_loo", N_insert_pts, "points");
+}
+
+void CDemGmrfPipeline::savePointsText(const std::string &file, bool checkpoints) const
+{
+	CFileOutputStream f(file);
+	const size_t k0 = checkpoints ? getInsertedCount() : 0, k1 = checkpoints ? m_pts_indices.size() : getInsertedCount();
+	for (size_t k=k0;k<k1;k++)
+	{
+		const size_t i=m_pts_indices[k];
+		double x=m_pts(i,0), y=m_pts(i,1);
+		if (m_opts.rotate_grid) m_frame.toWorld(m_pts(i,0),m_pts(i,1),x,y);
+		f.printf("%f, %f, %f\n",x,y,m_pts(i,2));
+	}
+}
+
+// Saves the grid limits and one `X Y MEAN STD` row per materialized cell,
+// but those left out by the active-cell mask (NaN):
+static void save_sparse_grid(const CSparseDemGrid &grid, const std::string &prefix)
+{
+	CFileOutputStream fil_lim( prefix + string("_grid_limits.txt") );
+	fil_lim.printf("%% Grid limits: [x_min x_max y_min y_max]\n%f %f %f %f\n", grid.getXMin(),grid.getXMax(),grid.getYMin(),grid.getYMax());
+
+	CFileOutputStream fil_cells( prefix + string("_cells.txt") );
+	fil_cells.printf("%% X Y MEAN STD\n");
+	grid.forEachBlock([&](size_t bx, size_t by, const TRandomFieldCell *cells)
+	{
+		for (size_t j=0;j<CSparseDemGrid::BLOCK;j++)
+		{
+			const size_t cy = by*CSparseDemGrid::BLOCK+j;
+			if (cy>=grid.getSizeY()) break;
+			for (size_t i=0;i<CSparseDemGrid::BLOCK;i++)
+			{
+				const size_t cx = bx*CSparseDemGrid::BLOCK+i;
+				if (cx>=grid.getSizeX()) break;
+				const TRandomFieldCell &c = cells[i+j*CSparseDemGrid::BLOCK];
+				if (c.gmrf_mean!=c.gmrf_mean) continue;
+				fil_cells.printf("%f, %f, %f, %f\n", grid.idx2x(cx), grid.idx2y(cy), c.gmrf_mean, c.gmrf_std);
+			}
+		}
+	});
+}
+
+void CDemGmrfPipeline::saveGridText(const std::string &prefix, bool skip_mean)
+{
+	if (isSparse())
+		save_sparse_grid(m_sparse_dem, prefix);
+	else if (isSoA())
+	{
+		if (skip_mean) save_dem_grid_std_text(getGridView(), prefix, m_opts.nodata);
+		else save_dem_grid_text(getGridView(), prefix, m_opts.nodata);
+	}
+	else
+	{
+		setInactiveCells(m_opts.nodata);
+		m_map.saveMetricMapRepresentationToFile(prefix);
+		m_map.saveAsMatlab3DGraph(prefix + string("_draw.m") );
+		setInactiveCells(std::numeric_limits<double>::quiet_NaN());
+	}
+}
+
+void CDemGmrfPipeline::saveNorthUpGrid(const std::string &prefix) const
+{
+	if (isSparse())
+		THROW_EXCEPTION("North-up resampling requires a dense or SoA grid storage");
+	save_north_up_grid(getGridView(), m_frame, m_opts.nodata, prefix);
+}
+
+void CDemGmrfPipeline::saveGeoref(const std::string &file) const
+{
+	m_frame.saveToTextFile(file, m_geom);
+}
+
+void CDemGmrfPipeline::buildTin(double max_error, TDemTin &tin) const
+{
+	if (isSparse())
+		THROW_EXCEPTION("The TIN export requires a dense, SoA or compact grid storage");
+	build_dem_tin(getGridView(), max_error, tin, m_opts.rotate_grid ? &m_frame : NULL);
+}
+
+void CDemGmrfPipeline::saveDerivatives(const std::string &prefix, TDemDerivativeOptions opts) const
+{
+	if (isSparse())
+		THROW_EXCEPTION("Terrain derivatives require a dense, SoA or compact grid storage");
+	if (m_opts.rotate_grid)
+		opts.grid_rotation = m_frame.angle;
+	TDemDerivatives d;
+	compute_dem_derivatives(getGridView(), opts, d);
+	save_dem_derivatives_text(d, prefix, m_opts.nodata);
+}
+
+void CDemGmrfPipeline::exportAll(const std::string &prefix, bool north_up, bool skip_mean)
+{
+	enterStage(9, "9.save_points");
+	// Each output file is an independent task on the thread pool:
+	CTaskGroup save_tasks;
+	save_tasks.run([&]() { savePointsText(prefix + string("_pts_map.txt"), false); });
+	save_tasks.run([&]() { savePointsText(prefix + string("_pts_chk.txt"), true); });
+	save_tasks.run([&]()
+	{
+		saveGridText(prefix + string("_grmf"), skip_mean);
+		if (m_opts.rotate_grid && north_up)
+			saveNorthUpGrid(prefix + string("_grmf_northup"));
+	});
+	if (m_opts.rotate_grid)
+		saveGeoref(prefix + string("_grmf_georef.txt"));
+	save_tasks.wait();
+	leaveStage(9, "9.save_points", getTotalCells(), "cells");
+}
@@ -0,0 +1,244 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/maps/CHeightGridMap2D_MRF.h>
+#include <mrpt/math/CMatrix.h>
+#include <Eigen/Dense>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "active_mask.h"
+#include "checkpoints.h"
+#include "dem_derivatives.h"
+#include "dem_predict.h"
+#include "dem_tin.h"
+#include "gmrf_solver.h"
+#include "grid_frame.h"
+#include "resource_planner.h"
+#include "soa_dem_grid.h"
+#include "xyz_loader.h"
+
+/** Parameters of one DEM job (the dem-gmrf command line, minus I/O and GUI) */
+struct TDemGmrfOptions
+{
+	TDemGmrfOptions() :
+		resolution(1.0), border(10.0), std_prior(1.0), std_obs(0.20), seed(0),
+		solver("mrpt"), grid_storage("dense"), mask_dist(0), rotate_grid(false),
+		skip_variance(false), loo(false), mem_budget_gb(0), nodata(-9999.0)
+	{}
+
+	double resolution;        //!< Cell side length [m]
+	double border;            //!< Margin around the bbox of the data [m]
+	double std_prior;         //!< Std of the smoothness prior [m]
+	double std_obs;           //!< Std of the observations without their own (4th) column [m]
+	TCheckpointOptions checkpoints;
+	unsigned int seed;        //!< For the random checkpoint selection (0: from the clock)
+	std::string solver;       //!< mrpt, native, mixed
+	std::string grid_storage; //!< dense, soa, compact (float32 soa), sparse
+	double mask_dist;         //!< Only solve cells within this distance of the data (<=0: all)
+	TPolygon2D aoi;           //!< Area of interest (no vertices: none)
+	bool   rotate_grid;       //!< Align the grid with the principal axes of the XY points
+	bool   skip_variance;
+	bool   loo;               //!< Insert all points (no checkpoints), for evaluateLOO()
+	double mem_budget_gb;     //!< See applyMemBudget() (0: no budget)
+	double nodata;            //!< Written for cells outside the active mask
+};
+
+/** Residuals of a set of points and their statistics (see CResidualStats) */
+struct TResidualSet
+{
+	Eigen::VectorXd residuals; //!< Empty unless requested
+	Eigen::VectorXd stats;
+
+	/** Writes the residuals (if kept) and the statistics, as dem-gmrf does */
+	void saveToTextFiles(const std::string &residuals_file, const std::string &stats_file) const;
+};
+
+/** The dem-gmrf pipeline as a library: one object per DEM job, whose stages
+  * are called in order by the application, which keeps the data in memory
+  * between stages and decides what to write to disk:
+  *
+  *   [1] loadPoints() or setPoints()  [2] computeBBox()  [P] plan() (optional)
+  *   [3] selectCheckpoints()  [4] buildMap()  [5] insertPoints()  [6] solve()
+  *   [7] evaluateCheckpoints()  [8] evaluateLOO()  [9] exportAll() or save*()
+  *
+  * Points passed to setPoints() are used in place (they must outlive the
+  * object), unless an AOI or a rotated grid is requested, which transform
+  * them. The DEM is returned as a TDemGridView over the grid storage itself.
+  * Stages run on the global CThreadPool; several objects may run concurrently.
+  * Errors are reported with exceptions.
+  */
+class CDemGmrfPipeline
+{
+public:
+	explicit CDemGmrfPipeline(const TDemGmrfOptions &opts = TDemGmrfOptions());
+
+	/** Called when each stage starts and ends (name such as "1.load_dataset",
+	  * and items processed, e.g. for CTimeLogger or CPerfReport) */
+	struct TStageHooks
+	{
+		std::function<void(const char *stage)> enter;
+		std::function<void(const char *stage, double items, const char *items_unit)> leave;
+	};
+	void setStageHooks(const TStageHooks &hooks) { m_hooks = hooks; }
+
+	const TDemGmrfOptions &getOptions() const { return m_opts; }
+
+	/** Fill-reducing orderings shared with other jobs (see CGmrfOrderingCache), used by solve() */
+	void setOrderingCache(CGmrfOrderingCache *cache) { m_ordering_cache = cache; }
+
+	/** Last stage completed (0: none, 1: points set, ..., 6: solved) */
+	int getStage() const { return m_stage; }
+
+	// ---- Stages ----
+	/** [1] Loads a text XYZ[S] file (see load_xyz_file()), restarting the pipeline */
+	void loadPoints(const std::string &file);
+	/** [1] Uses in-memory XYZ[S] rows, restarting the pipeline */
+	void setPoints(const TPointsView &pts);
+	/** [2] AOI filtering, optional grid rotation and bbox (plus border).
+	  * Throws if already called since the points were set */
+	void computeBBox();
+	/** [P] Estimates of the requested strategy (first) and the alternatives
+	  * with the same outputs. See CResourcePlanner. Without a calibrated
+	  * `planner`, a new one is calibrated (~1 s). */
+	std::vector<TPlanEstimate> plan(const CResourcePlanner *planner = NULL);
+	/** After plan(): if the requested strategy exceeds the memory budget, switches
+	  * to the fastest one that fits and returns true. Throws if none fits. */
+	bool applyMemBudget(const std::vector<TPlanEstimate> &estimates);
+	/** [3] */
+	void selectCheckpoints();
+	/** [4] Allocates the grid storage and the active-cell mask */
+	void buildMap();
+	/** [5] */
+	void insertPoints();
+	/** [6] `on_mean_ready` is called with the grid as soon as the mean is in it
+	  * (SoA storages only), and may start asynchronous work on the mean that
+	  * overlaps the variance computation. */
+	void solve(const std::function<void(const TDemGridView &)> &on_mean_ready = std::function<void(const TDemGridView &)>());
+	/** [7] Nearest-neighbor and bilinear residuals at the checkpoints */
+	void evaluateCheckpoints(bool keep_residuals, TResidualSet &nn, TResidualSet &bi) const;
+	/** [8] Analytic leave-one-out residuals of the inserted points (needs the variance) */
+	void evaluateLOO(bool keep_residuals, TResidualSet &loo) const;
+	/** [9] Writes the inserted points, checkpoints and grid files (`<prefix>_pts_map.txt`,
+	  * `_pts_chk.txt`, `_grmf*`...) in parallel. `skip_mean`: the mean grid
+	  * file was already written (e.g. from solve()'s `on_mean_ready`). */
+	void exportAll(const std::string &prefix, bool north_up, bool skip_mean = false);
+
+	// ---- Individual exports ----
+	void savePointsText(const std::string &file, bool checkpoints) const;
+	/** Grid files `<prefix>_grid_limits.txt`, `_mean.txt`, `_mean_std.txt` (or `_cells.txt` for sparse storage) */
+	void saveGridText(const std::string &prefix, bool skip_mean = false);
+	void saveNorthUpGrid(const std::string &prefix) const;
+	void saveGeoref(const std::string &file) const;
+	/** TIN of the mean within `max_error` meters, in world coordinates (see build_dem_tin()) */
+	void buildTin(double max_error, TDemTin &tin) const;
+	/** Terrain derivatives of the mean, `<prefix>_slope.txt`... (see compute_dem_derivatives()).
+	  * With a rotated grid, aspect and sun azimuth are corrected to the true north. */
+	void saveDerivatives(const std::string &prefix, TDemDerivativeOptions opts) const;
+
+	// ---- Results ----
+	/** Points, in the grid frame after computeBBox() */
+	const TPointsView &getPoints() const { return m_pts; }
+	size_t getPointCount() const { return m_pts.rows(); }
+	size_t getCheckpointCount() const { return m_n_chk; }
+	size_t getInsertedCount() const { return m_pts.rows()-m_n_chk; }
+	size_t getAOIDiscardedCount() const { return m_aoi_discarded; }
+	double getCheckpointCellSize() const { return m_chk_cell_size; }
+	/** Bbox of the data plus the border, in the grid frame */
+	const TPointsBBox &getLimits() const { return m_limits; }
+	const TGridGeometry &getGeometry() const { return m_geom; }
+	bool isRotated() const { return m_opts.rotate_grid; }
+	const TGridFrame &getGridFrame() const { return m_frame; }
+	/** Bbox area [m^2] before and after rotating the grid */
+	double getAreaWorld() const { return m_area_world; }
+	double getAreaLocal() const { return m_area_local; }
+
+	const TPlanInput &getPlanInput() const { return m_plan_in; }
+	/** Solver and storage actually used (may differ from the options, see applyMemBudget()) */
+	const std::string &getSolver() const { return m_solver; }
+	const std::string &getGridStorage() const { return m_storage; }
+	bool usesNativeSolver() const { return m_solver!="mrpt"; }
+	size_t getSparseBlockCount() const { return m_sparse_dem.getBlockCount(); }
+	double getTotalCells() const { return double(m_geom.size_x)*m_geom.size_y; }
+	/** Cells solved for (all the grid with the mrpt solver) */
+	double getSolvedCells() const;
+
+	struct TSolveInfo
+	{
+		TSolveInfo() : unknowns(0), observations(0), factor_nnz(0), mixed_requested(false), used_mixed(false), reused_ordering(false), refine_iters(0), refine_residual(0) {}
+		size_t unknowns, observations, factor_nnz;
+		bool   mixed_requested, used_mixed, reused_ordering;
+		int    refine_iters;
+		double refine_residual;
+		std::vector<CGmrfDemSolver::TProfileEntry> profile;
+	};
+	/** Statistics of the native solver, after solve() */
+	const TSolveInfo &getSolveInfo() const { return m_solve_info; }
+
+	/** The DEM (empty view for sparse storage: see predict()) */
+	TDemGridView getGridView() const;
+	const CSparseDemGrid &getSparseGrid() const { return m_sparse_dem; }
+	/** The MRPT map (dense storage), e.g. for its 3D view */
+	mrpt::maps::CHeightGridMap2D_MRF &getMap() { return m_map; }
+
+	/** Nearest-neighbor and bilinear predictions, whatever the grid storage */
+	void predict(const double *xs, const double *ys, size_t n, TBatchPrediction &out, bool parallel = true) const;
+
+private:
+	TDemGmrfOptions m_opts;
+	TStageHooks m_hooks;
+	CGmrfOrderingCache *m_ordering_cache;
+	int m_stage;  //!< Last stage completed
+
+	mrpt::math::CMatrix m_owned_pts; //!< Loaded or transformed points
+	TPointsView m_pts;
+	TPointsBBox m_data_bbox, m_limits;
+	TPointsXYMoments m_moments;
+	bool m_have_moments;
+	TGridFrame m_frame;
+	TPolygon2D m_aoi;    //!< In the grid frame
+	size_t m_aoi_discarded;
+	double m_area_world, m_area_local;
+
+	std::vector<size_t> m_pts_indices; //!< Inserted points first, then the checkpoints
+	size_t m_n_chk;
+	std::mt19937 m_rng;                //!< Checkpoint selection, seeded from TDemGmrfOptions::seed
+	double m_chk_cell_size;
+
+	TPlanInput m_plan_in;
+	std::string m_solver, m_storage;
+
+	TGridGeometry m_geom;
+	mrpt::maps::CHeightGridMap2D_MRF m_map;
+	CSparseDemGrid m_sparse_dem;
+	CSoADemGrid<double> m_soa_dem;
+	CCompactDemGrid m_compact_dem;
+	std::vector<uint8_t> m_active_mask;
+	bool m_use_mask;
+	std::unique_ptr<CGmrfDemSolver> m_solver_impl;
+	TSolveInfo m_solve_info;
+
+	void enterStage(int stage, const char *name);
+	void leaveStage(int stage, const char *name, double items, const char *items_unit);
+	/** Makes the points owned (copying a view given to setPoints()), before transforming them */
+	void ownPoints();
+	double observationStd(size_t i) const { return m_pts.cols()>=4 ? m_pts(i,3) : m_opts.std_obs; }
+
+	bool isSparse() const  { return m_storage=="sparse"; }
+	bool isCompact() const { return m_storage=="compact"; }
+	bool isSoA() const     { return m_storage=="soa" || m_storage=="compact"; }
+	/** Sets the mean & std of the cells outside the active mask of the MRPT map */
+	void setInactiveCells(double value);
+
+	CDemGmrfPipeline(const CDemGmrfPipeline &);
+	CDemGmrfPipeline &operator=(const CDemGmrfPipeline &);
+};
@@ -0,0 +1,99 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "dem_grid_io.h"
+#include <mrpt/math/CMatrix.h>
+#include <mrpt/utils/CFileOutputStream.h>
+#include <cstdio>
+
+using namespace std;
+
+// Formats one row of a plane into `buf`, substituting no-data:
+template <typename T>
+static void format_row(const T *vals, const T *nan_ref, size_t n, double offset, double nodata, std::string &buf)
+{
+	char tmp[64];
+	buf.clear();
+	for (size_t i=0;i<n;i++)
+	{
+		const double v = nan_ref[i]!=nan_ref[i] ? nodata : offset+vals[i];
+		const int len = snprintf(tmp,sizeof(tmp),"%f ",v);
+		buf.append(tmp, len>0 ? size_t(len) : 0);
+	}
+	buf.push_back('\n');
+}
+
+// Writes the mean (or the std) plane, one grid row per text line:
+template <typename T>
+static void save_plane(const TDemGridView &g, mrpt::utils::CFileOutputStream &fil, bool std_plane, double nodata)
+{
+	// SoA planes: each row of the grid is a contiguous span of each plane
+	const T *mean = reinterpret_cast<const T*>(g.mean), *std = reinterpret_cast<const T*>(g.std);
+	std::string buf;
+	for (size_t cy=0;cy<g.size_y;cy++)
+	{
+		const T *m = mean + cy*g.size_x;
+		if (std_plane) format_row(std + cy*g.size_x, m, g.size_x, 0.0, nodata, buf);
+		else format_row(m, m, g.size_x, g.z_origin, nodata, buf);
+		fil.WriteBuffer(buf.data(), buf.size());
+	}
+}
+
+static void save_plane(const TDemGridView &g, const std::string &file, bool std_plane, double nodata)
+{
+	mrpt::utils::CFileOutputStream fil(file);
+	if (g.isPlanar())
+	{
+		if (g.is_float32) save_plane<float>(g, fil, std_plane, nodata);
+		else save_plane<double>(g, fil, std_plane, nodata);
+		return;
+	}
+	for (size_t cy=0;cy<g.size_y;cy++)
+	{
+		for (size_t cx=0;cx<g.size_x;cx++)
+		{
+			double m,s;
+			g.fetch(cx,cy,m,s);
+			fil.printf("%f ", m!=m ? nodata : (std_plane ? s : m));
+		}
+		fil.printf("\n");
+	}
+}
+
+void save_dem_grid_mean_text(const TDemGridView &g, const std::string &prefix, double nodata)
+{
+	mrpt::math::CMatrix DIMs(1,4);
+	DIMs(0,0)=g.x_min; DIMs(0,1)=g.x_min+g.size_x*g.resolution;
+	DIMs(0,2)=g.y_min; DIMs(0,3)=g.y_min+g.size_y*g.resolution;
+	DIMs.saveToTextFile( prefix + string("_grid_limits.txt"), MATRIX_FORMAT_FIXED, false /* add mrpt header */, "% Grid limits: [x_min x_max y_min y_max]\n" );
+
+	save_plane(g, prefix + string("_mean.txt"), false, nodata);
+}
+
+void save_dem_grid_std_text(const TDemGridView &g, const std::string &prefix, double nodata)
+{
+	save_plane(g, prefix + string("_mean_std.txt"), true, nodata);
+}
+
+void save_dem_grid_text(const TDemGridView &g, const std::string &prefix, double nodata)
+{
+	save_dem_grid_mean_text(g, prefix, nodata);
+	save_dem_grid_std_text(g, prefix, nodata);
+}
+
+void save_grid_plane_text(const float *plane, size_t size_x, size_t size_y, const std::string &file, double nodata)
+{
+	mrpt::utils::CFileOutputStream fil(file);
+	std::string buf;
+	for (size_t cy=0;cy<size_y;cy++)
+	{
+		const float *row = plane + cy*size_x;
+		format_row(row, row, size_x, 0.0, nodata, buf);
+		fil.WriteBuffer(buf.data(), buf.size());
+	}
+}
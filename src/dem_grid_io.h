@@ -0,0 +1,30 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <string>
+#include "dem_predict.h"
+
+/** Writes a DEM grid in the same text layout as
+  * CRandomFieldGridMap2D::saveMetricMapRepresentationToFile() does for GMRF
+  * maps: `<prefix>_grid_limits.txt`, and the `<prefix>_mean.txt` and
+  * `<prefix>_mean_std.txt` matrices (one row per grid row). No-data (NaN)
+  * cells are written as `nodata`. Works directly on the view, whatever the
+  * storage layout behind it; SoA planes are formatted a whole row at a time.
+  */
+void save_dem_grid_text(const TDemGridView &grid, const std::string &prefix, double nodata);
+
+/** Only `<prefix>_grid_limits.txt` and `<prefix>_mean.txt`, see save_dem_grid_text() */
+void save_dem_grid_mean_text(const TDemGridView &grid, const std::string &prefix, double nodata);
+/** Only `<prefix>_mean_std.txt`, see save_dem_grid_text(). No-data cells are those with a NaN mean. */
+void save_dem_grid_std_text(const TDemGridView &grid, const std::string &prefix, double nodata);
+
+/** Writes a row-major plane of `size_x` x `size_y` values in the layout of
+  * `<prefix>_mean.txt`, with NaN values written as `nodata` */
+void save_grid_plane_text(const float *plane, size_t size_x, size_t size_y, const std::string &file, double nodata);
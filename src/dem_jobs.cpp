@@ -0,0 +1,458 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "dem_jobs.h"
+#include <mrpt/system/filesystem.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+using namespace std;
+
+static double wall_now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ------------------------------------------------------------------
+//  TDemJob
+// ------------------------------------------------------------------
+TDemJob TDemJob::FromJSON(const CJsonValue &j, const TDemGmrfOptions &defaults)
+{
+	TDemJob d;
+	d.opts = defaults;
+	const TDemJob job = FromJSON(j, d);
+	if (job.input.empty())
+		throw std::runtime_error("JSON: missing member `input`");
+	return job;
+}
+
+TDemJob TDemJob::FromJSON(const CJsonValue &j, const TDemJob &defaults)
+{
+	static const char *known[] = {
+		"id", "input", "output_prefix", "extent", "margin",
+		"resolution", "border", "std_prior", "std_obs",
+		"checkpoint_ratio", "chk_mode", "chk_cell", "chk_per_cell", "seed",
+		"solver", "grid_storage", "mask_dist", "aoi", "rotate_grid",
+		"skip_variance", "loo", "nodata", "perf_report", "residual_files", "cmd" };
+	if (!j.isObject())
+		throw std::runtime_error("A job must be a JSON object");
+	for (size_t i=0;i<j.members().size();i++)
+	{
+		const std::string &key = j.members()[i].first;
+		if (std::find_if(known, known+sizeof(known)/sizeof(known[0]), [&key](const char *k) { return key==k; })==known+sizeof(known)/sizeof(known[0]))
+			throw std::runtime_error("Unknown job parameter `"+key+"`");
+	}
+
+	TDemJob job = defaults;
+	job.id = j.get("id", job.id.c_str());
+	job.input = j.get("input", job.input.c_str());
+	job.output_prefix = j.get("output_prefix", job.output_prefix.c_str());
+	if (j.has("extent"))
+	{
+		const CJsonValue &e = j["extent"];
+		if (!e.isArray() || e.size()!=4)
+			throw std::runtime_error("`extent` must be [x_min,x_max,y_min,y_max]");
+		for (int k=0;k<4;k++) job.extent[k] = e[k].asNumber();
+		if (!(job.extent[0]<job.extent[1] && job.extent[2]<job.extent[3]))
+			throw std::runtime_error("Empty `extent`");
+		job.has_extent = true;
+	}
+	job.margin = j.get("margin", job.margin);
+	job.perf_report = j.get("perf_report", job.perf_report.c_str());
+	job.residual_files = j.get("residual_files", job.residual_files);
+
+	TDemGmrfOptions &o = job.opts;
+	o.resolution    = j.get("resolution", o.resolution);
+	o.border        = j.get("border", o.border);
+	o.std_prior     = j.get("std_prior", o.std_prior);
+	o.std_obs       = j.get("std_obs", o.std_obs);
+	o.checkpoints.ratio     = j.get("checkpoint_ratio", o.checkpoints.ratio);
+	if (j.has("chk_mode"))
+		o.checkpoints.mode  = checkpoint_mode_from_string(j["chk_mode"].asString());
+	o.checkpoints.cell_size = j.get("chk_cell", o.checkpoints.cell_size);
+	o.checkpoints.per_cell  = size_t(j.get("chk_per_cell", double(o.checkpoints.per_cell)));
+	o.seed          = unsigned(j.get("seed", double(o.seed)));
+	o.solver        = j.get("solver", o.solver.c_str());
+	o.grid_storage  = j.get("grid_storage", o.grid_storage.c_str());
+	o.mask_dist     = j.get("mask_dist", o.mask_dist);
+	o.rotate_grid   = j.get("rotate_grid", o.rotate_grid);
+	o.skip_variance = j.get("skip_variance", o.skip_variance);
+	o.loo           = j.get("loo", o.loo);
+	o.nodata        = j.get("nodata", o.nodata);
+	if (j.has("aoi"))
+	{
+		// [[x,y], [x,y], ...]
+		const CJsonValue &a = j["aoi"];
+		o.aoi = TPolygon2D();
+		for (size_t k=0;k<a.size();k++) {
+			o.aoi.xs.push_back(a[k][0].asNumber());
+			o.aoi.ys.push_back(a[k][1].asNumber());
+		}
+		if (o.aoi.xs.size()<3)
+			throw std::runtime_error("`aoi` needs at least 3 vertices");
+	}
+	if (!(o.resolution>0))
+		throw std::runtime_error("`resolution` must be positive");
+	return job;
+}
+
+static void stats_to_json(std::string &s, const char *name, const Eigen::VectorXd &stats)
+{
+	if (stats.size()<6) return;
+	char buf[128];
+	snprintf(buf,sizeof(buf),", \"%s_rmse\": %.6g, \"%s_median\": %.6g", name, stats[4], name, stats[5]);
+	s += buf;
+}
+
+std::string TDemJobResult::toJSON() const
+{
+	char buf[512];
+	std::string s = "{\"ok\": true, \"id\": " + json_quote(id);
+	snprintf(buf,sizeof(buf),
+		", \"points\": %u, \"checkpoints\": %u, \"unknowns\": %u, \"grid\": [%u, %u]"
+		", \"solver\": %s, \"grid_storage\": %s"
+		", \"est_peak_mb\": %.1f, \"job_mb\": %.1f, \"queued_s\": %.4f, \"wall_s\": %.4f"
+		", \"points_cached\": %s, \"ordering_reused\": %s",
+		(unsigned)points, (unsigned)checkpoints, (unsigned)unknowns, (unsigned)size_x, (unsigned)size_y,
+		json_quote(solver).c_str(), json_quote(grid_storage).c_str(),
+		est_peak_bytes/(1024.0*1024.0), job_bytes/(1024.0*1024.0), queued_s, wall_s,
+		points_cached ? "true" : "false", ordering_reused ? "true" : "false");
+	s += buf;
+	stats_to_json(s, "chk_nn", stats_nn);
+	stats_to_json(s, "chk_bi", stats_bi);
+	stats_to_json(s, "loo", stats_loo);
+	return s + "}";
+}
+
+// ------------------------------------------------------------------
+//  CPointCache
+// ------------------------------------------------------------------
+uint64_t CPointCache::TPoints::bytes() const
+{
+	return uint64_t(xyz.rows())*xyz.cols()*sizeof(float) + uint64_t(xyz.rows())*sizeof(size_t) + index.getCellCount()*sizeof(size_t);
+}
+
+void CPointCache::TPoints::crop(double x_min, double x_max, double y_min, double y_max, mrpt::math::CMatrix &out) const
+{
+	std::vector<size_t> sel;
+	const size_t cx0 = index.x2idx(x_min), cx1 = index.x2idx(x_max);
+	const size_t cy0 = index.y2idx(y_min), cy1 = index.y2idx(y_max);
+	for (size_t cy=cy0;cy<=cy1;cy++)
+		for (size_t cx=cx0;cx<=cx1;cx++)
+		{
+			const size_t c = index.cellIndex(cx,cy);
+			for (const size_t *it=index.cellBegin(c);it!=index.cellEnd(c);++it)
+			{
+				const double x = xyz(*it,0), y = xyz(*it,1);
+				if (x>=x_min && x<=x_max && y>=y_min && y<=y_max) sel.push_back(*it);
+			}
+		}
+	std::sort(sel.begin(),sel.end());
+	out.setSize(sel.size(), xyz.cols());
+	for (size_t i=0;i<sel.size();i++)
+		out.row(i) = xyz.row(sel[i]);
+}
+
+CPointCache::TPointsPtr CPointCache::get(const std::string &file, bool *was_cached)
+{
+	if (!mrpt::system::fileExists(file))
+		throw std::runtime_error("Input file not found: `"+file+"`");
+	const uint64_t file_size = mrpt::system::getFileSize(file);
+	const double file_mtime = double(mrpt::system::getFileModificationTime(file));
+
+	std::shared_ptr<std::promise<TPointsPtr> > loader;
+	std::shared_future<TPointsPtr> pts;
+	{
+		std::lock_guard<std::mutex> lk(m_mtx);
+		for (std::list<TEntry>::iterator it=m_entries.begin();it!=m_entries.end();++it)
+		{
+			if (it->file!=file) continue;
+			if (it->file_size==file_size && it->file_mtime==file_mtime) {
+				m_entries.splice(m_entries.begin(), m_entries, it);
+				pts = it->pts;
+			}
+			else m_entries.erase(it); // The file changed
+			break;
+		}
+		if (pts.valid()) m_hits++;
+		else
+		{
+			// Other jobs asking for this file meanwhile wait for this load:
+			m_misses++;
+			loader = std::make_shared<std::promise<TPointsPtr> >();
+			TEntry e;
+			e.file = file;
+			e.file_size = file_size;
+			e.file_mtime = file_mtime;
+			e.pts = pts = loader->get_future().share();
+			m_entries.push_front(e);
+		}
+	}
+	if (was_cached) *was_cached = !loader;
+
+	if (loader)
+	{
+		try {
+			std::shared_ptr<TPoints> p = std::make_shared<TPoints>();
+			load_xyz_file(file, p->xyz, p->bbox);
+			// ~256 points per cell of the index:
+			const size_t N = p->xyz.rows();
+			const double area = std::max(1e-9, (p->bbox.maxx-p->bbox.minx)*(p->bbox.maxy-p->bbox.miny));
+			const double cell = std::max(1e-6, std::sqrt(area*256.0/std::max<size_t>(1,N)));
+			p->index.build(p->xyz, p->bbox.minx, p->bbox.maxx+cell, p->bbox.miny, p->bbox.maxy+cell, cell);
+			loader->set_value(p);
+		}
+		catch (...) {
+			loader->set_exception(std::current_exception());
+			std::lock_guard<std::mutex> lk(m_mtx);
+			for (std::list<TEntry>::iterator it=m_entries.begin();it!=m_entries.end();++it)
+				if (it->file==file) { m_entries.erase(it); break; }
+			throw;
+		}
+		std::lock_guard<std::mutex> lk(m_mtx);
+		evict();
+	}
+	return pts.get(); // Rethrows the error of a concurrent load
+}
+
+static bool is_ready(const std::shared_future<CPointCache::TPointsPtr> &f)
+{
+	return f.wait_for(std::chrono::seconds(0))==std::future_status::ready;
+}
+
+void CPointCache::evict()
+{
+	// Drop the least recently used loaded clouds, always keeping the newest one:
+	uint64_t bytes = 0;
+	for (std::list<TEntry>::iterator it=m_entries.begin();it!=m_entries.end();)
+	{
+		if (is_ready(it->pts))
+		{
+			const uint64_t b = it->pts.get()->bytes();
+			if (bytes>0 && bytes+b>m_max_bytes) {
+				it = m_entries.erase(it);
+				continue;
+			}
+			bytes += b;
+		}
+		++it;
+	}
+}
+
+size_t CPointCache::size() const
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	return m_entries.size();
+}
+
+uint64_t CPointCache::getBytes() const
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	uint64_t bytes = 0;
+	for (std::list<TEntry>::const_iterator it=m_entries.begin();it!=m_entries.end();++it)
+		if (is_ready(it->pts)) bytes += it->pts.get()->bytes();
+	return bytes;
+}
+
+// ------------------------------------------------------------------
+//  CMemoryAdmission
+// ------------------------------------------------------------------
+void CMemoryAdmission::acquire(uint64_t bytes)
+{
+	if (bytes>m_budget)
+	{
+		char buf[200];
+		snprintf(buf,sizeof(buf),"The job needs an estimated %.2f GB, above the memory budget of %.2f GB",
+			bytes/(1024.0*1024.0*1024.0), m_budget/(1024.0*1024.0*1024.0));
+		throw std::runtime_error(buf);
+	}
+	std::unique_lock<std::mutex> lk(m_mtx);
+	const uint64_t ticket = m_next_ticket++;
+	m_cv.wait(lk, [&]() { return m_serving==ticket && m_running<m_max_jobs && m_used+bytes<=m_budget; });
+	m_serving++;
+	m_used += bytes;
+	m_running++;
+	m_cv.notify_all(); // The next ticket may fit too
+}
+
+void CMemoryAdmission::release(uint64_t bytes)
+{
+	{
+		std::lock_guard<std::mutex> lk(m_mtx);
+		m_used -= bytes;
+		m_running--;
+	}
+	m_cv.notify_all();
+}
+
+uint64_t CMemoryAdmission::getUsed() const
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	return m_used;
+}
+
+size_t CMemoryAdmission::getRunning() const
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	return m_running;
+}
+
+size_t CMemoryAdmission::getQueued() const
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	return size_t(m_next_ticket-m_serving);
+}
+
+// ------------------------------------------------------------------
+//  CDemJobRunner
+// ------------------------------------------------------------------
+CDemJobRunner::CDemJobRunner(const TOptions &opts) :
+	m_opts(opts),
+	m_points(opts.point_cache_bytes),
+	m_orderings(opts.max_orderings),
+	m_admission(opts.mem_budget_bytes, opts.max_jobs),
+	m_jobs_done(0), m_jobs_failed(0)
+{
+}
+
+TDemJobResult CDemJobRunner::run(const TDemJob &job)
+{
+	const double t0 = wall_now();
+	TDemJobResult r;
+	r.id = job.id;
+	try
+	{
+		// Stage records of this job only; memory and CPU figures are those
+		// of the whole process, shared with any concurrent job. The peak RSS
+		// is not reset per stage, which would wipe the peaks of the others:
+		const bool perf_report = !job.perf_report.empty();
+		CPerfReport perf;
+		perf.setResetPeakRss(false);
+		CDemGmrfPipeline::TStageHooks hooks;
+		hooks.enter = [&](const char *stage) { perf.enter(stage); };
+		hooks.leave = [&](const char *stage, double items, const char *items_unit) { perf.leave(stage, items, items_unit); };
+
+		if (perf_report) perf.enter("1.load_dataset");
+		const CPointCache::TPointsPtr pts = m_points.get(job.input, &r.points_cached);
+		if (perf_report) perf.leave("1.load_dataset", double(pts->xyz.rows()), "points");
+
+		// Without an extent, the cached points are used in place:
+		mrpt::math::CMatrix cropped;
+		CDemGmrfPipeline dem(job.opts);
+		dem.setOrderingCache(&m_orderings);
+		if (perf_report) dem.setStageHooks(hooks);
+		if (job.has_extent)
+		{
+			const double m = job.margin;
+			pts->crop(job.extent[0]-m, job.extent[1]+m, job.extent[2]-m, job.extent[3]+m, cropped);
+			if (!cropped.rows())
+				throw std::runtime_error("No points in the job extent");
+			dem.setPoints(TPointsView(cropped));
+		}
+		else dem.setPoints(TPointsView(pts->xyz));
+
+		dem.computeBBox();
+		dem.selectCheckpoints();
+		const std::vector<TPlanEstimate> est = dem.plan(&m_planner);
+		r.est_peak_bytes = est[0].peak_bytes;
+		r.job_bytes = uint64_t(std::max(0.0, est[0].peak_bytes-double(dem.getPlanInput().baseline_bytes)));
+
+		const double t_queue = wall_now();
+		if (perf_report) perf.enter("P.admission");
+		CMemoryAdmission::TGuard admitted(m_admission, r.job_bytes);
+		if (perf_report) perf.leave("P.admission");
+		r.queued_s = wall_now()-t_queue;
+
+		dem.buildMap();
+		dem.insertPoints();
+		dem.solve();
+		if (perf_report)
+			for (size_t i=0;i<dem.getSolveInfo().profile.size();i++)
+				perf.addNested(dem.getSolveInfo().profile[i].name, dem.getSolveInfo().profile[i].wall);
+		// Same residual files as dem-gmrf (residuals not kept are not written):
+		const bool save_residuals = job.residual_files && !job.output_prefix.empty();
+		if (dem.getCheckpointCount())
+		{
+			TResidualSet nn, bi;
+			dem.evaluateCheckpoints(save_residuals, nn, bi);
+			r.stats_nn = nn.stats;
+			r.stats_bi = bi.stats;
+			if (!job.output_prefix.empty()) {
+				nn.saveToTextFiles(job.output_prefix + "_chkpt_residuals_NN.txt", job.output_prefix + "_chkpt_residuals_NN_stats.txt");
+				bi.saveToTextFiles(job.output_prefix + "_chkpt_residuals_Bi.txt", job.output_prefix + "_chkpt_residuals_Bi_stats.txt");
+			}
+		}
+		if (job.opts.loo && dem.getInsertedCount())
+		{
+			TResidualSet loo;
+			dem.evaluateLOO(save_residuals, loo);
+			r.stats_loo = loo.stats;
+			if (!job.output_prefix.empty())
+				loo.saveToTextFiles(job.output_prefix + "_loo_residuals.txt", job.output_prefix + "_loo_residuals_stats.txt");
+		}
+		if (!job.output_prefix.empty())
+			dem.exportAll(job.output_prefix, false);
+
+		r.points = dem.getPointCount();
+		r.checkpoints = dem.getCheckpointCount();
+		r.unknowns = size_t(dem.getSolvedCells());
+		r.size_x = dem.getGeometry().size_x;
+		r.size_y = dem.getGeometry().size_y;
+		r.solver = dem.getSolver();
+		r.grid_storage = dem.getGridStorage();
+		r.ordering_reused = dem.getSolveInfo().reused_ordering;
+
+		if (perf_report)
+		{
+			perf.setInfo("job", job.id);
+			perf.setInfo("input", job.input);
+			perf.setInfo("solver", r.solver);
+			perf.setInfo("grid_storage", r.grid_storage);
+			char buf[64];
+			snprintf(buf,sizeof(buf),"%.1f",r.job_bytes/(1024.0*1024.0));
+			perf.setInfo("job_mb", buf);
+			perf.saveToJSON(job.perf_report);
+		}
+	}
+	catch (...)
+	{
+		std::lock_guard<std::mutex> lk(m_stats_mtx);
+		m_jobs_failed++;
+		throw;
+	}
+	r.wall_s = wall_now()-t0;
+	std::lock_guard<std::mutex> lk(m_stats_mtx);
+	m_jobs_done++;
+	return r;
+}
+
+std::string CDemJobRunner::getStatsJSON() const
+{
+	uint64_t done, failed;
+	{
+		std::lock_guard<std::mutex> lk(m_stats_mtx);
+		done = m_jobs_done;
+		failed = m_jobs_failed;
+	}
+	char buf[768];
+	snprintf(buf,sizeof(buf),
+		"{\"ok\": true, \"jobs_done\": %llu, \"jobs_failed\": %llu, \"jobs_running\": %u, \"jobs_queued\": %u"
+		", \"mem_budget_mb\": %.1f, \"mem_admitted_mb\": %.1f"
+		", \"point_cache\": {\"files\": %u, \"mb\": %.1f, \"max_mb\": %.1f, \"hits\": %llu, \"misses\": %llu}"
+		", \"ordering_cache\": {\"entries\": %u, \"mb\": %.1f, \"hits\": %llu, \"misses\": %llu}}",
+		(unsigned long long)done, (unsigned long long)failed, (unsigned)m_admission.getRunning(), (unsigned)m_admission.getQueued(),
+		m_admission.getBudget()/(1024.0*1024.0), m_admission.getUsed()/(1024.0*1024.0),
+		(unsigned)m_points.size(), m_points.getBytes()/(1024.0*1024.0), m_opts.point_cache_bytes/(1024.0*1024.0),
+		(unsigned long long)m_points.getHits(), (unsigned long long)m_points.getMisses(),
+		(unsigned)m_orderings.size(), m_orderings.getBytes()/(1024.0*1024.0),
+		(unsigned long long)m_orderings.getHits(), (unsigned long long)m_orderings.getMisses());
+	return buf;
+}
@@ -0,0 +1,195 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/math/CMatrix.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "dem_gmrf_pipeline.h"
+#include "gmrf_solver.h"
+#include "json_value.h"
+#include "perf_report.h"
+#include "point_grid_index.h"
+#include "resource_planner.h"
+
+/** One DEM job, as described in JSON by the clients of dem-gmrf-server:
+  *
+  *   { "id": "tile_12_7", "input": "survey.xyz", "extent": [x_min,x_max,y_min,y_max],
+  *     "output_prefix": "out/tile_12_7", "resolution": 0.5, "std_prior": 1.0, ... }
+  *
+  * Only `input` is required. See TDemJob::FromJSON() for the parameters. */
+struct TDemJob
+{
+	TDemJob() : has_extent(false), margin(0), residual_files(true) { extent[0]=extent[1]=extent[2]=extent[3]=0; }
+
+	std::string id;            //!< Echoed in the result
+	std::string input;         //!< XYZ[S] text file
+	std::string output_prefix; //!< Empty: no files are written
+	bool   has_extent;
+	double extent[4];          //!< [x_min x_max y_min y_max]: only the points inside are used
+	double margin;             //!< Points this far outside the extent are also used [m]
+	std::string perf_report;   //!< CPerfReport JSON file of the job (empty: none)
+	bool residual_files;       //!< Also write the per-point residuals, not only their statistics (as dem-gmrf without --no-residual-files)
+	TDemGmrfOptions opts;
+
+	/** Parameters not given in `j` are taken from `defaults`. Throws on unknown
+	  * or ill-typed parameters. */
+	static TDemJob FromJSON(const CJsonValue &j, const TDemGmrfOptions &defaults);
+	/** \overload Missing parameters, including `input`, are taken from `defaults`
+	  * (e.g. the defaults of a manifest, see dem-gmrf --jobs) */
+	static TDemJob FromJSON(const CJsonValue &j, const TDemJob &defaults);
+};
+
+struct TDemJobResult
+{
+	TDemJobResult() : points(0), checkpoints(0), unknowns(0), size_x(0), size_y(0), est_peak_bytes(0), job_bytes(0),
+		queued_s(0), wall_s(0), points_cached(false), ordering_reused(false) {}
+	std::string id, solver, grid_storage;
+	size_t points, checkpoints, unknowns, size_x, size_y;
+	double est_peak_bytes;     //!< Planner estimate for the whole process
+	uint64_t job_bytes;        //!< Admitted memory of this job
+	double queued_s, wall_s;   //!< Waiting for admission; total
+	bool points_cached, ordering_reused;
+	Eigen::VectorXd stats_nn, stats_bi, stats_loo; //!< Residual statistics (see CResidualStats), if evaluated
+
+	/** One-line JSON object, `{"ok":true, ...}` */
+	std::string toJSON() const;
+};
+
+/** Parsed point clouds kept in memory between jobs, with a coarse XY index so
+  * that jobs over a small extent of a large cloud only visit nearby points.
+  * A file requested by several jobs at once is loaded only once, and reloaded
+  * if its size or modification time changed. The least recently used clouds
+  * are dropped above `max_bytes` (jobs still using them keep them alive). */
+class CPointCache
+{
+public:
+	struct TPoints
+	{
+		mrpt::math::CMatrix xyz;
+		TPointsBBox bbox;
+		CPointGridIndex index;
+		uint64_t bytes() const;
+		/** Copies the points in [x_min,x_max]x[y_min,y_max] into `out`, in file order */
+		void crop(double x_min, double x_max, double y_min, double y_max, mrpt::math::CMatrix &out) const;
+	};
+	typedef std::shared_ptr<const TPoints> TPointsPtr;
+
+	explicit CPointCache(uint64_t max_bytes) : m_max_bytes(max_bytes), m_hits(0), m_misses(0) {}
+
+	TPointsPtr get(const std::string &file, bool *was_cached = NULL);
+
+	size_t size() const;
+	uint64_t getBytes() const;
+	uint64_t getHits() const { return m_hits; }
+	uint64_t getMisses() const { return m_misses; }
+
+private:
+	struct TEntry
+	{
+		std::string file;
+		uint64_t file_size;
+		double file_mtime;
+		std::shared_future<TPointsPtr> pts;
+	};
+	mutable std::mutex m_mtx;
+	std::list<TEntry> m_entries; //!< Most recently used first
+	uint64_t m_max_bytes;
+	std::atomic<uint64_t> m_hits, m_misses;
+
+	void evict(); //!< Called with m_mtx held
+};
+
+/** Admits jobs in arrival order while their estimated memory fits in the
+  * budget and there are free job slots. A job larger than the whole budget
+  * is rejected rather than queued forever. */
+class CMemoryAdmission
+{
+public:
+	CMemoryAdmission(uint64_t budget_bytes, size_t max_jobs) :
+		m_budget(budget_bytes), m_max_jobs(std::max<size_t>(1,max_jobs)), m_used(0), m_running(0), m_next_ticket(0), m_serving(0) {}
+
+	/** Blocks until the job is admitted. Throws if `bytes` exceeds the budget. */
+	void acquire(uint64_t bytes);
+	void release(uint64_t bytes);
+
+	/** RAII admission of one job */
+	class TGuard
+	{
+	public:
+		TGuard(CMemoryAdmission &a, uint64_t bytes) : m_a(a), m_bytes(bytes) { m_a.acquire(bytes); }
+		~TGuard() { m_a.release(m_bytes); }
+	private:
+		CMemoryAdmission &m_a;
+		uint64_t m_bytes;
+		TGuard(const TGuard &);
+		TGuard &operator=(const TGuard &);
+	};
+
+	uint64_t getBudget() const { return m_budget; }
+	uint64_t getUsed() const;
+	size_t getRunning() const;
+	size_t getQueued() const;
+
+private:
+	mutable std::mutex m_mtx;
+	std::condition_variable m_cv;
+	uint64_t m_budget;
+	size_t m_max_jobs;
+	uint64_t m_used;
+	size_t m_running;
+	uint64_t m_next_ticket, m_serving;
+};
+
+/** Runs DEM jobs from any number of threads, sharing the warm state between
+  * them: parsed point clouds, fill-reducing orderings of the solver and the
+  * calibration of the resource planner, which estimates the memory of each
+  * job for CMemoryAdmission. */
+class CDemJobRunner
+{
+public:
+	struct TOptions
+	{
+		TOptions() : mem_budget_bytes(0), max_jobs(2), point_cache_bytes(0), max_orderings(64) {}
+		uint64_t mem_budget_bytes;
+		size_t   max_jobs;
+		uint64_t point_cache_bytes;
+		size_t   max_orderings;
+	};
+
+	explicit CDemJobRunner(const TOptions &opts);
+
+	/** Calibrates the resource planner (~1 s). Call once before running jobs. */
+	void calibrate() { m_planner.calibrate(); }
+
+	/** Thread-safe. Errors are thrown as exceptions. */
+	TDemJobResult run(const TDemJob &job);
+
+	/** Caches and admission state, as a one-line JSON object */
+	std::string getStatsJSON() const;
+
+	const CPointCache &getPointCache() const { return m_points; }
+	const CMemoryAdmission &getAdmission() const { return m_admission; }
+
+private:
+	TOptions m_opts;
+	CPointCache m_points;
+	CGmrfOrderingCache m_orderings;
+	CMemoryAdmission m_admission;
+	CResourcePlanner m_planner;
+	mutable std::mutex m_stats_mtx;
+	uint64_t m_jobs_done, m_jobs_failed;
+};
@@ -0,0 +1,225 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "dem_lod_mesh.h"
+#include <mrpt/utils/color_maps.h>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+
+#include "parallel_for.h"
+
+using namespace mrpt::opengl;
+
+const size_t CDemLodMesh::TILE;
+
+CDemLodMesh::CDemLodMesh(const TDemGridView &grid, bool color_by_std, double max_error_rad) :
+	m_grid(grid),
+	m_color_by_std(color_by_std),
+	m_max_error(max_error_rad),
+	m_levels(0),
+	m_z_min(0), m_z_max(0), m_c_min(0), m_c_max(0),
+	m_pending(false),
+	m_triangles(0)
+{
+	const size_t side = std::max(grid.size_x, grid.size_y);
+	while ((TILE<<m_levels)<side) m_levels++;
+
+	// Height and color ranges of the valid cells, by rows in parallel:
+	float z_min = std::numeric_limits<float>::max(), z_max = -z_min, c_min = z_min, c_max = -z_min;
+	std::mutex mtx;
+	parallel_for(grid.size_y, [&](size_t y0, size_t y1)
+	{
+		float zl = std::numeric_limits<float>::max(), zh = -zl, cl = zl, ch = -zl;
+		for (size_t cy=y0;cy<y1;cy++)
+			for (size_t cx=0;cx<grid.size_x;cx++)
+			{
+				double m, s;
+				grid.fetch(cx,cy,m,s);
+				if (!std::isfinite(m)) continue;
+				const float c = float(m_color_by_std ? s : m);
+				zl = std::min(zl,float(m)); zh = std::max(zh,float(m));
+				if (std::isfinite(c)) { cl = std::min(cl,c); ch = std::max(ch,c); }
+			}
+		std::lock_guard<std::mutex> lk(mtx);
+		z_min = std::min(z_min,zl); z_max = std::max(z_max,zh);
+		c_min = std::min(c_min,cl); c_max = std::max(c_max,ch);
+	}, 16);
+	if (z_min<=z_max) { m_z_min = z_min; m_z_max = z_max; }
+	if (c_min<=c_max) { m_c_min = c_min; m_c_max = c_max; }
+}
+
+void CDemLodMesh::select(int level, size_t tx, size_t ty, double cx, double cy, double cz, std::vector<uint64_t> &keys) const
+{
+	// Distance from the camera to the bbox of the tile:
+	const size_t span = TILE<<level;
+	const double res = m_grid.resolution;
+	const double x0 = m_grid.x_min + res*double(tx*span), x1 = std::min(x0 + res*double(span), m_grid.x_min + res*double(m_grid.size_x));
+	const double y0 = m_grid.y_min + res*double(ty*span), y1 = std::min(y0 + res*double(span), m_grid.y_min + res*double(m_grid.size_y));
+	const double dx = std::max(0.0, std::max(x0-cx, cx-x1));
+	const double dy = std::max(0.0, std::max(y0-cy, cy-y1));
+	const double dz = std::max(0.0, std::max(m_z_min-cz, cz-m_z_max));
+	const double dist = std::sqrt(dx*dx+dy*dy+dz*dz);
+
+	if (level==0 || res*double(size_t(1)<<level) <= m_max_error*dist)
+	{
+		keys.push_back(key(level,tx,ty));
+		return;
+	}
+	const size_t child_span = span/2;
+	for (size_t j=0;j<2;j++)
+		for (size_t i=0;i<2;i++)
+		{
+			const size_t ctx = 2*tx+i, cty = 2*ty+j;
+			if (ctx*child_span<m_grid.size_x && cty*child_span<m_grid.size_y)
+				select(level-1, ctx, cty, cx, cy, cz, keys);
+		}
+}
+
+CSetOfTrianglesPtr CDemLodMesh::buildTile(uint64_t k) const
+{
+	const int level = int(k>>56);
+	const size_t tx = size_t(k & 0xFFFFFFF), ty = size_t((k>>28) & 0xFFFFFFF);
+	const size_t stride = size_t(1)<<level;
+	const size_t cx0 = tx*TILE*stride, cy0 = ty*TILE*stride;
+
+	// Vertices at the cell centers every `stride` cells (a coarse tile misses
+	// less than `stride` cells at the far edges of the grid):
+	const size_t nx = std::min(TILE, (m_grid.size_x-1-cx0)/stride)+1;
+	const size_t ny = std::min(TILE, (m_grid.size_y-1-cy0)/stride)+1;
+	std::vector<float> z(nx*ny), c(nx*ny);
+	for (size_t j=0;j<ny;j++)
+		for (size_t i=0;i<nx;i++)
+		{
+			double m, s;
+			m_grid.fetch(cx0+i*stride, cy0+j*stride, m, s);
+			z[i+j*nx] = float(m);
+			c[i+j*nx] = float(m_color_by_std ? s : m);
+		}
+
+	const double res = m_grid.resolution;
+	const float c_scale = m_c_max>m_c_min ? 1.0f/(m_c_max-m_c_min) : 0.0f;
+	std::vector<CSetOfTriangles::TTriangle> tris;
+	tris.reserve(2*(nx-1)*(ny-1) + 4*(nx+ny));
+	CSetOfTriangles::TTriangle t;
+	const size_t quad[2][3] = { {0,1,3}, {0,3,2} }; // Corners: 0=(i,j) 1=(i+1,j) 2=(i,j+1) 3=(i+1,j+1)
+	for (size_t j=0;j+1<ny;j++)
+		for (size_t i=0;i+1<nx;i++)
+		{
+			const size_t v[4] = { i+j*nx, i+1+j*nx, i+(j+1)*nx, i+1+(j+1)*nx };
+			if (!std::isfinite(z[v[0]]) || !std::isfinite(z[v[1]]) || !std::isfinite(z[v[2]]) || !std::isfinite(z[v[3]]))
+				continue;
+			for (int q=0;q<2;q++)
+			{
+				for (int k3=0;k3<3;k3++)
+				{
+					const size_t corner = quad[q][k3], vi = v[corner];
+					const size_t ci = i + (corner & 1), cj = j + (corner>>1);
+					t.x[k3] = float(m_grid.x_min + res*(double(cx0+ci*stride)+0.5));
+					t.y[k3] = float(m_grid.y_min + res*(double(cy0+cj*stride)+0.5));
+					t.z[k3] = z[vi];
+					const float ci01 = std::isfinite(c[vi]) ? std::min(1.0f, std::max(0.0f, (c[vi]-m_c_min)*c_scale)) : 0.0f;
+					mrpt::utils::colormap(mrpt::utils::cmJET, ci01, t.r[k3], t.g[k3], t.b[k3]);
+					t.a[k3] = 1.0f;
+				}
+				tris.push_back(t);
+			}
+		}
+
+	// Skirts: a vertical strip from each border of the tile down to the lowest
+	// height of the grid, which covers the cracks left where a neighbor of a
+	// different level samples the shared border at other points. Not along the
+	// borders of the grid, which have no neighbor:
+	const bool has_nb[4] = { cx0>0, cy0>0, nx==TILE+1 && cx0+TILE*stride<m_grid.size_x, ny==TILE+1 && cy0+TILE*stride<m_grid.size_y };
+	for (int side=0;side<4;side++)
+	{
+		if (!has_nb[side]) continue;
+		const size_t n = (side & 1) ? nx : ny;
+		for (size_t e=0;e+1<n;e++)
+		{
+			size_t ci[2], cj[2];
+			for (int a=0;a<2;a++)
+			{
+				ci[a] = (side & 1) ? e+a : (side==0 ? 0 : nx-1);
+				cj[a] = (side & 1) ? (side==1 ? 0 : ny-1) : e+a;
+			}
+			const size_t v0 = ci[0]+cj[0]*nx, v1 = ci[1]+cj[1]*nx;
+			if (!std::isfinite(z[v0]) || !std::isfinite(z[v1]))
+				continue;
+			// Corners: 0=top of v0, 1=top of v1, 2=bottom of v1, 3=bottom of v0
+			const size_t strip[2][3] = { {0,1,2}, {0,2,3} };
+			for (int q=0;q<2;q++)
+			{
+				for (int k3=0;k3<3;k3++)
+				{
+					const int corner = int(strip[q][k3]), a = (corner==1 || corner==2) ? 1 : 0;
+					const size_t vi = a ? v1 : v0;
+					t.x[k3] = float(m_grid.x_min + res*(double(cx0+ci[a]*stride)+0.5));
+					t.y[k3] = float(m_grid.y_min + res*(double(cy0+cj[a]*stride)+0.5));
+					t.z[k3] = corner<2 ? z[vi] : m_z_min;
+					const float ci01 = std::isfinite(c[vi]) ? std::min(1.0f, std::max(0.0f, (c[vi]-m_c_min)*c_scale)) : 0.0f;
+					mrpt::utils::colormap(mrpt::utils::cmJET, ci01, t.r[k3], t.g[k3], t.b[k3]);
+					t.a[k3] = 1.0f;
+				}
+				tris.push_back(t);
+			}
+		}
+	}
+
+	CSetOfTrianglesPtr obj = CSetOfTriangles::Create();
+	obj->enableTransparency(false);
+	obj->insertTriangles(tris.begin(), tris.end());
+	return obj;
+}
+
+bool CDemLodMesh::update(double cam_x, double cam_y, double cam_z)
+{
+	if (!m_grid.mean || !m_grid.size_x || !m_grid.size_y)
+		return false;
+	std::vector<uint64_t> keys;
+	select(m_levels, 0, 0, cam_x, cam_y, cam_z, keys);
+	std::sort(keys.begin(), keys.end());
+
+	bool same = keys.size()==m_shown.size();
+	for (size_t i=0;same && i<keys.size();i++)
+		same = m_shown.count(keys[i])!=0;
+	if (same) return false;
+
+	// Build the tiles not shown yet, in parallel:
+	std::vector<uint64_t> missing;
+	for (size_t i=0;i<keys.size();i++)
+		if (!m_shown.count(keys[i])) missing.push_back(keys[i]);
+	std::vector<CSetOfTrianglesPtr> built(missing.size());
+	parallel_for(missing.size(), [&](size_t b, size_t e)
+	{
+		for (size_t i=b;i<e;i++)
+			built[i] = buildTile(missing[i]);
+	}, 1);
+
+	std::map<uint64_t, CSetOfTrianglesPtr> shown;
+	for (size_t i=0;i<missing.size();i++)
+		shown[missing[i]] = built[i];
+	for (size_t i=0;i<keys.size();i++)
+		if (!shown.count(keys[i])) shown[keys[i]] = m_shown[keys[i]];
+	m_shown.swap(shown); // Tiles no longer selected are released by show()
+	m_pending = true;
+	return true;
+}
+
+void CDemLodMesh::show(CSetOfObjects &out)
+{
+	out.clear();
+	m_triangles = 0;
+	for (std::map<uint64_t, CSetOfTrianglesPtr>::const_iterator it=m_shown.begin();it!=m_shown.end();++it)
+	{
+		out.insert(it->second);
+		m_triangles += it->second->getTrianglesCount();
+	}
+	m_pending = false;
+}
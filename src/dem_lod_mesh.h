@@ -0,0 +1,72 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/opengl/CSetOfObjects.h>
+#include <mrpt/opengl/CSetOfTriangles.h>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "dem_predict.h"
+
+/** Level-of-detail triangle mesh of a DEM grid for the 3D viewer (chunked
+  * LOD): a quadtree of tiles of TILE x TILE quads, where a tile of level L
+  * samples its extent every 2^L cells, so every tile costs the same to build
+  * and draw whatever its level. For each camera position, update() selects
+  * the coarsest tiles whose cell spacing is seen under less than the maximum
+  * error angle and builds those not already shown, in parallel; show() then
+  * swaps them into the scene. Only the tiles shown are kept in memory.
+  *
+  * Adjacent tiles of different levels share their border line but not its
+  * vertices, which would leave cracks at the T-junctions. Rather than
+  * snapping the vertices of the finer tile to the coarser one, which would
+  * make each tile depend on the levels of its neighbors, every tile hangs a
+  * skirt from its inner borders down to the lowest height of the grid, so
+  * that tiles can still be built and cached independently.
+  *
+  * Colors come from one colormap over the whole grid (the height, or the std
+  * with `color_by_std`), so that adjacent tiles match. Cells with NaN means
+  * (outside the active mask) are not drawn. The grid must outlive the object.
+  */
+class CDemLodMesh
+{
+public:
+	static const size_t TILE = 64; //!< Quads per tile side
+
+	/** `max_error_rad`: spacing of the vertices of a tile over its distance to the camera */
+	CDemLodMesh(const TDemGridView &grid, bool color_by_std, double max_error_rad);
+
+	/** Selects the tiles for a camera at (x,y,z), in the coordinates of the
+	  * grid, and builds the new ones. Returns true if the selection changed:
+	  * then call show(). Does not touch the scene, which may be rendering. */
+	bool update(double cam_x, double cam_y, double cam_z);
+	/** Replaces the contents of `out` with the selected tiles (lock the scene first) */
+	void show(mrpt::opengl::CSetOfObjects &out);
+	bool hasPendingChanges() const { return m_pending; }
+
+	int getLevels() const { return m_levels; }
+	size_t getTilesShown() const { return m_shown.size(); }
+	size_t getTrianglesShown() const { return m_triangles; }
+
+private:
+	TDemGridView m_grid;
+	bool m_color_by_std;
+	double m_max_error;
+	int m_levels;                //!< Level of the root tile, covering the whole grid
+	float m_z_min, m_z_max;      //!< Height range, for the tile bboxes
+	float m_c_min, m_c_max;      //!< Range of the colored value
+	std::map<uint64_t, mrpt::opengl::CSetOfTrianglesPtr> m_shown; //!< Selected tiles, by key
+	bool m_pending;              //!< m_shown changed since show()
+	size_t m_triangles;
+
+	static uint64_t key(int level, size_t tx, size_t ty) { return (uint64_t(level)<<56) | (uint64_t(ty)<<28) | uint64_t(tx); }
+	void select(int level, size_t tx, size_t ty, double cx, double cy, double cz, std::vector<uint64_t> &keys) const;
+	mrpt::opengl::CSetOfTrianglesPtr buildTile(uint64_t key) const;
+};
@@ -0,0 +1,180 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "dem_predict.h"
+#include "parallel_for.h"
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+using namespace mrpt::maps;
+
+TDemGridView TDemGridView::FromMap(const CHeightGridMap2D_MRF &map)
+{
+	TDemGridView v;
+	v.x_min = map.getXMin();
+	v.y_min = map.getYMin();
+	v.resolution = map.getResolution();
+	v.size_x = map.getSizeX();
+	v.size_y = map.getSizeY();
+	const TRandomFieldCell *c0 = map.cellByIndex(0,0);
+	ASSERT_(c0!=NULL);
+	v.mean = reinterpret_cast<const char*>(&c0->gmrf_mean);
+	v.std  = reinterpret_cast<const char*>(&c0->gmrf_std);
+	v.stride = sizeof(TRandomFieldCell);
+	return v;
+}
+
+// Adapter with the grid interface used by predict_range(), for sparse grids:
+struct TSparseGridAccess
+{
+	const CSparseDemGrid &grid;
+	double x_min, y_min, resolution;
+	size_t size_x, size_y;
+
+	explicit TSparseGridAccess(const CSparseDemGrid &g) : grid(g),
+		x_min(g.getXMin()), y_min(g.getYMin()), resolution(g.getResolution()),
+		size_x(g.getSizeX()), size_y(g.getSizeY())
+	{}
+	inline void fetch(size_t cx, size_t cy, double &m, double &s) const
+	{
+		const TRandomFieldCell *c = grid.cellByIndex(cx,cy);
+		if (c) { m = c->gmrf_mean; s = c->gmrf_std; }
+		else m = s = std::numeric_limits<double>::quiet_NaN();
+	}
+};
+
+// Cells of a TDemGridView of a known value type, so that the float/double
+// dispatch of TDemGridView::fetch() is done once per batch, not per cell:
+template <typename T>
+struct TTypedGridAccess
+{
+	const char *mean, *std;
+	size_t stride;
+	double z_origin, x_min, y_min, resolution;
+	size_t size_x, size_y;
+
+	explicit TTypedGridAccess(const TDemGridView &g) : mean(g.mean), std(g.std), stride(g.stride),
+		z_origin(g.z_origin), x_min(g.x_min), y_min(g.y_min), resolution(g.resolution),
+		size_x(g.size_x), size_y(g.size_y)
+	{}
+	inline void fetch(size_t cx, size_t cy, double &m, double &s) const
+	{
+		const size_t off = (cx+cy*size_x)*stride;
+		m = z_origin + *reinterpret_cast<const T*>(mean+off);
+		s = *reinterpret_cast<const T*>(std+off);
+	}
+};
+
+// Points are processed in blocks: footprints and weights for the whole block,
+// then the (scalar) cell lookups, then both interpolants, so that all loops
+// but the lookups and the final sqrt() are branch-free and vectorize.
+template <class GRID>
+static void predict_range(const GRID &g, const double *xs, const double *ys, size_t i0, size_t i1, TBatchPrediction &out)
+{
+	const size_t PB = 64;
+	const double inv_res = 1.0/g.resolution;
+	const double x_min = g.x_min, y_min = g.y_min;
+	const int max_cx = int(g.size_x)-1, max_cy = int(g.size_y)-1;
+	const double max_cx0 = std::max(0,max_cx-1), max_cy0 = std::max(0,max_cy-1);
+	int cx0[PB], cy0[PB];
+	double u[PB], v[PB], tx[PB], ty[PB], m[4][PB], sd[4][PB];
+	double ok_w[4][PB], ok_m[4][PB], ok_v[4][PB];
+
+	for (size_t b=i0;b<i1;b+=PB)
+	{
+		const size_t n = std::min(PB, i1-b);
+		const double *bx = xs+b, *by = ys+b;
+
+		// Bottom-left cell of the 2x2 footprint, and the bilinear weights, from
+		// the continuous cell coordinates (cell centers at integer values).
+		// Clamped before truncating, which is then the same as floor(), in a
+		// loop of its own so that the conversion is not done conditionally:
+		for (size_t k=0;k<n;k++)
+		{
+			u[k] = (bx[k]-x_min)*inv_res - 0.5;
+			v[k] = (by[k]-y_min)*inv_res - 0.5;
+			tx[k] = std::min(max_cx0, std::max(0.0, u[k]));
+			ty[k] = std::min(max_cy0, std::max(0.0, v[k]));
+		}
+		for (size_t k=0;k<n;k++)
+		{
+			cx0[k] = int(tx[k]);
+			cy0[k] = int(ty[k]);
+			tx[k] = std::min(1.0, std::max(0.0, u[k]-cx0[k]));
+			ty[k] = std::min(1.0, std::max(0.0, v[k]-cy0[k]));
+		}
+
+		// Cell lookups. Cells outside the active mask hold NaN: the bilinear
+		// interpolant drops them and renormalizes the weights of the rest.
+		for (size_t k=0;k<n;k++)
+		{
+			const size_t x0 = size_t(cx0[k]), y0 = size_t(cy0[k]);
+			const size_t x1 = size_t(std::min(max_cx, cx0[k]+1)), y1 = size_t(std::min(max_cy, cy0[k]+1));
+			g.fetch(x0,y0,m[0][k],sd[0][k]); g.fetch(x1,y0,m[1][k],sd[1][k]);
+			g.fetch(x0,y1,m[2][k],sd[2][k]); g.fetch(x1,y1,m[3][k],sd[3][k]);
+			for (int c=0;c<4;c++)
+			{
+				const bool ok = m[c][k]==m[c][k];
+				ok_w[c][k] = ok ? 1.0 : 0.0;
+				ok_m[c][k] = ok ? m[c][k] : 0.0;
+				ok_v[c][k] = ok ? sd[c][k]*sd[c][k] : 0.0;
+			}
+		}
+
+		// Nearest neighbor: the cell of the footprint containing the point:
+		double *z_bi = &out.z_bi[b], *v_bi = &out.std_bi[b], *z_nn = &out.z_nn[b], *s_nn = &out.std_nn[b];
+		for (size_t k=0;k<n;k++)
+		{
+			const bool right = tx[k]>=0.5, up = ty[k]>=0.5;
+			const double zb = right ? m[1][k] : m[0][k], zt = right ? m[3][k] : m[2][k];
+			const double sb = right ? sd[1][k] : sd[0][k], st = right ? sd[3][k] : sd[2][k];
+			z_nn[k] = up ? zt : zb;
+			s_nn[k] = up ? st : sb;
+		}
+
+		// Bilinear, NaN if all 4 cells are: then W=zw=vw=0 and 0*(1/0) is NaN,
+		// with no branch in the loop:
+		for (size_t k=0;k<n;k++)
+		{
+			const double w[4] = { (1-tx[k])*(1-ty[k]), tx[k]*(1-ty[k]), (1-tx[k])*ty[k], tx[k]*ty[k] };
+			double W = 0, zw = 0, vw = 0;
+			for (int c=0;c<4;c++)
+			{
+				const double wc = w[c]*ok_w[c][k];
+				W += wc; zw += wc*ok_m[c][k]; vw += wc*ok_v[c][k];
+			}
+			const double iW = 1.0/W;
+			z_bi[k] = zw*iW;
+			v_bi[k] = vw*iW;
+		}
+		for (size_t k=0;k<n;k++)
+			v_bi[k] = std::sqrt(v_bi[k]);
+	}
+}
+
+template <class GRID>
+static void predict_batch_impl(const GRID &grid, const double *xs, const double *ys, size_t n, TBatchPrediction &out, bool parallel)
+{
+	out.resize(n);
+	ASSERT_(grid.size_x>0 && grid.size_y>0);
+	if (!parallel)
+		predict_range(grid,xs,ys,0,n,out);
+	else parallel_for(n, [&](size_t i0, size_t i1) { predict_range(grid,xs,ys,i0,i1,out); });
+}
+
+void predict_batch(const TDemGridView &grid, const double *xs, const double *ys, size_t n, TBatchPrediction &out, bool parallel)
+{
+	if (grid.is_float32) predict_batch_impl(TTypedGridAccess<float>(grid),xs,ys,n,out,parallel);
+	else predict_batch_impl(TTypedGridAccess<double>(grid),xs,ys,n,out,parallel);
+}
+
+void predict_batch(const CSparseDemGrid &grid, const double *xs, const double *ys, size_t n, TBatchPrediction &out, bool parallel)
+{
+	predict_batch_impl(TSparseGridAccess(grid),xs,ys,n,out,parallel);
+}
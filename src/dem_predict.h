@@ -0,0 +1,74 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/maps/CHeightGridMap2D_MRF.h>
+#include <vector>
+#include "sparse_block_grid.h"
+
+/** Read-only view of the mean/std values of a DEM grid. Cells are stored
+  * row-major (cx + cy*size_x), `stride` bytes apart, so this can point straight
+  * into the array of TRandomFieldCell structs of a CHeightGridMap2D_MRF, or into
+  * the planes of a CSoADemGrid (heights relative to `z_origin`). */
+struct TDemGridView
+{
+	double x_min, y_min, resolution;
+	size_t size_x, size_y;
+	const char *mean, *std; //!< Address of the mean/std of cell (0,0)
+	size_t stride;          //!< Bytes between consecutive cells
+	bool   is_float32;      //!< Values are `float` (else `double`)
+	double z_origin;        //!< Added to the stored means
+
+	TDemGridView() : x_min(0), y_min(0), resolution(1), size_x(0), size_y(0), mean(NULL), std(NULL), stride(0), is_float32(false), z_origin(0) {}
+
+	static TDemGridView FromMap(const mrpt::maps::CHeightGridMap2D_MRF &map);
+
+	/** True if mean/std are packed planes (SoA storage, see CSoADemGrid) */
+	inline bool isPlanar() const { return stride == (is_float32 ? sizeof(float) : sizeof(double)); }
+
+	inline void fetch(size_t cx, size_t cy, double &m, double &s) const
+	{
+		const size_t off = (cx+cy*size_x)*stride;
+		if (is_float32) {
+			m = z_origin + *reinterpret_cast<const float*>(mean+off);
+			s = *reinterpret_cast<const float*>(std+off);
+		}
+		else {
+			m = z_origin + *reinterpret_cast<const double*>(mean+off);
+			s = *reinterpret_cast<const double*>(std+off);
+		}
+	}
+};
+
+/** DEM grid with sparse, block-hashed storage (see CSparseBlockGrid) */
+typedef CSparseBlockGrid<mrpt::maps::TRandomFieldCell> CSparseDemGrid;
+
+/** Output of predict_batch(): nearest-neighbor and bilinear interpolants */
+struct TBatchPrediction
+{
+	std::vector<double> z_nn, std_nn, z_bi, std_bi;
+	void resize(size_t n) { z_nn.resize(n); std_nn.resize(n); z_bi.resize(n); std_bi.resize(n); }
+};
+
+/** Predicts DEM heights at the points (xs[i],ys[i]), i=0..n-1, computing the
+  * nearest-neighbor and the bilinear interpolants (plus their std) from a single
+  * lookup of the 2x2 cell footprint per point (the one whose cell centers
+  * surround it), for the same purpose as CRandomFieldGridMap2D::predictMeasurement()
+  * with gimNearest and gimBilinear, but not identical to it:
+  *  - Nearest neighbor is the footprint cell containing the point.
+  *  - Bilinear drops no-data (NaN) cells and renormalizes the weights of the
+  *    rest (NaN if all 4 are). Its std is the sqrt of the weighted variances.
+  *  - Near the grid border the footprint is clamped into the grid, and the
+  *    weights to [0,1], so points outside get the value at the nearest border.
+  * Points are split across threads unless `parallel` is false (e.g. when
+  * already called from a worker thread).
+  */
+void predict_batch(const TDemGridView &grid, const double *xs, const double *ys, size_t n, TBatchPrediction &out, bool parallel = true);
+/** \overload Cells of non-materialized blocks are treated as no-data. */
+void predict_batch(const CSparseDemGrid &grid, const double *xs, const double *ys, size_t n, TBatchPrediction &out, bool parallel = true);
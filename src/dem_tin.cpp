@@ -0,0 +1,344 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "dem_tin.h"
+#include "parallel_for.h"
+#include <mrpt/utils/CFileOutputStream.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <unordered_map>
+
+using namespace std;
+
+// Vertical errors are non-negative floats, whose bit patterns sort like their
+// values: they are kept as atomic integers to take maxima from any thread.
+static inline uint32_t err_bits(float e) { uint32_t b; memcpy(&b,&e,sizeof(b)); return b; }
+static inline float err_value(uint32_t b) { float e; memcpy(&e,&b,sizeof(e)); return e; }
+static inline void atomic_max(std::atomic<uint32_t> &a, uint32_t v)
+{
+	uint32_t cur = a.load(std::memory_order_relaxed);
+	while (cur<v && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed)) {}
+}
+
+// Height of a vertex of the tiled grid (NaN outside the DEM):
+static inline double tin_z(const TDemGridView &g, long x, long y)
+{
+	if (size_t(x)>=g.size_x || size_t(y)>=g.size_y) return std::numeric_limits<double>::quiet_NaN();
+	double m, s;
+	g.fetch(size_t(x),size_t(y),m,s);
+	return m;
+}
+
+// A triangle of the RTIN: `a`-`b` is the longest edge, `c` the right angle.
+struct TTinTri { long ax, ay, bx, by, cx, cy; };
+
+// Triangle `i` of a tile of side T: the two halves of the tile first, then
+// their children, and so on (level L has 2^(L+1) triangles).
+static TTinTri decode_triangle(size_t i, long T)
+{
+	size_t id = i+2;
+	TTinTri t;
+	if (id & 1) { t.ax=0; t.ay=0; t.bx=T; t.by=T; t.cx=T; t.cy=0; }
+	else        { t.ax=T; t.ay=T; t.bx=0; t.by=0; t.cx=0; t.cy=T; }
+	while ((id >>= 1) > 1)
+	{
+		const long mx = (t.ax+t.bx)/2, my = (t.ay+t.by)/2;
+		if (id & 1) { t.bx=t.ax; t.by=t.ay; t.ax=t.cx; t.ay=t.cy; } // (c,a,m)
+		else        { t.ax=t.bx; t.ay=t.by; t.bx=t.cx; t.by=t.cy; } // (b,c,m)
+		t.cx=mx; t.cy=my;
+	}
+	return t;
+}
+
+static float round_up(double e)
+{
+	float f = float(e);
+	if (double(f)<e) f = std::nextafter(f, std::numeric_limits<float>::infinity());
+	return f;
+}
+
+// Max. vertical distance between the cells covered by `t` and the plane
+// through its vertices, rounded up to float. Returns as soon as it exceeds
+// `stop`. Triangles with some NaN cells have an infinite error (they are
+// split down to the cells), those with all NaN cells zero.
+static float triangle_error(const TDemGridView &g, const TTinTri &t, double stop)
+{
+	const float INF = std::numeric_limits<float>::infinity();
+	const double za = tin_z(g,t.ax,t.ay), zb = tin_z(g,t.bx,t.by), zc = tin_z(g,t.cx,t.cy);
+	const bool all_nan = za!=za && zb!=zb && zc!=zc;
+	if (!all_nan && (za!=za || zb!=zb || zc!=zc)) return INF;
+
+	const long x0 = std::min(t.ax,std::min(t.bx,t.cx)), x1 = std::max(t.ax,std::max(t.bx,t.cx));
+	const long y0 = std::min(t.ay,std::min(t.by,t.cy)), y1 = std::max(t.ay,std::max(t.by,t.cy));
+	const long area2 = (t.bx-t.ax)*(t.cy-t.ay) - (t.by-t.ay)*(t.cx-t.ax);
+	const double inv_area2 = 1.0/double(area2);
+	double max_e = 0;
+	for (long y=y0;y<=y1;y++)
+		for (long x=x0;x<=x1;x++)
+		{
+			// Barycentric coordinates (times area2) w.r.t. the edges opposite to a, b and c:
+			const long wa = (t.cx-t.bx)*(y-t.by) - (t.cy-t.by)*(x-t.bx);
+			const long wb = (t.ax-t.cx)*(y-t.cy) - (t.ay-t.cy)*(x-t.cx);
+			const long wc = (t.bx-t.ax)*(y-t.ay) - (t.by-t.ay)*(x-t.ax);
+			if (area2>0 ? (wa<0 || wb<0 || wc<0) : (wa>0 || wb>0 || wc>0)) continue;
+			const double z = tin_z(g,x,y);
+			if (all_nan ? z==z : z!=z) return INF;
+			if (all_nan) continue;
+			const double e = std::abs(z - (wa*za + wb*zb + wc*zc)*inv_area2);
+			if (e>max_e) {
+				max_e = e;
+				if (max_e>stop) return round_up(max_e);
+			}
+		}
+	return round_up(max_e);
+}
+
+namespace
+{
+	// Triangles emitted by one tile, with its own numbering of the vertices:
+	struct TTileMesh
+	{
+		TTileMesh() : max_error(0), valid_cells(0) {}
+		std::vector<uint64_t> verts;  //!< Global vertex (x,y), as x | y<<32
+		std::vector<uint32_t> faces;  //!< Indices in `verts`
+		float max_error;
+		size_t valid_cells;
+	};
+
+	struct TTileEmitter
+	{
+		const TDemGridView &g;
+		const std::atomic<uint32_t> *err;
+		size_t W;                     //!< Vertices per row of the tiled grid
+		long ox, oy, T;
+		float max_error;
+		std::vector<int32_t> &local;  //!< (T+1)^2 local indices of the tile vertices, -1: none yet
+		TTileMesh &out;
+
+		uint32_t vertex(long x, long y)
+		{
+			int32_t &idx = local[size_t(x-ox) + size_t(y-oy)*size_t(T+1)];
+			if (idx<0) {
+				idx = int32_t(out.verts.size());
+				out.verts.push_back(uint64_t(x) | (uint64_t(y)<<32));
+			}
+			return uint32_t(idx);
+		}
+
+		void process(long ax, long ay, long bx, long by, long cx, long cy)
+		{
+			const long mx = (ax+bx)/2, my = (ay+by)/2;
+			const bool leaf = std::abs(ax-cx)+std::abs(ay-cy)<=1;
+			const float e = leaf ? 0.0f : err_value(err[size_t(mx)+size_t(my)*W].load(std::memory_order_relaxed));
+			if (!leaf && e>max_error)
+			{
+				process(cx,cy, ax,ay, mx,my);
+				process(bx,by, cx,cy, mx,my);
+				return;
+			}
+			const double za = tin_z(g,ax,ay), zb = tin_z(g,bx,by), zc = tin_z(g,cx,cy);
+			if (za!=za || zb!=zb || zc!=zc) return;
+			if ((bx-ax)*(cy-ay) - (by-ay)*(cx-ax) < 0) { std::swap(bx,cx); std::swap(by,cy); }
+			out.faces.push_back(vertex(ax,ay));
+			out.faces.push_back(vertex(bx,by));
+			out.faces.push_back(vertex(cx,cy));
+			out.max_error = std::max(out.max_error, e);
+		}
+	};
+}
+
+void build_dem_tin(const TDemGridView &g, double max_error, TDemTin &out, const TGridFrame *frame)
+{
+	if (!(max_error>0))
+		THROW_EXCEPTION("The vertical tolerance of the TIN must be positive");
+	if (!g.mean)
+		THROW_EXCEPTION("The TIN requires a dense, SoA or compact grid storage");
+
+	const long T = long(TIN_TILE);
+	int k = 0;
+	while ((1L<<k)<T) k++;
+	const size_t ntx = std::max<size_t>(1, (g.size_x+TIN_TILE-2)/TIN_TILE);
+	const size_t nty = std::max<size_t>(1, (g.size_y+TIN_TILE-2)/TIN_TILE);
+	const size_t n_tiles = ntx*nty, W = ntx*TIN_TILE+1, H = nty*TIN_TILE+1;
+
+	// Errors at the middle of the longest edge of each triangle (each vertex
+	// is the middle of one or two triangles of the same level), bottom-up:
+	std::unique_ptr<std::atomic<uint32_t>[]> err(new std::atomic<uint32_t>[W*H]);
+	parallel_for(W*H, [&](size_t b, size_t e) { for (size_t i=b;i<e;i++) err[i].store(0, std::memory_order_relaxed); }, 1<<16);
+
+	for (int level=2*k-1;level>=0;level--)
+	{
+		const size_t first = (size_t(2)<<level)-2, count = size_t(2)<<level;
+		parallel_for(n_tiles*count, [&](size_t b, size_t e)
+		{
+			for (size_t j=b;j<e;j++)
+			{
+				const size_t tile = j/count;
+				const long ox = long((tile%ntx)*TIN_TILE), oy = long((tile/ntx)*TIN_TILE);
+				TTinTri t = decode_triangle(first + j%count, T);
+				t.ax+=ox; t.bx+=ox; t.cx+=ox; t.ay+=oy; t.by+=oy; t.cy+=oy;
+				const size_t m = size_t((t.ax+t.bx)/2) + size_t((t.ay+t.by)/2)*W;
+
+				// A triangle with a split child is split anyway: no need to scan it
+				float e_tri = 0;
+				if (level<2*k-1)
+					e_tri = std::max(err_value(err[size_t((t.ax+t.cx)/2) + size_t((t.ay+t.cy)/2)*W].load(std::memory_order_relaxed)),
+					                 err_value(err[size_t((t.bx+t.cx)/2) + size_t((t.by+t.cy)/2)*W].load(std::memory_order_relaxed)));
+				if (e_tri<=max_error)
+				{
+					// The planes of the children differ from this one by at most the
+					// deviation `d` of the middle point, so its error is bounded by
+					// theirs plus `d`: the cells are only scanned if that is too loose.
+					const double za = tin_z(g,t.ax,t.ay), zb = tin_z(g,t.bx,t.by), zm = tin_z(g,(t.ax+t.bx)/2,(t.ay+t.by)/2);
+					const double bound = e_tri + std::abs(zm-0.5*(za+zb));
+					if (bound<=max_error && tin_z(g,t.cx,t.cy)==tin_z(g,t.cx,t.cy)) e_tri = round_up(bound);
+					else e_tri = std::max(e_tri, triangle_error(g, t, max_error));
+				}
+				atomic_max(err[m], err_bits(e_tri));
+			}
+		}, 256);
+	}
+
+	// Triangles of each tile, in parallel:
+	std::vector<TTileMesh> tiles(n_tiles);
+	parallel_for(n_tiles, [&](size_t b, size_t e)
+	{
+		std::vector<int32_t> local(size_t(T+1)*size_t(T+1), -1);
+		for (size_t tile=b;tile<e;tile++)
+		{
+			const long ox = long((tile%ntx)*TIN_TILE), oy = long((tile/ntx)*TIN_TILE);
+			TTileEmitter em = { g, err.get(), W, ox, oy, T, float(max_error), local, tiles[tile] };
+			em.process(ox,oy, ox+T,oy+T, ox+T,oy);
+			em.process(ox+T,oy+T, ox,oy, ox,oy+T);
+			for (size_t i=0;i<tiles[tile].verts.size();i++)
+			{
+				const uint64_t v = tiles[tile].verts[i];
+				local[size_t(long(v & 0xFFFFFFFF)-ox) + size_t(long(v>>32)-oy)*size_t(T+1)] = -1;
+			}
+			// The last row and column of tiles also own the cells on their far border:
+			const long ex = tile%ntx==ntx-1 ? ox+T+1 : ox+T, ey = tile/ntx==nty-1 ? oy+T+1 : oy+T;
+			for (long y=oy;y<ey;y++)
+				for (long x=ox;x<ex;x++)
+					if (tin_z(g,x,y)==tin_z(g,x,y)) tiles[tile].valid_cells++;
+		}
+	}, 1);
+	err.reset();
+
+	// Merge the tiles: vertices on their borders are shared with the neighbors
+	std::vector<uint64_t> verts;
+	out.faces.clear();
+	out.max_error = 0;
+	out.grid_vertices = 0;
+	std::unordered_map<uint64_t,uint32_t> shared;
+	std::vector<uint32_t> remap;
+	for (size_t tile=0;tile<n_tiles;tile++)
+	{
+		const TTileMesh &tm = tiles[tile];
+		remap.resize(tm.verts.size());
+		for (size_t i=0;i<tm.verts.size();i++)
+		{
+			const uint64_t v = tm.verts[i];
+			if ((v & 0xFFFFFFFF)%TIN_TILE==0 || (v>>32)%TIN_TILE==0)
+			{
+				const std::pair<std::unordered_map<uint64_t,uint32_t>::iterator,bool> ins = shared.insert(std::make_pair(v, uint32_t(verts.size())));
+				if (ins.second) verts.push_back(v);
+				remap[i] = ins.first->second;
+			}
+			else {
+				remap[i] = uint32_t(verts.size());
+				verts.push_back(v);
+			}
+		}
+		if (verts.size()>=std::numeric_limits<uint32_t>::max())
+			THROW_EXCEPTION("The TIN has too many vertices: use a larger tolerance");
+		for (size_t i=0;i<tm.faces.size();i++)
+			out.faces.push_back(remap[tm.faces[i]]);
+		out.max_error = std::max(out.max_error, double(tm.max_error));
+		out.grid_vertices += tm.valid_cells;
+		std::vector<uint64_t>().swap(tiles[tile].verts);
+		std::vector<uint32_t>().swap(tiles[tile].faces);
+	}
+
+	// Coordinates of the cell centers:
+	out.xyz.resize(3*verts.size());
+	parallel_for(verts.size(), [&](size_t b, size_t e)
+	{
+		for (size_t i=b;i<e;i++)
+		{
+			const long x = long(verts[i] & 0xFFFFFFFF), y = long(verts[i]>>32);
+			double wx = g.x_min + g.resolution*(double(x)+0.5), wy = g.y_min + g.resolution*(double(y)+0.5);
+			if (frame) frame->toWorld(wx, wy, wx, wy);
+			out.xyz[3*i+0] = wx;
+			out.xyz[3*i+1] = wy;
+			out.xyz[3*i+2] = tin_z(g,x,y);
+		}
+	});
+}
+
+void TDemTin::saveToPLY(const std::string &file) const
+{
+	mrpt::utils::CFileOutputStream fil(file);
+	const uint16_t one = 1;
+	const bool little_endian = *reinterpret_cast<const uint8_t*>(&one)==1;
+	fil.printf("ply\nformat %s 1.0\n", little_endian ? "binary_little_endian" : "binary_big_endian");
+	fil.printf("comment dem-gmrf TIN, max. vertical error %f\n", max_error);
+	fil.printf("element vertex %u\nproperty double x\nproperty double y\nproperty double z\n", (unsigned)getVertexCount());
+	fil.printf("element face %u\nproperty list uchar uint vertex_indices\nend_header\n", (unsigned)getTriangleCount());
+	if (!xyz.empty())
+		fil.WriteBuffer(&xyz[0], xyz.size()*sizeof(double));
+
+	// Faces, in blocks of packed `3 i j k` records:
+	const size_t BLOCK = 1<<16, REC = 1+3*sizeof(uint32_t);
+	std::vector<uint8_t> buf;
+	for (size_t f0=0;f0<getTriangleCount();f0+=BLOCK)
+	{
+		const size_t n = std::min(BLOCK, getTriangleCount()-f0);
+		buf.resize(n*REC);
+		for (size_t f=0;f<n;f++)
+		{
+			buf[f*REC] = 3;
+			memcpy(&buf[f*REC+1], &faces[3*(f0+f)], 3*sizeof(uint32_t));
+		}
+		fil.WriteBuffer(&buf[0], buf.size());
+	}
+}
+
+void TDemTin::saveToOBJ(const std::string &file) const
+{
+	mrpt::utils::CFileOutputStream fil(file);
+	fil.printf("# dem-gmrf TIN, max. vertical error %f\n", max_error);
+
+	// Lines are formatted in blocks, in parallel:
+	const size_t BLOCK = 1<<16, nv = getVertexCount(), nf = getTriangleCount();
+	const size_t n_blocks = (nv+BLOCK-1)/BLOCK + (nf+BLOCK-1)/BLOCK;
+	std::vector<std::string> text(n_blocks);
+	parallel_for(n_blocks, [&](size_t b, size_t e)
+	{
+		char tmp[128];
+		for (size_t blk=b;blk<e;blk++)
+		{
+			const bool is_vertex = blk*BLOCK<nv;
+			const size_t i0 = is_vertex ? blk*BLOCK : (blk-(nv+BLOCK-1)/BLOCK)*BLOCK;
+			const size_t i1 = std::min(i0+BLOCK, is_vertex ? nv : nf);
+			std::string &s = text[blk];
+			for (size_t i=i0;i<i1;i++)
+			{
+				const int len = is_vertex ?
+					snprintf(tmp,sizeof(tmp),"v %f %f %f\n", xyz[3*i], xyz[3*i+1], xyz[3*i+2]) :
+					snprintf(tmp,sizeof(tmp),"f %u %u %u\n", faces[3*i]+1, faces[3*i+1]+1, faces[3*i+2]+1);
+				s.append(tmp, len>0 ? size_t(len) : 0);
+			}
+		}
+	}, 1);
+	for (size_t blk=0;blk<n_blocks;blk++)
+		fil.WriteBuffer(text[blk].data(), text[blk].size());
+}
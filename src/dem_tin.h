@@ -0,0 +1,56 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "dem_predict.h"
+#include "grid_frame.h"
+
+/** Triangulated irregular network (TIN) approximating a DEM grid */
+struct TDemTin
+{
+	TDemTin() : max_error(0), grid_vertices(0) {}
+
+	std::vector<double>   xyz;   //!< Vertices, 3 coordinates each
+	std::vector<uint32_t> faces; //!< Triangles, 3 vertex indices each, counterclockwise seen from above
+	double max_error;            //!< Bound of the vertical error of the surface at the cell centers
+	size_t grid_vertices;        //!< Valid cells of the grid it approximates
+
+	size_t getVertexCount() const { return xyz.size()/3; }
+	size_t getTriangleCount() const { return faces.size()/3; }
+
+	/** Binary PLY (double vertex coordinates, uint vertex indices) */
+	void saveToPLY(const std::string &file) const;
+	/** Wavefront OBJ (text: the format has no binary variant) */
+	void saveToOBJ(const std::string &file) const;
+};
+
+const size_t TIN_TILE = 256; //!< Cells per tile side in build_dem_tin() (a power of 2)
+
+/** Builds a TIN from the mean of `grid`, with a vertex on each cell center it
+  * keeps, whose height differs from that of the grid by at most `max_error`
+  * at every valid cell center.
+  *
+  * The TIN is a right-triangulated irregular network (RTIN): the grid is cut
+  * into tiles of TIN_TILE x TIN_TILE cells, each split by a diagonal and then
+  * by recursive bisection of the triangles at the middle of their longest
+  * edge. A triangle is split if the plane through its vertices misses any
+  * cell it covers by more than `max_error`, or if any of its descendants, or
+  * the triangle on the other side of its longest edge, is split: so that the
+  * surface has no cracks, also across tiles. The errors are found bottom-up,
+  * one level at a time with all the tiles in parallel, and the triangles are
+  * then emitted tile by tile in parallel.
+  *
+  * Cells with a NaN mean (outside the active mask) are not covered: the mesh
+  * keeps the full resolution along their boundary. Vertices are in the
+  * coordinates of the grid, or in world coordinates through `frame`. */
+void build_dem_tin(const TDemGridView &grid, double max_error, TDemTin &out, const TGridFrame *frame = NULL);
@@ -0,0 +1,592 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+// Python module `demgmrf`: CDemGmrfPipeline over the buffer protocol, so that
+// numpy point arrays are used in place and the DEM grids are returned as views
+// of the grid storage (numpy.asarray() wraps them without copying). The GIL is
+// released while the stages run, so DEMs can be built from several threads.
+
+#include <Python.h> // First, as required by Python
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "dem_gmrf_pipeline.h"
+#include "residual_stats.h"
+#include "thread_pool.h"
+
+// ---------------------------------------------------------------------------
+//  Buffer: read-only 1-D/2-D array exported to Python, either a view into the
+//  grid of a Pipeline (kept alive by `owner`) or an owned vector of doubles
+// ---------------------------------------------------------------------------
+struct PyPipeline;
+
+struct PyDemBuffer
+{
+	PyObject_HEAD
+	PyPipeline *owner;           //!< NULL if `owned` holds the data
+	std::vector<double> *owned;
+	const char *data;
+	int ndim;
+	Py_ssize_t shape[2], strides[2];
+	bool is_float32;
+};
+
+struct PyPipeline
+{
+	PyObject_HEAD
+	CDemGmrfPipeline *dem;
+	Py_buffer points;            //!< Caller's points, held while the pipeline uses them
+	bool has_points;
+	std::vector<float> *converted; //!< Points given in float64, converted once
+	bool busy;                   //!< A stage is running (with the GIL released)
+	Py_ssize_t n_views;          //!< Alive PyDemBuffer views of the grid
+};
+
+/** Pipelines running a stage (with the GIL released) on the shared thread
+  * pool: set_threads() must not restart it under them. Guarded by the GIL */
+static int g_stages_running = 0;
+
+static PyTypeObject PyDemBuffer_Type = { PyVarObject_HEAD_INIT(NULL, 0) };
+static PyTypeObject PyPipeline_Type = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+static void PyDemBuffer_dealloc(PyDemBuffer *self)
+{
+	if (self->owner) {
+		self->owner->n_views--;
+		Py_DECREF(self->owner);
+	}
+	delete self->owned;
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static int PyDemBuffer_getbuffer(PyDemBuffer *self, Py_buffer *view, int flags)
+{
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "demgmrf buffers are read-only");
+		return -1;
+	}
+	const Py_ssize_t itemsize = self->is_float32 ? sizeof(float) : sizeof(double);
+	const bool c_contiguous = self->strides[self->ndim-1]==itemsize && (self->ndim==1 || self->strides[0]==itemsize*self->shape[1]);
+	if (!c_contiguous && (flags & PyBUF_STRIDES)!=PyBUF_STRIDES) {
+		PyErr_SetString(PyExc_BufferError, "demgmrf buffer is strided: request it with PyBUF_STRIDES (numpy.asarray() does)");
+		return -1;
+	}
+	view->obj = (PyObject*)self;
+	Py_INCREF(self);
+	view->buf = const_cast<char*>(self->data);
+	view->len = itemsize*self->shape[0]*(self->ndim==2 ? self->shape[1] : 1);
+	view->readonly = 1;
+	view->itemsize = itemsize;
+	view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>(self->is_float32 ? "f" : "d") : NULL;
+	view->ndim = self->ndim;
+	view->shape = (flags & PyBUF_ND)==PyBUF_ND ? self->shape : NULL;
+	view->strides = (flags & PyBUF_STRIDES)==PyBUF_STRIDES ? self->strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static PyBufferProcs PyDemBuffer_as_buffer = { (getbufferproc)PyDemBuffer_getbuffer, NULL };
+
+/** Wraps the buffer in a memoryview, which numpy.asarray() accepts as is */
+static PyObject *as_memoryview(PyDemBuffer *b)
+{
+	if (!b) return NULL;
+	PyObject *mv = PyMemoryView_FromObject((PyObject*)b);
+	Py_DECREF(b);
+	return mv;
+}
+
+static PyObject *new_vector_buffer(const Eigen::VectorXd &v)
+{
+	PyDemBuffer *b = PyObject_New(PyDemBuffer, &PyDemBuffer_Type);
+	if (!b) return NULL;
+	b->owner = NULL;
+	b->owned = new std::vector<double>(v.data(), v.data()+v.size());
+	b->data = reinterpret_cast<const char*>(b->owned->empty() ? NULL : &(*b->owned)[0]);
+	b->ndim = 1;
+	b->shape[0] = Py_ssize_t(v.size()); b->shape[1] = 1;
+	b->strides[0] = sizeof(double); b->strides[1] = 0;
+	b->is_float32 = false;
+	return as_memoryview(b);
+}
+
+// ---------------------------------------------------------------------------
+//  Pipeline
+// ---------------------------------------------------------------------------
+/** Sets a RuntimeError unless the pipeline is initialized and idle */
+static bool check_idle(PyPipeline *self)
+{
+	if (!self->dem) {
+		PyErr_SetString(PyExc_RuntimeError, "Pipeline not initialized");
+		return false;
+	}
+	if (self->busy) {
+		PyErr_SetString(PyExc_RuntimeError, "The pipeline is running a stage in another thread");
+		return false;
+	}
+	return true;
+}
+
+/** Runs `f` with the GIL released, turning C++ exceptions into RuntimeError */
+template <class FUNC>
+static bool run_released(PyPipeline *self, FUNC f)
+{
+	if (!check_idle(self)) return false;
+	self->busy = true;
+	g_stages_running++;
+	std::string err;
+	Py_BEGIN_ALLOW_THREADS
+	try {
+		f();
+	} catch (std::exception &e) {
+		err = e.what();
+		if (err.empty()) err = "Unknown error";
+	} catch (...) {
+		err = "Unknown error";
+	}
+	Py_END_ALLOW_THREADS
+	g_stages_running--;
+	self->busy = false;
+	if (!err.empty()) {
+		PyErr_SetString(PyExc_RuntimeError, err.c_str());
+		return false;
+	}
+	return true;
+}
+
+static void release_points(PyPipeline *self)
+{
+	if (self->has_points) {
+		PyBuffer_Release(&self->points);
+		self->has_points = false;
+	}
+	delete self->converted;
+	self->converted = NULL;
+}
+
+static PyObject *PyPipeline_new(PyTypeObject *type, PyObject *, PyObject *)
+{
+	PyPipeline *self = (PyPipeline*)type->tp_alloc(type, 0);
+	if (!self) return NULL;
+	self->dem = NULL;
+	self->has_points = false;
+	self->converted = NULL;
+	self->busy = false;
+	self->n_views = 0;
+	return (PyObject*)self;
+}
+
+static void PyPipeline_dealloc(PyPipeline *self)
+{
+	delete self->dem;
+	release_points(self);
+	Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static bool parse_aoi(PyObject *obj, TPolygon2D &aoi)
+{
+	PyObject *seq = PySequence_Fast(obj, "`aoi` must be a sequence of (x,y) vertices");
+	if (!seq) return false;
+	const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+	for (Py_ssize_t i=0;i<n;i++)
+	{
+		PyObject *v = PySequence_Fast(PySequence_Fast_GET_ITEM(seq,i), "`aoi` vertices must be (x,y) pairs");
+		const bool is_pair = v && PySequence_Fast_GET_SIZE(v)==2;
+		const double x = is_pair ? PyFloat_AsDouble(PySequence_Fast_GET_ITEM(v,0)) : 0;
+		const double y = is_pair ? PyFloat_AsDouble(PySequence_Fast_GET_ITEM(v,1)) : 0;
+		Py_XDECREF(v);
+		if (v && !is_pair) PyErr_SetString(PyExc_TypeError, "`aoi` vertices must be (x,y) pairs");
+		if (PyErr_Occurred()) {
+			Py_DECREF(seq);
+			return false;
+		}
+		aoi.xs.push_back(x);
+		aoi.ys.push_back(y);
+	}
+	Py_DECREF(seq);
+	if (n<3) {
+		PyErr_SetString(PyExc_ValueError, "`aoi` needs at least 3 vertices");
+		return false;
+	}
+	return true;
+}
+
+static int PyPipeline_init(PyPipeline *self, PyObject *args, PyObject *kwds)
+{
+	static const char *kwlist[] = { "resolution", "border", "std_prior", "std_obs", "checkpoint_ratio", "chk_mode", "chk_cell",
+		"chk_per_cell", "seed", "solver", "grid_storage", "mask_dist", "aoi", "rotate_grid", "skip_variance", "loo", "nodata", NULL };
+	TDemGmrfOptions o;
+	const char *chk_mode = NULL, *solver = o.solver.c_str(), *grid_storage = o.grid_storage.c_str();
+	Py_ssize_t per_cell = Py_ssize_t(o.checkpoints.per_cell);
+	PyObject *aoi = NULL;
+	int rotate_grid = o.rotate_grid, skip_variance = o.skip_variance, loo = o.loo;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$dddddsdnIssdOpppd:Pipeline", const_cast<char**>(kwlist),
+		&o.resolution, &o.border, &o.std_prior, &o.std_obs, &o.checkpoints.ratio, &chk_mode, &o.checkpoints.cell_size,
+		&per_cell, &o.seed, &solver, &grid_storage, &o.mask_dist, &aoi, &rotate_grid, &skip_variance, &loo, &o.nodata))
+		return -1;
+	if (aoi && aoi!=Py_None && !parse_aoi(aoi, o.aoi))
+		return -1;
+	if (self->busy || self->n_views) {
+		PyErr_SetString(PyExc_RuntimeError, "Pipeline re-initialized while running or with alive grid views");
+		return -1;
+	}
+	o.checkpoints.per_cell = size_t(std::max<Py_ssize_t>(1,per_cell));
+	o.solver = solver;
+	o.grid_storage = grid_storage;
+	o.rotate_grid = rotate_grid!=0;
+	o.skip_variance = skip_variance!=0;
+	o.loo = loo!=0;
+	try {
+		if (chk_mode) o.checkpoints.mode = checkpoint_mode_from_string(chk_mode);
+		if (!(o.resolution>0)) throw std::runtime_error("`resolution` must be positive");
+		CDemGmrfPipeline *dem = new CDemGmrfPipeline(o); // Validates the options
+		delete self->dem;
+		self->dem = dem;
+	} catch (std::exception &e) {
+		PyErr_SetString(PyExc_ValueError, e.what());
+		return -1;
+	}
+	release_points(self);
+	return 0;
+}
+
+static PyObject *PyPipeline_load_points(PyPipeline *self, PyObject *args)
+{
+	const char *file;
+	if (!PyArg_ParseTuple(args, "s:load_points", &file)) return NULL;
+	const std::string f(file);
+	if (!run_released(self, [&]() { self->dem->loadPoints(f); })) return NULL;
+	release_points(self); // Loaded points are owned by the pipeline
+	Py_RETURN_NONE;
+}
+
+static PyObject *PyPipeline_set_points(PyPipeline *self, PyObject *args)
+{
+	PyObject *obj;
+	if (!PyArg_ParseTuple(args, "O:set_points", &obj)) return NULL;
+
+	Py_buffer b;
+	if (PyObject_GetBuffer(obj, &b, PyBUF_STRIDES | PyBUF_FORMAT)!=0) return NULL;
+	// Native-endian "f" or "d", with an optional byte order prefix:
+	const char *fmt = b.format ? b.format : "B";
+	if (*fmt=='@' || *fmt=='=' || *fmt==(PY_LITTLE_ENDIAN ? '<' : '>')) fmt++;
+	const bool is_f32 = !strcmp(fmt,"f"), is_f64 = !strcmp(fmt,"d");
+	if (b.ndim!=2 || (b.shape[1]!=3 && b.shape[1]!=4) || !(is_f32 || is_f64)) {
+		PyErr_SetString(PyExc_TypeError, "set_points() expects an Nx3 (XYZ) or Nx4 (XYZS) array of float32 or float64");
+		PyBuffer_Release(&b);
+		return NULL;
+	}
+	const size_t n = size_t(b.shape[0]), ncols = size_t(b.shape[1]);
+	if (!n) {
+		PyErr_SetString(PyExc_ValueError, "set_points(): no points");
+		PyBuffer_Release(&b);
+		return NULL;
+	}
+
+	TPointsView pts;
+	std::vector<float> *converted = NULL;
+	if (is_f32 && b.strides[0]%sizeof(float)==0 && b.strides[1]%sizeof(float)==0)
+	{
+		// Used in place:
+		pts = TPointsView(static_cast<const float*>(b.buf), n, ncols,
+			ptrdiff_t(b.strides[0]/Py_ssize_t(sizeof(float))), ptrdiff_t(b.strides[1]/Py_ssize_t(sizeof(float))));
+	}
+	else
+	{
+		// The pipeline works on float32 points: other layouts are converted once
+		converted = new std::vector<float>(n*ncols);
+		const char *base = static_cast<const char*>(b.buf);
+		for (size_t i=0;i<n;i++)
+			for (size_t k=0;k<ncols;k++)
+			{
+				const char *p = base + Py_ssize_t(i)*b.strides[0] + Py_ssize_t(k)*b.strides[1];
+				float v;
+				if (is_f64) { double d; memcpy(&d,p,sizeof(d)); v = float(d); }
+				else memcpy(&v,p,sizeof(v));
+				(*converted)[i*ncols+k] = v;
+			}
+		pts = TPointsView(&(*converted)[0], n, ncols, ptrdiff_t(ncols));
+		PyBuffer_Release(&b);
+	}
+	if (!run_released(self, [&]() { self->dem->setPoints(pts); })) {
+		if (converted) delete converted;
+		else PyBuffer_Release(&b);
+		return NULL;
+	}
+	release_points(self);
+	self->converted = converted;
+	if (!converted) {
+		self->points = b;
+		self->has_points = true;
+	}
+	Py_RETURN_NONE;
+}
+
+#define DEMGMRF_STAGE_METHOD(NAME, CALL) \
+	static PyObject *PyPipeline_##NAME(PyPipeline *self, PyObject *) \
+	{ \
+		if (!run_released(self, [&]() { self->dem->CALL(); })) return NULL; \
+		Py_RETURN_NONE; \
+	}
+DEMGMRF_STAGE_METHOD(compute_bbox, computeBBox)
+DEMGMRF_STAGE_METHOD(select_checkpoints, selectCheckpoints)
+DEMGMRF_STAGE_METHOD(insert_points, insertPoints)
+DEMGMRF_STAGE_METHOD(solve, solve)
+
+static PyObject *PyPipeline_build_map(PyPipeline *self, PyObject *)
+{
+	// Reallocates the grid storage, which views still point into:
+	if (self->n_views) {
+		PyErr_SetString(PyExc_RuntimeError, "build_map(): views of the previous grid (mean/std) are still alive");
+		return NULL;
+	}
+	if (!run_released(self, [&]() { self->dem->buildMap(); })) return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *PyPipeline_run(PyPipeline *self, PyObject *)
+{
+	if (self->dem && self->dem->getStage()<4 && self->n_views) {
+		PyErr_SetString(PyExc_RuntimeError, "run(): views of the previous grid (mean/std) are still alive");
+		return NULL;
+	}
+	if (!run_released(self, [&]()
+		{
+			// Only the stages not run yet (e.g. after compute_bbox()):
+			CDemGmrfPipeline &dem = *self->dem;
+			if (dem.getStage()<2) dem.computeBBox();
+			if (dem.getStage()<3) dem.selectCheckpoints();
+			if (dem.getStage()<4) dem.buildMap();
+			if (dem.getStage()<5) dem.insertPoints();
+			if (dem.getStage()<6) dem.solve();
+		})) return NULL;
+	Py_RETURN_NONE;
+}
+
+/** {"max_err": ..., "le90": ..., "residuals": memoryview} (see CResidualStats::getStats()) */
+static PyObject *residual_set_to_dict(const TResidualSet &r, bool with_residuals)
+{
+	static const char *names[] = { "max_err", "min_err", "average_err", "std_dev", "rmse", "median", "p95", "p99", "le90" };
+	PyObject *d = PyDict_New();
+	if (!d) return NULL;
+	for (int k=0;k<int(sizeof(names)/sizeof(names[0])) && k<r.stats.size();k++)
+	{
+		PyObject *v = PyFloat_FromDouble(r.stats[k]);
+		if (!v || PyDict_SetItemString(d, names[k], v)!=0) { Py_XDECREF(v); Py_DECREF(d); return NULL; }
+		Py_DECREF(v);
+	}
+	if (with_residuals)
+	{
+		PyObject *v = new_vector_buffer(r.residuals);
+		if (!v || PyDict_SetItemString(d, "residuals", v)!=0) { Py_XDECREF(v); Py_DECREF(d); return NULL; }
+		Py_DECREF(v);
+	}
+	return d;
+}
+
+static PyObject *PyPipeline_evaluate_checkpoints(PyPipeline *self, PyObject *args, PyObject *kwds)
+{
+	static const char *kwlist[] = { "residuals", NULL };
+	int keep = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:evaluate_checkpoints", const_cast<char**>(kwlist), &keep)) return NULL;
+	TResidualSet nn, bi;
+	if (!run_released(self, [&]() { self->dem->evaluateCheckpoints(keep!=0, nn, bi); })) return NULL;
+	PyObject *d_nn = residual_set_to_dict(nn, keep!=0);
+	PyObject *d_bi = d_nn ? residual_set_to_dict(bi, keep!=0) : NULL;
+	if (!d_bi) { Py_XDECREF(d_nn); return NULL; }
+	return Py_BuildValue("(NN)", d_nn, d_bi);
+}
+
+static PyObject *PyPipeline_evaluate_loo(PyPipeline *self, PyObject *args, PyObject *kwds)
+{
+	static const char *kwlist[] = { "residuals", NULL };
+	int keep = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p:evaluate_loo", const_cast<char**>(kwlist), &keep)) return NULL;
+	TResidualSet loo;
+	if (!run_released(self, [&]() { self->dem->evaluateLOO(keep!=0, loo); })) return NULL;
+	return residual_set_to_dict(loo, keep!=0);
+}
+
+static PyObject *PyPipeline_export_all(PyPipeline *self, PyObject *args, PyObject *kwds)
+{
+	static const char *kwlist[] = { "prefix", "north_up", NULL };
+	const char *prefix;
+	int north_up = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|p:export_all", const_cast<char**>(kwlist), &prefix, &north_up)) return NULL;
+	const std::string p(prefix);
+	if (!run_released(self, [&]() { self->dem->exportAll(p, north_up!=0); })) return NULL;
+	Py_RETURN_NONE;
+}
+
+/** The mean (`which`=0) or std (1) grid as a (size_y, size_x) view */
+static PyObject *grid_view(PyPipeline *self, int which)
+{
+	if (!check_idle(self)) return NULL;
+	if (self->dem->getGridStorage()=="sparse") {
+		PyErr_SetString(PyExc_RuntimeError, "The `sparse` grid storage has no dense grid: use export_all() or another grid_storage");
+		return NULL;
+	}
+	TDemGridView g;
+	try {
+		g = self->dem->getGridView();
+	} catch (std::exception &) {
+		g = TDemGridView(); // Dense storage before build_map()
+	}
+	if (!g.mean || !g.size_x || !g.size_y) {
+		PyErr_SetString(PyExc_RuntimeError, "No grid yet: call build_map() (or run()) first");
+		return NULL;
+	}
+	PyDemBuffer *b = PyObject_New(PyDemBuffer, &PyDemBuffer_Type);
+	if (!b) return NULL;
+	b->owner = self;
+	Py_INCREF(self);
+	self->n_views++;
+	b->owned = NULL;
+	b->data = which==0 ? g.mean : g.std;
+	b->ndim = 2;
+	b->shape[0] = Py_ssize_t(g.size_y);
+	b->shape[1] = Py_ssize_t(g.size_x);
+	b->strides[0] = Py_ssize_t(g.stride*g.size_x);
+	b->strides[1] = Py_ssize_t(g.stride);
+	b->is_float32 = g.is_float32;
+	return as_memoryview(b);
+}
+
+static PyObject *PyPipeline_get_mean(PyPipeline *self, void *) { return grid_view(self, 0); }
+static PyObject *PyPipeline_get_std(PyPipeline *self, void *) { return grid_view(self, 1); }
+
+static PyObject *PyPipeline_get_info(PyPipeline *self, void *closure)
+{
+	if (!check_idle(self)) return NULL;
+	const CDemGmrfPipeline &dem = *self->dem;
+	const TGridGeometry &g = dem.getGeometry();
+	const std::string what(static_cast<const char*>(closure));
+	if (what=="x_min") return PyFloat_FromDouble(g.x_min);
+	if (what=="y_min") return PyFloat_FromDouble(g.y_min);
+	if (what=="resolution") return PyFloat_FromDouble(dem.getOptions().resolution);
+	if (what=="size_x") return PyLong_FromSize_t(g.size_x);
+	if (what=="size_y") return PyLong_FromSize_t(g.size_y);
+	if (what=="z_origin") return PyFloat_FromDouble(dem.getGridStorage()=="compact" ? dem.getGridView().z_origin : 0.0);
+	if (what=="points") return PyLong_FromSize_t(dem.getPointCount());
+	if (what=="checkpoints") return PyLong_FromSize_t(dem.getCheckpointCount());
+	if (what=="solver") return PyUnicode_FromString(dem.getSolver().c_str());
+	if (what=="grid_storage") return PyUnicode_FromString(dem.getGridStorage().c_str());
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef PyPipeline_methods[] = {
+	{ "load_points", (PyCFunction)PyPipeline_load_points, METH_VARARGS, "load_points(file): [1] loads a text XYZ[S] file" },
+	{ "set_points", (PyCFunction)PyPipeline_set_points, METH_VARARGS,
+		"set_points(xyz): [1] uses an Nx3/Nx4 float32 array in place (any strides; kept referenced). float64 arrays are converted once." },
+	{ "compute_bbox", (PyCFunction)PyPipeline_compute_bbox, METH_NOARGS, "[2] AOI filtering, optional grid rotation and bbox" },
+	{ "select_checkpoints", (PyCFunction)PyPipeline_select_checkpoints, METH_NOARGS, "[3]" },
+	{ "build_map", (PyCFunction)PyPipeline_build_map, METH_NOARGS, "[4] Allocates the grid storage" },
+	{ "insert_points", (PyCFunction)PyPipeline_insert_points, METH_NOARGS, "[5]" },
+	{ "solve", (PyCFunction)PyPipeline_solve, METH_NOARGS, "[6]" },
+	{ "run", (PyCFunction)PyPipeline_run, METH_NOARGS, "Stages [2] to [6] not run yet, after set_points() or load_points()" },
+	{ "evaluate_checkpoints", (PyCFunction)PyPipeline_evaluate_checkpoints, METH_VARARGS | METH_KEYWORDS,
+		"evaluate_checkpoints(residuals=False): [7] (nn, bi) dicts of residual statistics" },
+	{ "evaluate_loo", (PyCFunction)PyPipeline_evaluate_loo, METH_VARARGS | METH_KEYWORDS,
+		"evaluate_loo(residuals=False): [8] dict of leave-one-out residual statistics" },
+	{ "export_all", (PyCFunction)PyPipeline_export_all, METH_VARARGS | METH_KEYWORDS,
+		"export_all(prefix, north_up=False): [9] writes the files of dem-gmrf" },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyGetSetDef PyPipeline_getset[] = {
+	{ const_cast<char*>("mean"), (getter)PyPipeline_get_mean, NULL,
+		const_cast<char*>("Mean heights, a read-only (size_y, size_x) view of the grid storage (relative to z_origin)"), NULL },
+	{ const_cast<char*>("std"), (getter)PyPipeline_get_std, NULL,
+		const_cast<char*>("Height std, a read-only (size_y, size_x) view of the grid storage"), NULL },
+	{ const_cast<char*>("x_min"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"x_min" },
+	{ const_cast<char*>("y_min"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"y_min" },
+	{ const_cast<char*>("resolution"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"resolution" },
+	{ const_cast<char*>("size_x"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"size_x" },
+	{ const_cast<char*>("size_y"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"size_y" },
+	{ const_cast<char*>("z_origin"), (getter)PyPipeline_get_info, NULL,
+		const_cast<char*>("Added to `mean` (nonzero for the float32 `compact` storage only)"), (void*)"z_origin" },
+	{ const_cast<char*>("points"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"points" },
+	{ const_cast<char*>("checkpoints"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"checkpoints" },
+	{ const_cast<char*>("solver"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"solver" },
+	{ const_cast<char*>("grid_storage"), (getter)PyPipeline_get_info, NULL, NULL, (void*)"grid_storage" },
+	{ NULL, NULL, NULL, NULL, NULL }
+};
+
+// ---------------------------------------------------------------------------
+//  Module
+// ---------------------------------------------------------------------------
+static PyObject *demgmrf_set_threads(PyObject *, PyObject *args, PyObject *kwds)
+{
+	static const char *kwlist[] = { "threads", "pin", NULL };
+	unsigned int threads = 0;
+	int pin = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|Ip:set_threads", const_cast<char**>(kwlist), &threads, &pin)) return NULL;
+	if (g_stages_running>0) {
+		PyErr_SetString(PyExc_RuntimeError, "Cannot restart the thread pool while a pipeline stage is running");
+		return NULL;
+	}
+	CThreadPool::Instance().setup(threads, pin!=0);
+	Eigen::setNbThreads(int(CThreadPool::Instance().getConcurrency()));
+	return PyLong_FromSize_t(CThreadPool::Instance().getConcurrency());
+}
+
+static PyMethodDef demgmrf_methods[] = {
+	{ "set_threads", (PyCFunction)demgmrf_set_threads, METH_VARARGS | METH_KEYWORDS,
+		"set_threads(threads=0, pin=False): restarts the thread pool shared by all pipelines "
+		"(0: one thread per hardware thread). Raises RuntimeError while any pipeline runs a stage. Returns the concurrency." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static struct PyModuleDef demgmrf_module = {
+	PyModuleDef_HEAD_INIT, "demgmrf",
+	"DEM-GMRF pipeline: DEMs from XYZ points with Gaussian Markov random fields.\n\n"
+	"    dem = demgmrf.Pipeline(resolution=0.5, solver='native')\n"
+	"    dem.set_points(xyz)   # Nx3 float32 numpy array, not copied\n"
+	"    dem.run()\n"
+	"    mean = numpy.asarray(dem.mean)  # view of the grid cells\n",
+	-1, demgmrf_methods, NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit_demgmrf(void)
+{
+	PyDemBuffer_Type.tp_name = "demgmrf.Buffer";
+	PyDemBuffer_Type.tp_basicsize = sizeof(PyDemBuffer);
+	PyDemBuffer_Type.tp_dealloc = (destructor)PyDemBuffer_dealloc;
+	PyDemBuffer_Type.tp_as_buffer = &PyDemBuffer_as_buffer;
+	PyDemBuffer_Type.tp_flags = Py_TPFLAGS_DEFAULT;
+	PyDemBuffer_Type.tp_doc = "Read-only array exported with the buffer protocol";
+
+	PyPipeline_Type.tp_name = "demgmrf.Pipeline";
+	PyPipeline_Type.tp_basicsize = sizeof(PyPipeline);
+	PyPipeline_Type.tp_dealloc = (destructor)PyPipeline_dealloc;
+	PyPipeline_Type.tp_flags = Py_TPFLAGS_DEFAULT;
+	PyPipeline_Type.tp_doc =
+		"Pipeline(resolution=1.0, border=10.0, std_prior=1.0, std_obs=0.2, checkpoint_ratio=0.01, chk_mode='random', "
+		"chk_cell=0, chk_per_cell=1, seed=0, solver='mrpt', grid_storage='dense', mask_dist=0, aoi=None, "
+		"rotate_grid=False, skip_variance=False, loo=False, nodata=-9999)\n\n"
+		"One DEM job (see CDemGmrfPipeline). Stages release the GIL.";
+	PyPipeline_Type.tp_methods = PyPipeline_methods;
+	PyPipeline_Type.tp_getset = PyPipeline_getset;
+	PyPipeline_Type.tp_init = (initproc)PyPipeline_init;
+	PyPipeline_Type.tp_new = PyPipeline_new;
+
+	if (PyType_Ready(&PyDemBuffer_Type)<0 || PyType_Ready(&PyPipeline_Type)<0)
+		return NULL;
+	PyObject *m = PyModule_Create(&demgmrf_module);
+	if (!m) return NULL;
+	Py_INCREF(&PyPipeline_Type);
+	if (PyModule_AddObject(m, "Pipeline", (PyObject*)&PyPipeline_Type)<0) {
+		Py_DECREF(&PyPipeline_Type);
+		Py_DECREF(m);
+		return NULL;
+	}
+	return m;
+}
@@ -0,0 +1,353 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "gmrf_solver.h"
+#include <Eigen/Sparse>
+#include <Eigen/SparseCholesky>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <limits>
+#include <chrono>
+#if defined(__SSE2__) || defined(_M_X64)
+#	include <xmmintrin.h>
+#	include <pmmintrin.h>
+#	define DEMGMRF_HAS_FTZ 1
+#endif
+
+typedef Eigen::SparseMatrix<double> SpMat;
+typedef Eigen::SparseMatrix<float>  SpMatF;
+typedef Eigen::PermutationMatrix<Eigen::Dynamic,Eigen::Dynamic,int> TPerm;
+
+// Factorizations are of the matrix already permuted by the (AMD, or cached) ordering:
+template <class SCALAR>
+struct TLDLT { typedef Eigen::SimplicialLDLT<Eigen::SparseMatrix<SCALAR>, Eigen::Lower, Eigen::NaturalOrdering<int> > type; };
+
+CGmrfOrderingCache::CGmrfOrderingCache(size_t max_entries) :
+	m_max_entries(max_entries), m_hits(0), m_misses(0)
+{
+}
+
+CGmrfOrderingCache::TOrderingPtr CGmrfOrderingCache::get(uint64_t key)
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	for (std::list<TEntry>::iterator it=m_entries.begin();it!=m_entries.end();++it)
+		if (it->key==key) {
+			m_entries.splice(m_entries.begin(), m_entries, it); // Most recently used first
+			m_hits++;
+			return m_entries.front().ordering;
+		}
+	m_misses++;
+	return TOrderingPtr();
+}
+
+void CGmrfOrderingCache::put(uint64_t key, const TOrderingPtr &ordering)
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	for (std::list<TEntry>::iterator it=m_entries.begin();it!=m_entries.end();++it)
+		if (it->key==key) { m_entries.erase(it); break; }
+	TEntry e;
+	e.key = key;
+	e.ordering = ordering;
+	m_entries.push_front(e);
+	while (m_entries.size()>m_max_entries) m_entries.pop_back();
+}
+
+size_t CGmrfOrderingCache::size() const
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	return m_entries.size();
+}
+
+size_t CGmrfOrderingCache::getBytes() const
+{
+	std::lock_guard<std::mutex> lk(m_mtx);
+	size_t bytes = 0;
+	for (std::list<TEntry>::const_iterator it=m_entries.begin();it!=m_entries.end();++it)
+		bytes += it->ordering->size()*sizeof(int);
+	return bytes;
+}
+
+CGmrfDemSolver::CGmrfDemSolver(size_t size_x, size_t size_y, const std::vector<size_t> *active_cells) :
+	m_size_x(size_x), m_size_y(size_y),
+	m_obs_count(0), m_factor_nnz(0),
+	m_used_mixed(false), m_reused_ordering(false), m_refine_iters(0), m_refine_residual(0)
+{
+	if (active_cells)
+	{
+		m_var2cell = *active_cells;
+		for (size_t v=1;v<m_var2cell.size();v++)
+			if (m_var2cell[v]<=m_var2cell[v-1])
+				throw std::invalid_argument("CGmrfDemSolver: active cells must be sorted and unique");
+		if (!m_var2cell.empty() && m_var2cell.back()>=size_x*size_y)
+			throw std::invalid_argument("CGmrfDemSolver: active cell out of the grid");
+	}
+	else
+	{
+		m_var2cell.resize(size_x*size_y);
+		for (size_t c=0;c<m_var2cell.size();c++) m_var2cell[c]=c;
+	}
+	m_obs_lambda.assign(m_var2cell.size(),0.0);
+	m_obs_lambda_z.assign(m_var2cell.size(),0.0);
+}
+
+void CGmrfDemSolver::maskToCellList(const std::vector<uint8_t> &mask, std::vector<size_t> &active_cells)
+{
+	active_cells.clear();
+	for (size_t c=0;c<mask.size();c++)
+		if (mask[c]) active_cells.push_back(c);
+}
+
+uint64_t CGmrfDemSolver::getPatternKey() const
+{
+	// FNV-1a over the grid size and the active cells:
+	uint64_t h = 14695981039346656037ULL;
+	const auto mix = [&h](uint64_t v) { for (int i=0;i<8;i++) { h ^= (v>>(8*i)) & 0xff; h *= 1099511628211ULL; } };
+	mix(m_size_x); mix(m_size_y); mix(m_var2cell.size());
+	for (size_t v=0;v<m_var2cell.size();v++) mix(m_var2cell[v]);
+	return h;
+}
+
+void CGmrfDemSolver::addObservation(size_t cx, size_t cy, double z, double lambda)
+{
+	if (cx>=m_size_x || cy>=m_size_y) return;
+	const int64_t v = cell2var(cx+cy*m_size_x, cx+cy*m_size_x);
+	if (v<0) return;
+	m_obs_lambda[v]  +=lambda;
+	m_obs_lambda_z[v]+=lambda*z;
+	m_obs_count++;
+}
+
+// Diagonal of inv(A) from A = L*D*L^T (L unit lower, CSC with sorted row
+// indices, no diagonal stored), by Takahashi's recurrences restricted to the
+// pattern of L, which is closed under the operations needed (chordal graph):
+//   S_ij = -sum_{k>j} L_kj S_ik   (i>j, L_ij!=0)
+//   S_jj = 1/d_j - sum_{k>j} L_kj S_kj
+// Accumulation is always in double, whatever the scalar type of the factor.
+template <class SCALAR>
+static void selected_inverse_diagonal(const Eigen::SparseMatrix<SCALAR> &L, const Eigen::Matrix<SCALAR,Eigen::Dynamic,1> &D, Eigen::VectorXd &diag_inv)
+{
+	const int n = L.cols();
+	const int *Lp = L.outerIndexPtr(), *Li = L.innerIndexPtr();
+	const SCALAR *Lx = L.valuePtr();
+	std::vector<double> S(L.nonZeros()); // S_ij for each (i,j) in pattern(L)
+	diag_inv.resize(n);
+
+	// Look up S_ik (i>k) in column k:
+	struct TFind {
+		const int *Lp, *Li; const std::vector<double> &S;
+		double operator()(int i, int k) const {
+			const int *b = Li+Lp[k], *e = Li+Lp[k+1];
+			const int *it = std::lower_bound(b,e,i);
+			return S[it-Li]; // present by the chordal property
+		}
+	} find = {Lp,Li,S};
+
+	for (int j=n-1;j>=0;j--)
+	{
+		const int p0 = Lp[j], p1 = Lp[j+1];
+		// Off-diagonal entries of column j, bottom-up:
+		for (int p=p1-1;p>=p0;p--)
+		{
+			const int i = Li[p];
+			double s = 0;
+			for (int q=p0;q<p1;q++)
+			{
+				const int k = Li[q];
+				const double S_ik = (k==i) ? diag_inv[i] : (k>i ? find(k,i) : find(i,k));
+				s -= Lx[q]*S_ik;
+			}
+			S[p] = s;
+		}
+		double s = 1.0/double(D[j]);
+		for (int q=p0;q<p1;q++) s -= Lx[q]*S[q];
+		diag_inv[j] = s;
+	}
+}
+
+// Posterior std of each unknown from an LDL^T factorization of P*A*P^T
+template <class SCALAR>
+static void std_from_factor(const typename TLDLT<SCALAR>::type &ldlt, const Eigen::VectorXi &P, std::vector<double> &std_out)
+{
+	Eigen::VectorXd var_perm;
+	selected_inverse_diagonal<SCALAR>(ldlt.matrixL().nestedExpression(), ldlt.vectorD(), var_perm);
+	// Unknown v is at position P(v) of the factored matrix:
+	for (size_t v=0;v<std_out.size();v++) std_out[v] = std::sqrt(std::max(0.0,var_perm[P[v]]));
+}
+
+static double wall_now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CGmrfDemSolver::profile(const char *name, double &t0)
+{
+	const double t1 = wall_now();
+	TProfileEntry e;
+	e.name = name;
+	e.wall = t1-t0;
+	m_profile.push_back(e);
+	t0 = t1;
+}
+
+void CGmrfDemSolver::solve(const TOptions &opts)
+{
+	double t0 = wall_now();
+	m_profile.clear();
+	m_refine_iters = 0;
+	m_refine_residual = 0;
+	m_used_mixed = false;
+	m_reused_ordering = false;
+	const size_t n = m_var2cell.size();
+	m_mean.assign(n,0.0);
+	m_std.assign(n,0.0);
+	if (!n) return;
+
+	const double lp = opts.lambda_prior;
+	// Weak anchor to the mean of the data: keeps the system definite for
+	// connected components of active cells without any observation.
+	double sum_lz=0, sum_l=0;
+	for (size_t v=0;v<n;v++) { sum_lz+=m_obs_lambda_z[v]; sum_l+=m_obs_lambda[v]; }
+	const double z0 = sum_l>0 ? sum_lz/sum_l : 0.0;
+	const double ridge = 1e-10*lp;
+
+	// Precision matrix (lower triangle) and information vector:
+	std::vector<Eigen::Triplet<double> > trips;
+	trips.reserve(3*n);
+	Eigen::VectorXd diag(n), b(n);
+	for (size_t v=0;v<n;v++) {
+		diag[v] = m_obs_lambda[v] + ridge;
+		b[v] = m_obs_lambda_z[v] + ridge*z0;
+	}
+	for (size_t v=0;v<n;v++)
+	{
+		const size_t c = m_var2cell[v], cx = c % m_size_x, cy = c / m_size_x;
+		const int64_t nb[2] = {
+			cx+1<m_size_x ? cell2var(c+1, v+1) : -1,
+			cy+1<m_size_y ? cell2var(c+m_size_x, v+m_size_x) : -1 };
+		for (int k=0;k<2;k++)
+		{
+			if (nb[k]<0) continue;
+			diag[v]+=lp; diag[nb[k]]+=lp;
+			trips.push_back(Eigen::Triplet<double>(nb[k],v,-lp));
+		}
+	}
+	for (size_t v=0;v<n;v++) trips.push_back(Eigen::Triplet<double>(v,v,diag[v]));
+	profile("assemble", t0);
+
+	// Fill-reducing ordering: AMD, as Eigen's default, or the one cached for
+	// the same unknowns. It only depends on the sparsity pattern of A.
+	const uint64_t key = opts.ordering_cache ? getPatternKey() : 0;
+	CGmrfOrderingCache::TOrderingPtr ordering;
+	if (opts.ordering_cache) ordering = opts.ordering_cache->get(key);
+	m_reused_ordering = ordering && size_t(ordering->size())==n;
+	if (!m_reused_ordering)
+	{
+		SpMat A(n,n);
+		A.setFromTriplets(trips.begin(),trips.end());
+		const SpMat C = A.selfadjointView<Eigen::Lower>();
+		SpMat().swap(A);
+		TPerm Pinv;
+		Eigen::AMDOrdering<int> amd;
+		amd(C, Pinv);
+		const TPerm P_amd = Pinv.inverse();
+		ordering = std::make_shared<const Eigen::VectorXi>(P_amd.indices());
+		if (opts.ordering_cache) opts.ordering_cache->put(key, ordering);
+	}
+
+	// The permuted matrix P*A*P^T (lower triangle), built directly:
+	const Eigen::VectorXi &P = *ordering;
+	for (size_t t=0;t<trips.size();t++)
+	{
+		int i = P[trips[t].row()], j = P[trips[t].col()];
+		if (i<j) std::swap(i,j);
+		trips[t] = Eigen::Triplet<double>(i,j,trips[t].value());
+	}
+	SpMat Ap(n,n);
+	Ap.setFromTriplets(trips.begin(),trips.end());
+	std::vector<Eigen::Triplet<double> >().swap(trips);
+	Eigen::VectorXd bp(n);
+	for (size_t v=0;v<n;v++) bp[P[v]] = b[v];
+	profile("ordering", t0);
+
+	if (opts.mixed_precision && solve_mixed(Ap,bp,P,opts))
+		return;
+	t0 = wall_now();
+
+	TLDLT<double>::type ldlt(Ap);
+	if (ldlt.info()!=Eigen::Success)
+		throw std::runtime_error("CGmrfDemSolver: factorization of the precision matrix failed");
+	m_factor_nnz = ldlt.matrixL().nestedExpression().nonZeros() + n;
+	profile("factorize", t0);
+
+	const Eigen::VectorXd x = ldlt.solve(bp);
+	for (size_t v=0;v<n;v++) m_mean[v]=x[P[v]];
+	profile("solve_mean", t0);
+	if (opts.on_mean_ready) opts.on_mean_ready();
+
+	t0 = wall_now();
+	if (!opts.skip_variance) {
+		std_from_factor<double>(ldlt, P, m_std);
+		profile("variance", t0);
+	}
+}
+
+// Float32 factorization + iterative refinement against the double precision
+// operator: x_{k+1} = x_k + inv(LDL^T_f32) * (b - A*x_k), with residuals in
+// double. Converges to double accuracy as long as cond(A)*eps_f32 < 1; returns
+// false (and the caller falls back to a double factorization) otherwise.
+bool CGmrfDemSolver::solve_mixed(const Eigen::SparseMatrix<double> &A, const Eigen::VectorXd &b, const Eigen::VectorXi &P, const TOptions &opts)
+{
+#if DEMGMRF_HAS_FTZ
+	// Fill-in entries of L decay quickly and underflow float32 into denormals,
+	// which are an order of magnitude slower to operate on. Flush them to zero
+	// (this thread only); the refinement absorbs the difference.
+	struct TFlushDenormals {
+		unsigned int old_ftz, old_daz;
+		TFlushDenormals() : old_ftz(_MM_GET_FLUSH_ZERO_MODE()), old_daz(_MM_GET_DENORMALS_ZERO_MODE()) {
+			_MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON); _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+		}
+		~TFlushDenormals() { _MM_SET_FLUSH_ZERO_MODE(old_ftz); _MM_SET_DENORMALS_ZERO_MODE(old_daz); }
+	} flush_denormals;
+#endif
+	const size_t n = b.size();
+	double t0 = wall_now();
+	TLDLT<float>::type ldlt(A.cast<float>());
+	if (ldlt.info()!=Eigen::Success)
+		return false;
+	profile("factorize_f32", t0);
+
+	Eigen::VectorXd x = ldlt.solve(b.cast<float>()).cast<double>();
+	const double b_norm = std::max(b.norm(), std::numeric_limits<double>::min());
+	double prev_rel = std::numeric_limits<double>::max();
+	bool converged = false;
+	for (m_refine_iters=0; m_refine_iters<=opts.max_refine_iters; m_refine_iters++)
+	{
+		const Eigen::VectorXd r = b - A.selfadjointView<Eigen::Lower>()*x;
+		m_refine_residual = r.norm()/b_norm;
+		if (m_refine_residual<=opts.refine_tolerance) { converged=true; break; }
+		if (m_refine_residual>0.5*prev_rel || m_refine_iters==opts.max_refine_iters)
+			break; // Stagnated or diverging
+		prev_rel = m_refine_residual;
+		x += ldlt.solve(r.cast<float>()).cast<double>();
+	}
+	profile("refine", t0);
+	if (!converged)
+		return false;
+
+	m_used_mixed = true;
+	m_factor_nnz = ldlt.matrixL().nestedExpression().nonZeros() + n;
+	for (size_t v=0;v<n;v++) m_mean[v]=x[P[v]];
+	if (opts.on_mean_ready) opts.on_mean_ready();
+	t0 = wall_now();
+	if (!opts.skip_variance) {
+		std_from_factor<float>(ldlt, P, m_std);
+		profile("variance", t0);
+	}
+	return true;
+}
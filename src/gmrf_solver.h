@@ -0,0 +1,146 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <Eigen/Sparse>
+
+/** Fill-reducing orderings of GMRF precision matrices, shared by the solves of
+  * the same set of unknowns (grid size and active cells), e.g. by repeated
+  * jobs over one extent, which then skip the AMD ordering. Thread-safe; only
+  * the `max_entries` most recently used orderings are kept. */
+class CGmrfOrderingCache
+{
+public:
+	/** P(v): position of unknown v in the factored matrix */
+	typedef std::shared_ptr<const Eigen::VectorXi> TOrderingPtr;
+
+	explicit CGmrfOrderingCache(size_t max_entries = 64);
+
+	/** Empty if there is no ordering for `key` (see CGmrfDemSolver::getPatternKey()) */
+	TOrderingPtr get(uint64_t key);
+	void put(uint64_t key, const TOrderingPtr &ordering);
+
+	size_t size() const;
+	size_t getBytes() const;
+	uint64_t getHits() const { return m_hits; }
+	uint64_t getMisses() const { return m_misses; }
+
+private:
+	struct TEntry { uint64_t key; TOrderingPtr ordering; };
+	mutable std::mutex m_mtx;
+	std::list<TEntry> m_entries; //!< Most recently used first
+	size_t m_max_entries;
+	std::atomic<uint64_t> m_hits, m_misses;
+};
+
+/** Solver for the same GMRF model as CHeightGridMap2D_MRF (mrGMRF_SD): a
+  * first-order smoothness prior between each cell and its 4 neighbors (precision
+  * `lambda_prior`), plus one term per observation on the cell containing it.
+  * Unlike the MRPT implementation, only the cells in an (optional) list of
+  * active cells become unknowns of the linear system, and no per-cell storage
+  * is kept for the rest, so empty regions of the bbox cost neither memory nor
+  * solve time.
+  *
+  * The posterior mean comes from a sparse LDL^T factorization of the precision
+  * matrix; the posterior std of each cell from the diagonal of its inverse,
+  * obtained with the Takahashi recurrences over the sparsity pattern of L.
+  */
+class CGmrfDemSolver
+{
+public:
+	struct TOptions
+	{
+		TOptions() : lambda_prior(1.0), skip_variance(false), mixed_precision(false), max_refine_iters(10), refine_tolerance(1e-12), ordering_cache(NULL) {}
+		double lambda_prior;
+		bool   skip_variance;
+		/** Factor in float32 (half the memory of the factor, faster triangular
+		  * solves) and recover double accuracy by iterative refinement. If the
+		  * refinement does not converge, a double factorization is used. */
+		bool   mixed_precision;
+		int    max_refine_iters;
+		double refine_tolerance; //!< On ||b-A*x||/||b||
+		/** If set, called as soon as getMean() is available, before the variance
+		  * is computed. It may start asynchronous work on the mean (e.g. writing
+		  * it to disk), which then overlaps the variance computation. */
+		std::function<void()> on_mean_ready;
+		/** If set, the fill-reducing ordering is looked up here before computing it, and stored */
+		CGmrfOrderingCache *ordering_cache;
+	};
+
+	/** `active_cells` holds the linear indices (cx+cy*size_x) of the cells to
+	  * solve for, in ascending order. It may be NULL to solve for all the cells. */
+	CGmrfDemSolver(size_t size_x, size_t size_y, const std::vector<size_t> *active_cells = NULL);
+
+	/** Builds the sorted list of active cells from a row-major mask (non-zero=active) */
+	static void maskToCellList(const std::vector<uint8_t> &mask, std::vector<size_t> &active_cells);
+
+	/** Adds one observation `z` with precision `lambda` (=1/std^2) of cell (cx,cy).
+	  * Observations on inactive cells are ignored. */
+	void addObservation(size_t cx, size_t cy, double z, double lambda);
+
+	void solve(const TOptions &opts);
+
+	size_t getUnknownsCount() const { return m_var2cell.size(); }
+	size_t getObservationsCount() const { return m_obs_count; }
+	size_t getFactorNonZeros() const { return m_factor_nnz; }
+	/** Whether the last solve() used the float32 factor (see TOptions::mixed_precision) */
+	bool usedMixedPrecision() const { return m_used_mixed; }
+	int getRefinementIterations() const { return m_refine_iters; }
+	/** Whether the last solve() took its ordering from TOptions::ordering_cache */
+	bool reusedOrdering() const { return m_reused_ordering; }
+	/** Hash of the grid size and active cells, which determine the sparsity pattern */
+	uint64_t getPatternKey() const;
+	double getRefinementResidual() const { return m_refine_residual; }
+
+	/** Wall time [s] of each internal step of the last solve() ("assemble",
+	  * "ordering", "factorize", "solve_mean", "variance"...), in execution order */
+	struct TProfileEntry { std::string name; double wall; };
+	const std::vector<TProfileEntry> &getProfile() const { return m_profile; }
+
+	/** Linear cell index (cx+cy*size_x) of each unknown */
+	const std::vector<size_t> &getUnknownCells() const { return m_var2cell; }
+	/** Posterior mean & std of each unknown, in the order of getUnknownCells() */
+	const std::vector<double> &getMean() const { return m_mean; }
+	const std::vector<double> &getStd() const { return m_std; }
+
+private:
+	size_t m_size_x, m_size_y;
+	std::vector<size_t>  m_var2cell;  //!< Sorted, so cell->unknown is a binary search
+	std::vector<double>  m_obs_lambda, m_obs_lambda_z; //!< Per unknown: sum(lambda), sum(lambda*z)
+	size_t m_obs_count, m_factor_nnz;
+	bool   m_used_mixed, m_reused_ordering;
+	int    m_refine_iters;
+	double m_refine_residual;
+	std::vector<double>  m_mean, m_std;
+	std::vector<TProfileEntry> m_profile;
+
+	/** Appends a profile entry for the step that started at `t0` and restarts `t0` */
+	void profile(const char *name, double &t0);
+
+	/** `A`, `b`: already permuted by the ordering `P` */
+	bool solve_mixed(const Eigen::SparseMatrix<double> &A, const Eigen::VectorXd &b, const Eigen::VectorXi &P, const TOptions &opts);
+
+	/** Unknown index of a cell, or -1 if inactive. `hint` is tried first. */
+	inline int64_t cell2var(size_t c, size_t hint) const
+	{
+		if (hint<m_var2cell.size() && m_var2cell[hint]==c) return hint;
+		const std::vector<size_t>::const_iterator it = std::lower_bound(m_var2cell.begin(),m_var2cell.end(),c);
+		return (it!=m_var2cell.end() && *it==c) ? int64_t(it-m_var2cell.begin()) : -1;
+	}
+};
@@ -0,0 +1,97 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "grid_frame.h"
+#include "parallel_for.h"
+#include <mrpt/utils/CFileOutputStream.h>
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+void TGridFrame::pointsToLocal(mrpt::math::CMatrix &xyz) const
+{
+	parallel_for(xyz.rows(), [&](size_t i0, size_t i1)
+	{
+		for (size_t i=i0;i<i1;i++)
+		{
+			double u,v;
+			toLocal(xyz(i,0),xyz(i,1),u,v);
+			xyz(i,0) = static_cast<float>(u);
+			xyz(i,1) = static_cast<float>(v);
+		}
+	});
+}
+
+void TGridFrame::polygonToLocal(TPolygon2D &poly) const
+{
+	for (size_t i=0;i<poly.xs.size();i++)
+	{
+		double u,v;
+		toLocal(poly.xs[i],poly.ys[i],u,v);
+		poly.xs[i]=u; poly.ys[i]=v;
+	}
+}
+
+void TGridFrame::saveToTextFile(const std::string &file, const TGridGeometry &g) const
+{
+	// World coordinates of the center of cell (cx,cy):
+	//  X = X0 + A*cx + B*cy ;  Y = Y0 + C*cx + D*cy
+	double X0,Y0;
+	toWorld(g.x_min+0.5*g.resolution, g.y_min+0.5*g.resolution, X0,Y0);
+	const double c = std::cos(angle), s = std::sin(angle), r = g.resolution;
+
+	mrpt::utils::CFileOutputStream f(file);
+	f.printf("%% Local grid frame: origin (world) and rotation [deg]\n");
+	f.printf("%% OX OY ANGLE_DEG\n%f %f %.9f\n", ox, oy, angle*180.0/M_PI);
+	f.printf("%% World coordinates of cell (cx,cy) center: X=X0+A*cx+B*cy, Y=Y0+C*cx+D*cy\n");
+	f.printf("%% X0 Y0 A B C D\n%f %f %.9f %.9f %.9f %.9f\n", X0, Y0, r*c, -r*s, r*s, r*c);
+}
+
+void save_north_up_grid(const TDemGridView &g, const TGridFrame &frame, double nodata, const std::string &prefix)
+{
+	// World bbox of the rotated grid:
+	const double ux[2] = { g.x_min, g.x_min+g.size_x*g.resolution };
+	const double vy[2] = { g.y_min, g.y_min+g.size_y*g.resolution };
+	double minx=std::numeric_limits<double>::max(), maxx=-minx, miny=minx, maxy=-minx;
+	for (int i=0;i<2;i++) for (int j=0;j<2;j++)
+	{
+		double x,y;
+		frame.toWorld(ux[i],vy[j],x,y);
+		minx=std::min(minx,x); maxx=std::max(maxx,x);
+		miny=std::min(miny,y); maxy=std::max(maxy,y);
+	}
+	const double r = g.resolution;
+	const size_t nx = std::max<size_t>(1,size_t(std::ceil((maxx-minx)/r)));
+	const size_t ny = std::max<size_t>(1,size_t(std::ceil((maxy-miny)/r)));
+
+	mrpt::math::CMatrix MEAN(ny,nx), STDs(ny,nx);
+	parallel_for(ny, [&](size_t cy0, size_t cy1)
+	{
+		std::vector<double> us(nx), vs(nx);
+		TBatchPrediction pred;
+		for (size_t cy=cy0;cy<cy1;cy++)
+		{
+			for (size_t cx=0;cx<nx;cx++)
+				frame.toLocal(minx+(cx+0.5)*r, miny+(cy+0.5)*r, us[cx], vs[cx]);
+			predict_batch(g, &us[0], &vs[0], nx, pred, false /* already in a worker thread */);
+			for (size_t cx=0;cx<nx;cx++)
+			{
+				const bool inside = us[cx]>=ux[0] && us[cx]<ux[1] && vs[cx]>=vy[0] && vs[cx]<vy[1] && pred.z_bi[cx]==pred.z_bi[cx];
+				MEAN(cy,cx) = static_cast<float>(inside ? pred.z_bi[cx] : nodata);
+				STDs(cy,cx) = static_cast<float>(inside ? pred.std_bi[cx] : nodata);
+			}
+		}
+	}, 16);
+
+	mrpt::math::CMatrix DIMs(1,4);
+	DIMs(0,0)=minx; DIMs(0,1)=minx+nx*r; DIMs(0,2)=miny; DIMs(0,3)=miny+ny*r;
+	DIMs.saveToTextFile( prefix + string("_grid_limits.txt"), MATRIX_FORMAT_FIXED, false /* add mrpt header */, "% Grid limits: [x_min x_max y_min y_max]\n" );
+	MEAN.saveToTextFile( prefix + string("_mean.txt"), MATRIX_FORMAT_FIXED );
+	STDs.saveToTextFile( prefix + string("_mean_std.txt"), MATRIX_FORMAT_FIXED );
+}
@@ -0,0 +1,55 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/math/CMatrix.h>
+#include <string>
+#include <cmath>
+#include "dem_predict.h"
+#include "active_mask.h"
+
+/** Rigid 2D frame in which the DEM grid is built: local (u,v) coordinates are
+  * world (x,y) coordinates relative to `origin` and rotated by -`angle`, so
+  * that the grid axes can follow the principal axes of an oblique survey. */
+struct TGridFrame
+{
+	double ox, oy;  //!< Origin, in world coordinates
+	double angle;   //!< Rotation of the local +u axis w.r.t. world +X [rad]
+
+	TGridFrame() : ox(0), oy(0), angle(0) {}
+	TGridFrame(double ox_, double oy_, double angle_) : ox(ox_), oy(oy_), angle(angle_) {}
+
+	inline void toLocal(double x, double y, double &u, double &v) const
+	{
+		const double c = std::cos(angle), s = std::sin(angle), dx = x-ox, dy = y-oy;
+		u =  c*dx + s*dy;
+		v = -s*dx + c*dy;
+	}
+	inline void toWorld(double u, double v, double &x, double &y) const
+	{
+		const double c = std::cos(angle), s = std::sin(angle);
+		x = ox + c*u - s*v;
+		y = oy + s*u + c*v;
+	}
+
+	/** Transforms the XY columns of `xyz` from world to local coordinates, in parallel */
+	void pointsToLocal(mrpt::math::CMatrix &xyz) const;
+	void polygonToLocal(TPolygon2D &poly) const;
+
+	/** Writes the frame and the affine transform from grid cell indices to
+	  * world coordinates of the cell centers, for georeferencing the outputs. */
+	void saveToTextFile(const std::string &file, const TGridGeometry &grid) const;
+};
+
+/** Resamples a DEM built in the rotated frame `frame` into a north-up grid,
+  * covering the world bbox of the rotated grid at the same resolution.
+  * Cells outside the rotated grid are set to `nodata`. Rows run in parallel.
+  * Writes `<prefix>_grid_limits.txt`, `<prefix>_mean.txt` and `<prefix>_mean_std.txt`.
+  */
+void save_north_up_grid(const TDemGridView &grid, const TGridFrame &frame, double nodata, const std::string &prefix);
@@ -0,0 +1,151 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "hw_counters.h"
+#include <cstring>
+#if defined(__linux__)
+#	include <linux/perf_event.h>
+#	include <sys/syscall.h>
+#	include <sys/ioctl.h>
+#	include <unistd.h>
+#endif
+
+const char *hw_event_name(THwEvent e)
+{
+	static const char *names[HW_EVENT_COUNT] = { "cycles", "instructions", "llc_misses", "dtlb_misses", "branch_misses" };
+	return names[e];
+}
+
+THwCounts THwCounts::operator-(const THwCounts &o) const
+{
+	THwCounts r;
+	for (int i=0;i<HW_EVENT_COUNT;i++) {
+		r.valid[i] = valid[i] && o.valid[i];
+		r.v[i] = (r.valid[i] && v[i]>=o.v[i]) ? v[i]-o.v[i] : 0;
+	}
+	return r;
+}
+
+THwCounts &THwCounts::operator+=(const THwCounts &o)
+{
+	for (int i=0;i<HW_EVENT_COUNT;i++) {
+		v[i] += o.v[i];
+		valid[i] = valid[i] || o.valid[i];
+	}
+	return *this;
+}
+
+double THwCounts::ipc() const
+{
+	return (valid[hwCycles] && valid[hwInstructions] && v[hwCycles]) ? double(v[hwInstructions])/v[hwCycles] : -1;
+}
+
+double THwCounts::perKiloInstr(THwEvent e) const
+{
+	return (valid[e] && valid[hwInstructions] && v[hwInstructions]) ? 1000.0*v[e]/v[hwInstructions] : -1;
+}
+
+#if defined(__linux__)
+static int perf_open(uint32_t type, uint64_t config, int tid, int group_fd)
+{
+	perf_event_attr attr;
+	memset(&attr,0,sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = group_fd<0 ? 1 : 0;  // The leader starts (and enables) the group
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return int(syscall(__NR_perf_event_open, &attr, tid, -1 /*any cpu*/, group_fd, 0));
+}
+#endif
+
+bool CHwCounters::open(const std::vector<int> &tids)
+{
+	close();
+#if defined(__linux__)
+	const uint32_t types[HW_EVENT_COUNT] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+	const uint64_t configs[HW_EVENT_COUNT] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES, // Last level cache
+		PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_BRANCH_MISSES };
+	for (size_t t=0;t<tids.size();t++)
+	{
+		TGroup g;
+		g.leader = -1;
+		for (int e=0;e<HW_EVENT_COUNT;e++)
+		{
+			g.fds[e] = perf_open(types[e], configs[e], tids[t], g.leader);
+			if (g.leader<0) g.leader = g.fds[e]; // The first event that opens leads the group
+		}
+		if (g.leader<0) continue;
+		bool leader_ok = true;
+		for (int e=0;e<HW_EVENT_COUNT && leader_ok;e++)
+			if (g.fds[e]>=0 && ioctl(g.fds[e], PERF_EVENT_IOC_ID, &g.ids[e])!=0) {
+				if (g.fds[e]==g.leader) leader_ok = false;
+				else {
+					::close(g.fds[e]);
+					g.fds[e] = -1;
+				}
+			}
+		if (!leader_ok) {
+			// Nothing of the group can be read without its leader: skip this thread.
+			for (int e=0;e<HW_EVENT_COUNT;e++)
+				if (g.fds[e]>=0) ::close(g.fds[e]);
+			continue;
+		}
+		ioctl(g.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(g.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		m_tids.push_back(tids[t]);
+		m_groups.push_back(g);
+	}
+	return !m_groups.empty();
+#else
+	(void)tids;
+	return false;
+#endif
+}
+
+void CHwCounters::close()
+{
+#if defined(__linux__)
+	for (size_t i=0;i<m_groups.size();i++)
+		for (int e=0;e<HW_EVENT_COUNT;e++)
+			if (m_groups[i].fds[e]>=0) ::close(m_groups[i].fds[e]);
+#endif
+	m_groups.clear();
+	m_tids.clear();
+}
+
+void CHwCounters::read(std::vector<THwCounts> &out) const
+{
+	out.assign(m_groups.size(), THwCounts());
+#if defined(__linux__)
+	for (size_t i=0;i<m_groups.size();i++)
+	{
+		const TGroup &g = m_groups[i];
+		// Layout with PERF_FORMAT_GROUP|ID: nr, time_enabled, time_running, {value, id}[nr]
+		uint64_t buf[3+2*HW_EVENT_COUNT];
+		if (::read(g.leader, buf, sizeof(buf))<24) continue;
+		const uint64_t nr = buf[0], enabled = buf[1], running = buf[2];
+		const double scale = running ? double(enabled)/running : 1.0; // running=0: the thread has not run yet
+		for (int e=0;e<HW_EVENT_COUNT;e++)
+		{
+			if (g.fds[e]<0) continue;
+			for (uint64_t k=0;k<nr && k<uint64_t(HW_EVENT_COUNT);k++)
+				if (buf[3+2*k+1]==g.ids[e]) {
+					out[i].v[e] = uint64_t(buf[3+2*k]*scale);
+					out[i].valid[e] = true;
+				}
+		}
+	}
+#endif
+}
@@ -0,0 +1,82 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/** Hardware events counted by CHwCounters */
+enum THwEvent
+{
+	hwCycles = 0,
+	hwInstructions,
+	hwLLCMisses,
+	hwDTLBMisses,
+	hwBranchMisses,
+	HW_EVENT_COUNT
+};
+
+const char *hw_event_name(THwEvent e);
+
+/** Counts of each THwEvent for one thread. Events the CPU (or VM) does not
+  * support are flagged in `valid`. */
+struct THwCounts
+{
+	THwCounts() { for (int i=0;i<HW_EVENT_COUNT;i++) { v[i]=0; valid[i]=false; } }
+	uint64_t v[HW_EVENT_COUNT];
+	bool     valid[HW_EVENT_COUNT];
+
+	THwCounts operator-(const THwCounts &o) const;
+	THwCounts &operator+=(const THwCounts &o);
+
+	double ipc() const;
+	/** Misses of event `e` per 1000 instructions (<0 if not available) */
+	double perKiloInstr(THwEvent e) const;
+};
+
+/** User-space hardware performance counters (cycles, instructions, LLC, dTLB
+  * and branch misses) of a set of threads, read with the Linux perf_event_open()
+  * syscall, with no external tools. One counter group is opened per thread, so
+  * counts can be reported per thread and summed per process. Counts are scaled
+  * for multiplexing when the PMU runs short of counters.
+  *
+  * Requires /proc/sys/kernel/perf_event_paranoid <= 2 (the default on most
+  * distributions). On other systems, open() just returns false.
+  */
+class CHwCounters
+{
+public:
+	CHwCounters() {}
+	~CHwCounters() { close(); }
+
+	/** Starts counting for each thread id (Linux TIDs). Returns false if no
+	  * counter at all could be opened. */
+	bool open(const std::vector<int> &tids);
+	void close();
+	bool isOpen() const { return !m_groups.empty(); }
+
+	const std::vector<int> &getThreadIds() const { return m_tids; }
+
+	/** Current counts since open(), one entry per thread of getThreadIds() */
+	void read(std::vector<THwCounts> &out) const;
+
+private:
+	struct TGroup
+	{
+		int fds[HW_EVENT_COUNT];       //!< -1 if the event could not be opened
+		uint64_t ids[HW_EVENT_COUNT];  //!< Kernel id of each event, to match group reads
+		int leader;                    //!< fd of the group leader
+	};
+	std::vector<int>    m_tids;
+	std::vector<TGroup> m_groups;
+
+	CHwCounters(const CHwCounters &);
+	CHwCounters &operator=(const CHwCounters &);
+};
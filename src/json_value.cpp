@@ -0,0 +1,271 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "json_value.h"
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+
+static const char *type_name(CJsonValue::TType t)
+{
+	static const char *names[] = { "null", "bool", "number", "string", "array", "object" };
+	return names[t];
+}
+
+struct TJsonParser
+{
+	const std::string &s;
+	size_t pos;
+	int depth;
+
+	explicit TJsonParser(const std::string &s_) : s(s_), pos(0), depth(0) {}
+
+	void fail(const char *what) const
+	{
+		char buf[128];
+		snprintf(buf,sizeof(buf),"JSON: %s at offset %u", what, (unsigned)pos);
+		throw std::runtime_error(buf);
+	}
+	void skipSpaces()
+	{
+		while (pos<s.size() && (s[pos]==' ' || s[pos]=='\t' || s[pos]=='\n' || s[pos]=='\r')) pos++;
+	}
+	void expect(const char *lit)
+	{
+		for (const char *c=lit;*c;c++,pos++)
+			if (pos>=s.size() || s[pos]!=*c) fail("invalid literal");
+	}
+	static void appendUtf8(std::string &out, unsigned cp)
+	{
+		if (cp<0x80) out+=char(cp);
+		else if (cp<0x800) { out+=char(0xC0|(cp>>6)); out+=char(0x80|(cp&0x3F)); }
+		else if (cp<0x10000) { out+=char(0xE0|(cp>>12)); out+=char(0x80|((cp>>6)&0x3F)); out+=char(0x80|(cp&0x3F)); }
+		else { out+=char(0xF0|(cp>>18)); out+=char(0x80|((cp>>12)&0x3F)); out+=char(0x80|((cp>>6)&0x3F)); out+=char(0x80|(cp&0x3F)); }
+	}
+	unsigned hex4()
+	{
+		if (pos+4>s.size()) fail("truncated \\u escape");
+		unsigned v=0;
+		for (int i=0;i<4;i++,pos++)
+		{
+			const char c = s[pos];
+			v <<= 4;
+			if (c>='0' && c<='9') v|=c-'0';
+			else if (c>='a' && c<='f') v|=c-'a'+10;
+			else if (c>='A' && c<='F') v|=c-'A'+10;
+			else fail("invalid \\u escape");
+		}
+		return v;
+	}
+	std::string parseString()
+	{
+		std::string out;
+		pos++; // opening quote
+		while (true)
+		{
+			if (pos>=s.size()) fail("unterminated string");
+			const char c = s[pos++];
+			if (c=='"') return out;
+			if (static_cast<unsigned char>(c)<0x20) fail("control character in string");
+			if (c!='\\') { out+=c; continue; }
+			if (pos>=s.size()) fail("unterminated string");
+			switch (s[pos++])
+			{
+			case '"': out+='"'; break;
+			case '\\': out+='\\'; break;
+			case '/': out+='/'; break;
+			case 'b': out+='\b'; break;
+			case 'f': out+='\f'; break;
+			case 'n': out+='\n'; break;
+			case 'r': out+='\r'; break;
+			case 't': out+='\t'; break;
+			case 'u':
+				{
+					unsigned cp = hex4();
+					if (cp>=0xD800 && cp<0xDC00 && pos+1<s.size() && s[pos]=='\\' && s[pos+1]=='u') {
+						pos+=2;
+						const unsigned lo = hex4();
+						cp = 0x10000 + ((cp-0xD800)<<10) + (lo-0xDC00);
+					}
+					appendUtf8(out,cp);
+				}
+				break;
+			default: pos--; fail("invalid escape");
+			}
+		}
+	}
+	void parseValue(CJsonValue &v)
+	{
+		skipSpaces();
+		if (pos>=s.size()) fail("unexpected end");
+		const char c = s[pos];
+		if (c=='{' || c=='[')
+		{
+			if (++depth>256) fail("nesting too deep");
+			const bool obj = c=='{';
+			v.m_type = obj ? CJsonValue::jObject : CJsonValue::jArray;
+			pos++;
+			skipSpaces();
+			if (pos<s.size() && s[pos]==(obj ? '}' : ']')) { pos++; depth--; return; }
+			while (true)
+			{
+				skipSpaces();
+				if (obj)
+				{
+					if (pos>=s.size() || s[pos]!='"') fail("expected a member name");
+					const std::string key = parseString();
+					skipSpaces();
+					if (pos>=s.size() || s[pos]!=':') fail("expected ':'");
+					pos++;
+					v.m_object.push_back(std::make_pair(key,CJsonValue()));
+					parseValue(v.m_object.back().second);
+				}
+				else
+				{
+					v.m_array.push_back(CJsonValue());
+					parseValue(v.m_array.back());
+				}
+				skipSpaces();
+				if (pos<s.size() && s[pos]==',') { pos++; continue; }
+				if (pos<s.size() && s[pos]==(obj ? '}' : ']')) { pos++; depth--; return; }
+				fail(obj ? "expected ',' or '}'" : "expected ',' or ']'");
+			}
+		}
+		else if (c=='"') { v.m_type = CJsonValue::jString; v.m_string = parseString(); }
+		else if (c=='t') { expect("true");  v.m_type = CJsonValue::jBool; v.m_bool = true; }
+		else if (c=='f') { expect("false"); v.m_type = CJsonValue::jBool; v.m_bool = false; }
+		else if (c=='n') { expect("null");  v.m_type = CJsonValue::jNull; }
+		else if (c=='-' || (c>='0' && c<='9'))
+		{
+			const char *b = s.c_str()+pos;
+			char *e = NULL;
+			v.m_type = CJsonValue::jNumber;
+			v.m_number = std::strtod(b,&e);
+			if (e==b) fail("invalid number");
+			pos += e-b;
+		}
+		else fail("unexpected character");
+	}
+};
+
+CJsonValue CJsonValue::Parse(const std::string &text)
+{
+	TJsonParser p(text);
+	CJsonValue v;
+	p.parseValue(v);
+	p.skipSpaces();
+	if (p.pos!=text.size()) p.fail("trailing characters");
+	return v;
+}
+
+CJsonValue CJsonValue::ParseFile(const std::string &file)
+{
+	std::ifstream f(file.c_str(), std::ios::binary);
+	if (!f) throw std::runtime_error("Cannot open `"+file+"`");
+	std::stringstream ss;
+	ss << f.rdbuf();
+	try {
+		return Parse(ss.str());
+	} catch (std::exception &e) {
+		throw std::runtime_error(file+": "+e.what());
+	}
+}
+
+static void check_type(const CJsonValue &v, CJsonValue::TType t)
+{
+	if (v.type()!=t)
+		throw std::runtime_error(std::string("JSON: expected ")+type_name(t)+", found "+type_name(v.type()));
+}
+
+bool CJsonValue::asBool() const { check_type(*this,jBool); return m_bool; }
+double CJsonValue::asNumber() const { check_type(*this,jNumber); return m_number; }
+const std::string &CJsonValue::asString() const { check_type(*this,jString); return m_string; }
+
+size_t CJsonValue::size() const
+{
+	if (m_type==jObject) return m_object.size();
+	check_type(*this,jArray);
+	return m_array.size();
+}
+
+const CJsonValue &CJsonValue::operator[](size_t i) const
+{
+	check_type(*this,jArray);
+	if (i>=m_array.size()) throw std::runtime_error("JSON: array index out of range");
+	return m_array[i];
+}
+
+const CJsonValue *CJsonValue::find(const std::string &key) const
+{
+	check_type(*this,jObject);
+	for (size_t i=0;i<m_object.size();i++)
+		if (m_object[i].first==key) return &m_object[i].second;
+	return NULL;
+}
+
+bool CJsonValue::has(const std::string &key) const { return find(key)!=NULL; }
+
+const CJsonValue &CJsonValue::operator[](const std::string &key) const
+{
+	const CJsonValue *v = find(key);
+	if (!v) throw std::runtime_error("JSON: missing member `"+key+"`");
+	return *v;
+}
+
+const std::vector<std::pair<std::string,CJsonValue> > &CJsonValue::members() const
+{
+	check_type(*this,jObject);
+	return m_object;
+}
+
+// Optional members: a type mismatch is an error, with the member name:
+template <class T, class GETTER>
+static T get_member(const CJsonValue &obj, const std::string &key, const T &def, GETTER getter)
+{
+	const CJsonValue *v = obj.has(key) ? &obj[key] : NULL;
+	if (!v || v->isNull()) return def;
+	try {
+		return getter(*v);
+	} catch (std::exception &e) {
+		throw std::runtime_error(std::string(e.what())+" in `"+key+"`");
+	}
+}
+
+double CJsonValue::get(const std::string &key, double def) const
+{
+	return get_member(*this, key, def, [](const CJsonValue &v) { return v.asNumber(); });
+}
+
+bool CJsonValue::get(const std::string &key, bool def) const
+{
+	return get_member(*this, key, def, [](const CJsonValue &v) { return v.asBool(); });
+}
+
+std::string CJsonValue::get(const std::string &key, const char *def) const
+{
+	return get_member(*this, key, std::string(def), [](const CJsonValue &v) { return v.asString(); });
+}
+
+std::string json_quote(const std::string &s)
+{
+	std::string r = "\"";
+	for (size_t i=0;i<s.size();i++)
+	{
+		const char c = s[i];
+		if (c=='"' || c=='\\') { r+='\\'; r+=c; }
+		else if (static_cast<unsigned char>(c)<0x20) {
+			char buf[8];
+			snprintf(buf,sizeof(buf),"\\u%04x",c);
+			r+=buf;
+		}
+		else r+=c;
+	}
+	return r+"\"";
+}
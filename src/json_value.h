@@ -0,0 +1,63 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+/** A parsed JSON document (RFC 8259), for job descriptions. Accessors throw
+  * std::runtime_error on type mismatches and missing members, naming them. */
+class CJsonValue
+{
+public:
+	enum TType { jNull, jBool, jNumber, jString, jArray, jObject };
+
+	CJsonValue() : m_type(jNull), m_bool(false), m_number(0) {}
+
+	/** Throws std::runtime_error with the offset of the first syntax error */
+	static CJsonValue Parse(const std::string &text);
+	static CJsonValue ParseFile(const std::string &file);
+
+	TType type() const { return m_type; }
+	bool isNull() const { return m_type==jNull; }
+	bool isObject() const { return m_type==jObject; }
+	bool isArray() const { return m_type==jArray; }
+
+	bool asBool() const;
+	double asNumber() const;
+	const std::string &asString() const;
+
+	/** Array elements or object members */
+	size_t size() const;
+	const CJsonValue &operator[](size_t i) const;
+
+	bool has(const std::string &key) const;
+	const CJsonValue &operator[](const std::string &key) const;
+	const std::vector<std::pair<std::string,CJsonValue> > &members() const;
+
+	/** Optional members of an object, with defaults */
+	double get(const std::string &key, double def) const;
+	bool get(const std::string &key, bool def) const;
+	std::string get(const std::string &key, const char *def) const;
+
+private:
+	TType m_type;
+	bool m_bool;
+	double m_number;
+	std::string m_string;
+	std::vector<CJsonValue> m_array;
+	std::vector<std::pair<std::string,CJsonValue> > m_object;
+
+	const CJsonValue *find(const std::string &key) const;
+	friend struct TJsonParser;
+};
+
+/** `s` as a quoted JSON string */
+std::string json_quote(const std::string &s);
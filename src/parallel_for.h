@@ -0,0 +1,37 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include "thread_pool.h"
+
+/** Runs `func(begin,end)` over contiguous chunks of [0,N) on the CThreadPool.
+  * The range is split in a few chunks per thread, so that idle threads can
+  * steal the remaining ones. Ranges shorter than `min_chunk` elements per
+  * thread are run inline. */
+template <class FUNC>
+void parallel_for(size_t N, FUNC func, size_t min_chunk = 1024)
+{
+	const size_t nThreads = std::max<size_t>(1, std::min(CThreadPool::Instance().getConcurrency(), N/std::max<size_t>(1,min_chunk)));
+	if (nThreads<=1) {
+		if (N) func(size_t(0),N);
+		return;
+	}
+	const size_t nChunks = std::min(N/std::max<size_t>(1,min_chunk), 4*nThreads);
+	const size_t chunk = (N+nChunks-1)/nChunks;
+	CTaskGroup tasks;
+	for (size_t b=chunk;b<N;b+=chunk)
+	{
+		const size_t e = std::min(N,b+chunk);
+		tasks.run([&func,b,e]() { func(b,e); });
+	}
+	func(size_t(0),std::min(N,chunk));
+	tasks.wait();
+}
@@ -0,0 +1,232 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "perf_report.h"
+#include "json_value.h"
+#include "thread_pool.h"
+#include <mrpt/utils/CFileOutputStream.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#if defined(__linux__)
+#	include <time.h>
+#endif
+
+using namespace std;
+
+// Reads `key: value` (first number) from a /proc file; 0 if not found
+static uint64_t read_proc_value(const char *file, const char *key)
+{
+	FILE *f = fopen(file,"rt");
+	if (!f) return 0;
+	char line[256];
+	uint64_t val = 0;
+	const size_t key_len = strlen(key);
+	while (fgets(line,sizeof(line),f))
+	{
+		if (strncmp(line,key,key_len)!=0 || line[key_len]!=':') continue;
+		unsigned long long v = 0;
+		if (sscanf(line+key_len+1,"%llu",&v)==1) val = v;
+		break;
+	}
+	fclose(f);
+	return val;
+}
+
+static double cpu_time_now()
+{
+#if defined(CLOCK_PROCESS_CPUTIME_ID)
+	timespec ts;
+	if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID,&ts)==0)
+		return ts.tv_sec + 1e-9*ts.tv_nsec;
+#endif
+	return double(std::clock())/CLOCKS_PER_SEC;
+}
+
+CPerfReport::TSample CPerfReport::TSample::Now()
+{
+	TSample s;
+	s.wall = std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	s.cpu  = cpu_time_now();
+	s.rss      = 1024*read_proc_value("/proc/self/status","VmRSS");
+	s.rss_peak = 1024*read_proc_value("/proc/self/status","VmHWM");
+	s.bytes_read    = read_proc_value("/proc/self/io","rchar");
+	s.bytes_written = read_proc_value("/proc/self/io","wchar");
+	return s;
+}
+
+// Resets the peak RSS (VmHWM) of the process to its current RSS (Linux>=4.0)
+static void reset_peak_rss()
+{
+	FILE *f = fopen("/proc/self/clear_refs","wt");
+	if (!f) return;
+	fputs("5",f);
+	fclose(f);
+}
+
+CPerfReport::CPerfReport() : m_start(TSample::Now()), m_hw(NULL), m_reset_peak_rss(true)
+{
+}
+
+void CPerfReport::enter(const std::string &stage)
+{
+	if (m_reset_peak_rss) reset_peak_rss();
+	m_open_stage = stage;
+	m_stage_start = TSample::Now();
+	if (m_hw) m_hw->read(m_hw_start);
+}
+
+void CPerfReport::leave(const std::string &stage, double items, const char *items_unit)
+{
+	if (stage!=m_open_stage) return;
+	const TSample now = TSample::Now();
+	TEntry e;
+	e.name  = stage;
+	e.wall  = now.wall-m_stage_start.wall;
+	e.cpu   = now.cpu-m_stage_start.cpu;
+	e.rss_peak  = std::max(now.rss_peak, m_stage_start.rss);
+	e.rss_delta = int64_t(now.rss)-int64_t(m_stage_start.rss);
+	e.bytes_read    = now.bytes_read-m_stage_start.bytes_read;
+	e.bytes_written = now.bytes_written-m_stage_start.bytes_written;
+	e.items = items;
+	e.items_unit = items_unit;
+	e.threads = CThreadPool::Instance().getConcurrency();
+	if (m_hw)
+	{
+		m_hw->read(e.hw);
+		for (size_t t=0;t<e.hw.size() && t<m_hw_start.size();t++) {
+			e.hw[t] = e.hw[t]-m_hw_start[t];
+			e.hw_total += e.hw[t];
+		}
+	}
+	m_stages.push_back(e);
+	m_open_stage.clear();
+}
+
+void CPerfReport::addNested(const std::string &name, double wall)
+{
+	if (m_stages.empty()) return;
+	TEntry e;
+	e.name = name;
+	e.wall = wall;
+	m_stages.back().children.push_back(e);
+}
+
+void CPerfReport::setInfo(const std::string &key, const std::string &value)
+{
+	m_info.push_back(std::make_pair(key,value));
+}
+
+static void write_hw_counts(mrpt::utils::CFileOutputStream &f, const THwCounts &c)
+{
+	f.printf("{ ");
+	for (int i=0;i<HW_EVENT_COUNT;i++)
+		if (c.valid[i]) f.printf("\"%s\": %llu, ", hw_event_name(THwEvent(i)), (unsigned long long)c.v[i]);
+	if (c.ipc()>=0) f.printf("\"ipc\": %.3f, ", c.ipc());
+	const THwEvent misses[] = { hwLLCMisses, hwDTLBMisses, hwBranchMisses };
+	for (int i=0;i<3;i++)
+		if (c.perKiloInstr(misses[i])>=0) f.printf("\"%s_per_kinstr\": %.3f, ", hw_event_name(misses[i]), c.perKiloInstr(misses[i]));
+	f.printf("\"valid\": %s }", c.valid[hwInstructions] ? "true" : "false");
+}
+
+static void write_entry(mrpt::utils::CFileOutputStream &f, const CPerfReport::TEntry &e, const std::string &indent, bool nested)
+{
+	f.printf("%s{ \"name\": %s, \"wall_s\": %.6f", indent.c_str(), json_quote(e.name).c_str(), e.wall);
+	if (!nested)
+	{
+		f.printf(", \"cpu_s\": %.6f, \"rss_peak_bytes\": %llu, \"rss_delta_bytes\": %lld, \"bytes_read\": %llu, \"bytes_written\": %llu, \"threads\": %u",
+			e.cpu, (unsigned long long)e.rss_peak, (long long)e.rss_delta, (unsigned long long)e.bytes_read, (unsigned long long)e.bytes_written, (unsigned)e.threads);
+		if (e.items>0)
+			f.printf(", \"items\": %.0f, \"items_unit\": %s, \"throughput_per_s\": %.3f", e.items, json_quote(e.items_unit).c_str(), e.wall>0 ? e.items/e.wall : 0.0);
+		if (!e.hw.empty())
+		{
+			f.printf(",\n%s  \"hw\": { \"total\": ", indent.c_str());
+			write_hw_counts(f, e.hw_total);
+			f.printf(",\n%s    \"per_thread\": [\n", indent.c_str());
+			for (size_t t=0;t<e.hw.size();t++)
+			{
+				f.printf("%s      ", indent.c_str());
+				write_hw_counts(f, e.hw[t]);
+				f.printf(t+1<e.hw.size() ? ",\n" : "\n");
+			}
+			f.printf("%s    ] }", indent.c_str());
+		}
+	}
+	if (!e.children.empty())
+	{
+		f.printf(",\n%s  \"children\": [\n", indent.c_str());
+		for (size_t i=0;i<e.children.size();i++)
+		{
+			write_entry(f, e.children[i], indent+"    ", true);
+			f.printf(i+1<e.children.size() ? ",\n" : "\n");
+		}
+		f.printf("%s  ]", indent.c_str());
+	}
+	f.printf(" }");
+}
+
+void CPerfReport::saveToJSON(const std::string &file) const
+{
+	const TSample now = TSample::Now();
+	uint64_t peak = now.rss_peak;
+	for (size_t i=0;i<m_stages.size();i++) peak = std::max(peak, m_stages[i].rss_peak);
+
+	mrpt::utils::CFileOutputStream f(file);
+	f.printf("{\n");
+	for (size_t i=0;i<m_info.size();i++)
+		f.printf("  %s: %s,\n", json_quote(m_info[i].first).c_str(), json_quote(m_info[i].second).c_str());
+	f.printf("  \"threads\": %u,\n", (unsigned)CThreadPool::Instance().getConcurrency());
+	f.printf("  \"rss_peak_scope\": \"%s\",\n", m_reset_peak_rss ? "stage" : "process, shared with concurrent jobs");
+	if (m_hw)
+	{
+		const std::vector<int> &tids = m_hw->getThreadIds();
+		f.printf("  \"hw_thread_ids\": [");
+		for (size_t t=0;t<tids.size();t++) f.printf(t ? ", %d" : "%d", tids[t]);
+		f.printf("],\n");
+	}
+	f.printf("  \"total\": { \"wall_s\": %.6f, \"cpu_s\": %.6f, \"rss_peak_bytes\": %llu, \"bytes_read\": %llu, \"bytes_written\": %llu },\n",
+		now.wall-m_start.wall, now.cpu-m_start.cpu, (unsigned long long)peak,
+		(unsigned long long)(now.bytes_read-m_start.bytes_read), (unsigned long long)(now.bytes_written-m_start.bytes_written));
+	f.printf("  \"stages\": [\n");
+	for (size_t i=0;i<m_stages.size();i++)
+	{
+		write_entry(f, m_stages[i], "    ", false);
+		f.printf(i+1<m_stages.size() ? ",\n" : "\n");
+	}
+	f.printf("  ]\n}\n");
+}
+
+static void print_hw_row(const char *label, const THwCounts &c)
+{
+	printf("  %-30s %12.3e %6.2f %8.2f %8.2f %8.2f\n", label, double(c.v[hwInstructions]), c.ipc(),
+		c.perKiloInstr(hwLLCMisses), c.perKiloInstr(hwDTLBMisses), c.perKiloInstr(hwBranchMisses));
+}
+
+void CPerfReport::printHwSummary() const
+{
+	if (!m_hw) return;
+	printf("Hardware counters per stage (misses per 1000 instructions, -1: not available):\n");
+	printf("  %-30s %12s %6s %8s %8s %8s\n", "stage / thread", "instr", "IPC", "LLC", "dTLB", "branch");
+	const std::vector<int> &tids = m_hw->getThreadIds();
+	for (size_t i=0;i<m_stages.size();i++)
+	{
+		const TEntry &e = m_stages[i];
+		if (e.hw.empty()) continue;
+		print_hw_row(e.name.c_str(), e.hw_total);
+		if (e.hw.size()<2) continue;
+		for (size_t t=0;t<e.hw.size();t++)
+		{
+			if (!e.hw[t].v[hwInstructions]) continue; // Idle thread
+			char label[64];
+			snprintf(label,sizeof(label),"  tid %d", t<tids.size() ? tids[t] : -1);
+			print_hw_row(label, e.hw[t]);
+		}
+	}
+}
@@ -0,0 +1,91 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "hw_counters.h"
+
+/** Per-stage performance record, saved as JSON for tracking regressions
+  * across runs: wall and CPU time, peak and incremental resident memory, bytes
+  * read and written, and throughput of each stage (enter()/leave() pairs, like
+  * CTimeLogger), plus optional nested entries (e.g. solver internals).
+  *
+  * Memory and I/O figures come from /proc/self/{status,io}; on other systems
+  * they are reported as 0. The peak RSS of each stage is measured by resetting
+  * the kernel high-water mark (/proc/self/clear_refs) when it is entered.
+  *
+  * With setHwCounters(), each stage also records the hardware counters of
+  * every pool thread (see CHwCounters).
+  */
+class CPerfReport
+{
+public:
+	struct TSample
+	{
+		TSample() : wall(0), cpu(0), rss(0), rss_peak(0), bytes_read(0), bytes_written(0) {}
+		double   wall, cpu;      //!< [s]
+		uint64_t rss, rss_peak;  //!< [bytes]
+		uint64_t bytes_read, bytes_written;
+		static TSample Now();
+	};
+
+	struct TEntry
+	{
+		TEntry() : wall(0), cpu(0), rss_peak(0), rss_delta(0), bytes_read(0), bytes_written(0), items(0), threads(0) {}
+		std::string name;
+		double   wall, cpu;
+		uint64_t rss_peak;
+		int64_t  rss_delta;
+		uint64_t bytes_read, bytes_written;
+		double   items;           //!< Points or cells processed, for the throughput
+		std::string items_unit;
+		size_t   threads;
+		std::vector<TEntry> children;
+		std::vector<THwCounts> hw;  //!< Per thread (see CHwCounters::getThreadIds()); empty if not enabled
+		THwCounts hw_total;
+	};
+
+	CPerfReport();
+
+	void enter(const std::string &stage);
+	/** Closes the last entered stage, which processed `items` `items_unit` (e.g. "points") */
+	void leave(const std::string &stage, double items = 0, const char *items_unit = "");
+
+	/** Adds a nested entry (wall time only) to the last stage that was left */
+	void addNested(const std::string &name, double wall);
+
+	void setInfo(const std::string &key, const std::string &value);
+
+	/** By default, enter() resets the peak RSS of the process so that each
+	  * stage reports its own peak. Disable it for reports of jobs that run
+	  * concurrently in one process, which would wipe each other's peaks:
+	  * their peak RSS is then that of the whole process. */
+	void setResetPeakRss(bool reset) { m_reset_peak_rss = reset; }
+
+	/** Records hardware counters per stage from `hw` (must outlive this object; NULL to disable) */
+	void setHwCounters(const CHwCounters *hw) { m_hw = hw; }
+
+	/** Prints per-stage (and per-thread) IPC and miss rates to the console */
+	void printHwSummary() const;
+
+	const std::vector<TEntry> &getStages() const { return m_stages; }
+
+	void saveToJSON(const std::string &file) const;
+
+private:
+	TSample m_start, m_stage_start;
+	std::string m_open_stage;
+	std::vector<TEntry> m_stages;
+	std::vector<std::pair<std::string,std::string> > m_info;
+	const CHwCounters *m_hw;
+	std::vector<THwCounts> m_hw_start;
+	bool m_reset_peak_rss;
+};
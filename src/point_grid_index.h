@@ -0,0 +1,95 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+/** A coarse 2D grid over the XY plane that buckets point indices by cell.
+  * Storage is compressed (CSR-like): one offset per cell into a single array of
+  * point indices, built with a two-pass counting sort, so it costs O(N) time and
+  * two machine words per point regardless of how sparse the footprint is.
+  */
+class CPointGridIndex
+{
+public:
+	CPointGridIndex() : m_x_min(0), m_y_min(0), m_cell_size(1), m_size_x(0), m_size_y(0) {}
+
+	/** Builds the index for the points `xyz(i,0:1)`, i=0..N-1. Points outside the
+	  * given limits are clamped into the border cells. */
+	template <class XYZ_MATRIX>
+	void build(const XYZ_MATRIX &xyz, double x_min, double x_max, double y_min, double y_max, double cell_size)
+	{
+		const size_t N = xyz.rows();
+		resize(x_min,x_max,y_min,y_max,cell_size);
+
+		std::vector<size_t> pt_cell(N);
+		for (size_t i=0;i<N;i++)
+		{
+			const size_t c = cellIndex(x2idx(xyz(i,0)), y2idx(xyz(i,1)));
+			pt_cell[i] = c;
+			m_cell_start[c+1]++;
+		}
+		for (size_t c=0;c<m_size_x*m_size_y;c++)
+			m_cell_start[c+1]+=m_cell_start[c];
+
+		m_pts.resize(N);
+		std::vector<size_t> next(m_cell_start.begin(), m_cell_start.end()-1);
+		for (size_t i=0;i<N;i++)
+			m_pts[next[pt_cell[i]]++] = i;
+	}
+
+	inline size_t getSizeX() const { return m_size_x; }
+	inline size_t getSizeY() const { return m_size_y; }
+	inline size_t getCellCount() const { return m_size_x*m_size_y; }
+	inline double getCellSize() const { return m_cell_size; }
+	inline double getXMin() const { return m_x_min; }
+	inline double getYMin() const { return m_y_min; }
+
+	inline size_t x2idx(double x) const { return clampIdx( (x-m_x_min)/m_cell_size, m_size_x); }
+	inline size_t y2idx(double y) const { return clampIdx( (y-m_y_min)/m_cell_size, m_size_y); }
+	inline size_t cellIndex(size_t cx, size_t cy) const { return cx + cy*m_size_x; }
+
+	/** Number of points in cell with linear index `c` */
+	inline size_t cellPointCount(size_t c) const { return m_cell_start[c+1]-m_cell_start[c]; }
+	/** Range [begin,end) of point indices in cell with linear index `c` */
+	inline const size_t *cellBegin(size_t c) const { return m_pts.empty() ? NULL : &m_pts[0]+m_cell_start[c]; }
+	inline const size_t *cellEnd(size_t c) const { return m_pts.empty() ? NULL : &m_pts[0]+m_cell_start[c+1]; }
+
+	/** Number of cells with at least one point */
+	size_t countNonEmptyCells() const
+	{
+		size_t n=0;
+		for (size_t c=0;c<getCellCount();c++) if (cellPointCount(c)) n++;
+		return n;
+	}
+
+private:
+	double m_x_min, m_y_min, m_cell_size;
+	size_t m_size_x, m_size_y;
+	std::vector<size_t> m_cell_start; //!< Size: cells+1
+	std::vector<size_t> m_pts;        //!< Point indices, sorted by cell
+
+	void resize(double x_min, double x_max, double y_min, double y_max, double cell_size)
+	{
+		m_x_min = x_min; m_y_min = y_min; m_cell_size = cell_size;
+		m_size_x = std::max<size_t>(1, static_cast<size_t>(std::ceil((x_max-x_min)/cell_size)));
+		m_size_y = std::max<size_t>(1, static_cast<size_t>(std::ceil((y_max-y_min)/cell_size)));
+		m_cell_start.assign(m_size_x*m_size_y+1, 0);
+		m_pts.clear();
+	}
+	static inline size_t clampIdx(double f, size_t n)
+	{
+		if (!(f>0)) return 0;
+		const size_t i = static_cast<size_t>(f);
+		return i<n ? i : n-1;
+	}
+};
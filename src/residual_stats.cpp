@@ -0,0 +1,168 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "residual_stats.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+static const double PI = 3.14159265358979323846;
+
+CTDigest::CTDigest(double compression) :
+	m_compression(compression),
+	m_min(std::numeric_limits<double>::max()),
+	m_max(-std::numeric_limits<double>::max()),
+	m_total_w(0), m_buffer_w(0)
+{
+}
+
+void CTDigest::add(double x, double w)
+{
+	if (x<m_min) m_min=x;
+	if (x>m_max) m_max=x;
+	m_buffer.push_back(TCentroid(x,w));
+	m_buffer_w+=w;
+	if (m_buffer.size()>=size_t(5*m_compression))
+		compress();
+}
+
+void CTDigest::merge(const CTDigest &o)
+{
+	o.compress();
+	if (o.m_min<m_min) m_min=o.m_min;
+	if (o.m_max>m_max) m_max=o.m_max;
+	m_buffer.insert(m_buffer.end(), o.m_centroids.begin(), o.m_centroids.end());
+	m_buffer_w+=o.m_total_w;
+	compress();
+}
+
+void CTDigest::compress() const
+{
+	if (m_buffer.empty()) return;
+
+	m_buffer.insert(m_buffer.end(), m_centroids.begin(), m_centroids.end());
+	std::sort(m_buffer.begin(), m_buffer.end());
+	const double total = m_total_w + m_buffer_w;
+
+	// k1 scale function: k(q) = d/(2pi) asin(2q-1), each centroid spans at most dk=1
+	const double d = m_compression;
+	m_centroids.clear();
+	TCentroid cur = m_buffer[0];
+	double w_so_far = 0;
+	double q_limit = total * 0.5*(std::sin( std::asin(-1.0) + 2*PI/d )+1);
+	for (size_t i=1;i<m_buffer.size();i++)
+	{
+		const TCentroid &c = m_buffer[i];
+		if (w_so_far+cur.w+c.w <= q_limit) {
+			cur.w+=c.w;
+			cur.mean+=(c.mean-cur.mean)*c.w/cur.w;
+		}
+		else {
+			w_so_far+=cur.w;
+			m_centroids.push_back(cur);
+			const double k = std::asin(std::min(1.0, 2*w_so_far/total-1));
+			q_limit = total * 0.5*(std::sin( std::min(0.5*PI, k + 2*PI/d) )+1);
+			cur = c;
+		}
+	}
+	m_centroids.push_back(cur);
+
+	m_total_w = total;
+	m_buffer.clear();
+	m_buffer_w = 0;
+}
+
+double CTDigest::quantile(double q) const
+{
+	compress();
+	const std::vector<TCentroid> &c = m_centroids;
+	if (c.empty()) return std::numeric_limits<double>::quiet_NaN();
+	if (c.size()==1) return c[0].mean;
+
+	const double index = std::min(1.0,std::max(0.0,q)) * m_total_w;
+
+	// Between the minimum and the first centroid center:
+	if (index < 0.5*c[0].w)
+		return m_min + (c[0].mean-m_min) * index/(0.5*c[0].w);
+
+	double cum = 0;
+	for (size_t i=0;i+1<c.size();i++)
+	{
+		const double ci = cum + 0.5*c[i].w, cn = cum + c[i].w + 0.5*c[i+1].w;
+		if (index<=cn)
+			return c[i].mean + (c[i+1].mean-c[i].mean) * (index-ci)/(cn-ci);
+		cum+=c[i].w;
+	}
+
+	// Between the last centroid center and the maximum:
+	const double cl = m_total_w - 0.5*c.back().w;
+	return c.back().mean + (m_max-c.back().mean) * std::min(1.0,(index-cl)/(0.5*c.back().w));
+}
+
+CResidualStats::CResidualStats() :
+	m_n(0), m_mean(0), m_M2(0),
+	m_min(std::numeric_limits<double>::max()),
+	m_max(-std::numeric_limits<double>::max())
+{
+}
+
+void CResidualStats::merge(const CResidualStats &o)
+{
+	if (!o.m_n) return;
+	// Chan et al. parallel update of the Welford moments:
+	const double n = double(m_n)+o.m_n;
+	const double d = o.m_mean-m_mean;
+	m_M2   += o.m_M2 + d*d*double(m_n)*o.m_n/n;
+	m_mean += d*o.m_n/n;
+	m_n    += o.m_n;
+	m_min = std::min(m_min,o.m_min);
+	m_max = std::max(m_max,o.m_max);
+	m_digest.merge(o.m_digest);
+	m_abs_digest.merge(o.m_abs_digest);
+	if (m_n<=EXACT_MAX) m_values.insert(m_values.end(), o.m_values.begin(), o.m_values.end());
+	else std::vector<double>().swap(m_values);
+}
+
+std::string CResidualStats::getStatsHeader()
+{
+	return "% MAX_ERR   MIN_ERR   AVERAGE_ERR   STD_DEV   RMSE    MEDIAN   P95   P99   LE90\n";
+}
+
+void CResidualStats::getStats(Eigen::VectorXd &stats) const
+{
+	stats.resize(9);
+	stats.setZero();
+	const size_t N = m_n;
+	if (!N) return;
+
+	stats[0] = m_max;
+	stats[1] = m_min;
+	stats[2] = m_mean;
+	stats[3] = N>1 ? std::sqrt(m_M2/(N-1)) : 0.0;
+	// RMSE:
+	stats[4] = std::sqrt( m_M2/N + m_mean*m_mean );
+	if (N<=EXACT_MAX)
+	{
+		// Exact: the sorted residuals, with the median as v[N/2]
+		std::vector<double> v(m_values);
+		std::sort(v.begin(), v.end());
+		stats[5] = v[N/2];
+		stats[6] = v[std::min(N-1, size_t(0.95*N))];
+		stats[7] = v[std::min(N-1, size_t(0.99*N))];
+		for (size_t i=0;i<N;i++) v[i]=std::abs(v[i]);
+		std::sort(v.begin(), v.end());
+		stats[8] = v[std::min(N-1, size_t(0.90*N))];
+	}
+	else
+	{
+		stats[5] = m_digest.quantile(0.50);
+		stats[6] = m_digest.quantile(0.95);
+		stats[7] = m_digest.quantile(0.99);
+		stats[8] = m_abs_digest.quantile(0.90);
+	}
+}
@@ -0,0 +1,84 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <Eigen/Dense>
+#include <vector>
+#include <string>
+#include <cstddef>
+
+/** Mergeable t-digest sketch (Dunning & Ertl, "merging" variant, k1 scale
+  * function) for approximate quantiles in bounded memory. Accuracy is best at
+  * the tails, which is where P95/P99 live. */
+class CTDigest
+{
+public:
+	explicit CTDigest(double compression = 200);
+
+	void add(double x, double w = 1.0);
+	void merge(const CTDigest &o);
+	/** Quantile `q` in [0,1]. Returns NaN if empty. */
+	double quantile(double q) const;
+	double totalWeight() const { return m_total_w + m_buffer_w; }
+
+private:
+	struct TCentroid {
+		double mean, w;
+		TCentroid(double m=0, double w_=0) : mean(m), w(w_) {}
+		bool operator<(const TCentroid &o) const { return mean<o.mean; }
+	};
+	double m_compression;
+	double m_min, m_max;
+	mutable std::vector<TCentroid> m_centroids, m_buffer;
+	mutable double m_total_w, m_buffer_w;
+
+	void compress() const;
+};
+
+/** Single-pass, mergeable accumulator of all the statistics reported for a
+  * set of residuals: max, min, mean and std (Welford), RMSE, and median, P95,
+  * P99 and LE90 (90th percentile of |r|). Quantiles are exact (from the sorted
+  * residuals) for up to EXACT_MAX residuals, and t-digest estimates beyond.
+  * Per-thread instances can be combined with merge(). */
+class CResidualStats
+{
+public:
+	/** Up to this many residuals are kept, for exact quantiles */
+	static const size_t EXACT_MAX = size_t(1)<<16;
+
+	CResidualStats();
+
+	inline void add(double r)
+	{
+		m_n++;
+		const double d = r-m_mean;
+		m_mean += d/m_n;
+		m_M2 += d*(r-m_mean);
+		if (r>m_max) m_max=r;
+		if (r<m_min) m_min=r;
+		m_digest.add(r);
+		m_abs_digest.add(std::abs(r));
+		if (m_n<=EXACT_MAX) m_values.push_back(r);
+		else if (!m_values.empty()) std::vector<double>().swap(m_values);
+	}
+	void merge(const CResidualStats &o);
+
+	size_t size() const { return m_n; }
+
+	/** Column names of the vector returned by getStats() */
+	static std::string getStatsHeader();
+	/** Fills: MAX_ERR MIN_ERR AVERAGE_ERR STD_DEV RMSE MEDIAN P95 P99 LE90 (max/min are signed) */
+	void getStats(Eigen::VectorXd &stats) const;
+
+private:
+	size_t m_n;
+	double m_mean, m_M2, m_min, m_max;
+	CTDigest m_digest, m_abs_digest;
+	std::vector<double> m_values; //!< All residuals, while m_n<=EXACT_MAX
+};
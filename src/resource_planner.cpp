@@ -0,0 +1,329 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "resource_planner.h"
+#include "gmrf_solver.h"
+#include "dem_predict.h"
+#include <mrpt/maps/CHeightGridMap2D_MRF.h>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#ifdef _WIN32
+#	define NOMINMAX
+#	include <windows.h>
+#else
+#	include <unistd.h>
+#endif
+
+using namespace mrpt::maps;
+
+// Memory model constants [bytes]. Eigen sparse matrices store one double (or
+// float) and one int per nonzero, plus one int per column.
+static const double TRIPLET_BYTES = 16;        // Eigen::Triplet<double>
+static const double SPMAT_BYTES_PER_NNZ = 12, SPMAT_F32_BYTES_PER_NNZ = 8;
+static const double MRPT_OBS_BYTES = 48;       // Per observation kept by CHeightGridMap2D_MRF
+static const double MRPT_PRIOR_BYTES = 96;     // Per cell: prior factors and their Hessian triplets
+
+static double wall_now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TPlanInput::sampleOccupancy(const TPointsView &xyz, size_t max_samples)
+{
+	blocks_x = (geom.size_x+BLOCK-1)/BLOCK;
+	blocks_y = (geom.size_y+BLOCK-1)/BLOCK;
+	block_has_data.assign(blocks_x*blocks_y, 0);
+	const size_t N = xyz.rows();
+	const size_t stride = std::max<size_t>(1, (N+max_samples-1)/std::max<size_t>(1,max_samples));
+	sample_ratio = N ? 1.0/stride : 1.0;
+	for (size_t i=0;i<N;i+=stride)
+	{
+		const double cx = (xyz(i,0)-geom.x_min)/geom.resolution, cy = (xyz(i,1)-geom.y_min)/geom.resolution;
+		if (cx<0 || cy<0 || cx>=geom.size_x || cy>=geom.size_y) continue;
+		block_has_data[size_t(cx)/BLOCK + (size_t(cy)/BLOCK)*blocks_x] = 1;
+	}
+}
+
+// Number of cells of `occupied` (nx*ny) within `r` cells (Chebyshev) of a
+// non-zero one: separable running max along rows, then along columns.
+static size_t count_dilated(const std::vector<uint8_t> &occupied, size_t nx, size_t ny, size_t r)
+{
+	std::vector<uint8_t> rows(occupied.size(), 0);
+	for (size_t y=0;y<ny;y++)
+	{
+		// Distance to the last occupied cell on the left, then on the right:
+		size_t last = size_t(-1);
+		for (size_t x=0;x<nx;x++) {
+			if (occupied[x+y*nx]) last = x;
+			if (last!=size_t(-1) && x-last<=r) rows[x+y*nx] = 1;
+		}
+		last = size_t(-1);
+		for (size_t x=nx;x-->0;) {
+			if (occupied[x+y*nx]) last = x;
+			if (last!=size_t(-1) && last-x<=r) rows[x+y*nx] = 1;
+		}
+	}
+	size_t count = 0;
+	for (size_t x=0;x<nx;x++)
+	{
+		std::vector<size_t> dist(ny, size_t(-1));
+		size_t last = size_t(-1);
+		for (size_t y=0;y<ny;y++) {
+			if (rows[x+y*nx]) last = y;
+			if (last!=size_t(-1)) dist[y] = y-last;
+		}
+		last = size_t(-1);
+		for (size_t y=ny;y-->0;) {
+			if (rows[x+y*nx]) last = y;
+			if (last!=size_t(-1)) dist[y] = std::min(dist[y], last-y);
+			if (dist[y]<=r) count++;
+		}
+	}
+	return count;
+}
+
+double CResourcePlanner::TPowerLaw::at(double n) const
+{
+	return n>0 ? t1*std::pow(n/n1, beta) : 0.0;
+}
+
+CResourcePlanner::TPowerLaw CResourcePlanner::TPowerLaw::Fit(double n1, double t1, double n2, double t2, double beta_min, double beta_max)
+{
+	double beta = (t1>0 && t2>0 && n2!=n1) ? std::log(t2/t1)/std::log(n2/n1) : beta_max;
+	beta = std::max(beta_min, std::min(beta_max, beta));
+	// Anchor at the largest (most representative) measurement:
+	return TPowerLaw(std::max(t2,1e-9), n2, beta);
+}
+
+CResourcePlanner::CResourcePlanner() :
+	m_fill_c0(0.81), m_fill_c1(0.068),
+	m_factor(0.18,65536,1.42), m_variance(4.6,65536,1.64), m_factor_f32(0.15,65536,1.42),
+	m_mrpt_solve(0.5,65536,1.5), m_mrpt_variance(60,65536,2.2)
+{
+}
+
+double CResourcePlanner::factorNonZeros(double n) const
+{
+	if (n<2) return n;
+	const double L = std::log2(n);
+	return std::max(n, n*(m_fill_c0*L + m_fill_c1*L*L));
+}
+
+void CResourcePlanner::calibrate()
+{
+	// Native solves of k*k grids with one observation every 3 cells, as in
+	// dem-gmrf-microbench:
+	const size_t sides[2] = { 96, 160 };
+	double n[2], nnz[2], t_fact[2], t_var[2], t_f32[2];
+	for (int k=0;k<2;k++)
+	{
+		const size_t side = sides[k];
+		n[k] = double(side*side);
+		for (int mixed=0;mixed<2;mixed++)
+		{
+			CGmrfDemSolver solver(side,side);
+			for (size_t c=0;c<side*side;c+=3)
+				solver.addObservation(c%side, c/side, std::sin(0.05*(c%side))+std::cos(0.07*(c/side)), 25.0);
+			CGmrfDemSolver::TOptions opts;
+			opts.mixed_precision = mixed!=0;
+			opts.skip_variance = mixed!=0;
+			solver.solve(opts);
+			const std::vector<CGmrfDemSolver::TProfileEntry> &prof = solver.getProfile();
+			if (!mixed) {
+				nnz[k] = double(solver.getFactorNonZeros());
+				t_fact[k] = t_var[k] = 0;
+			}
+			else t_f32[k] = 0;
+			for (size_t i=0;i<prof.size();i++)
+			{
+				if (prof[i].name=="factorize" && !mixed) t_fact[k] += prof[i].wall;
+				else if (prof[i].name=="variance" && !mixed) t_var[k] += prof[i].wall;
+				else if (mixed && prof[i].name!="assemble") t_f32[k] += prof[i].wall;
+			}
+		}
+	}
+	// Fill: solve nnz/n = c0*L + c1*L^2 at both sizes
+	const double L0 = std::log2(n[0]), L1 = std::log2(n[1]);
+	const double f0 = nnz[0]/n[0], f1 = nnz[1]/n[1];
+	double c1 = (f1/L1 - f0/L0)/(L1-L0);
+	if (c1<0) c1 = 0;
+	const double c0 = f1/L1 - c1*L1;
+	if (c0>0) { m_fill_c0 = c0; m_fill_c1 = c1; }
+
+	m_factor     = TPowerLaw::Fit(n[0],t_fact[0], n[1],t_fact[1], 1.2, 2.0);
+	m_variance   = TPowerLaw::Fit(n[0],t_var[0],  n[1],t_var[1],  1.3, 2.0);
+	m_factor_f32 = TPowerLaw::Fit(n[0],t_f32[0],  n[1],t_f32[1],  1.2, 2.0);
+
+	// MRPT: whole solve with and without variance, on smaller grids
+	const size_t mrpt_sides[2] = { 24, 40 };
+	double nm[2], t_solve[2], t_mvar[2];
+	for (int k=0;k<2;k++)
+	{
+		const size_t side = mrpt_sides[k];
+		nm[k] = double(side*side);
+		double t[2];
+		for (int with_var=0;with_var<2;with_var++)
+		{
+			CHeightGridMap2D_MRF map(CRandomFieldGridMap2D::mrGMRF_SD, 0,1, 0,1, 0.5, false);
+			map.insertionOptions.GMRF_lambdaObs = 25.0;
+			map.insertionOptions.GMRF_skip_variance = !with_var;
+			const TRandomFieldCell def(0,0);
+			map.setSize(0,double(side),0,double(side),1.0,&def);
+			for (size_t c=0;c<side*side;c+=3)
+				map.insertIndividualReading(std::sin(0.05*(c%side)), mrpt::math::TPoint2D(c%side+0.5,c/side+0.5), false, true, 0.2);
+			const double t0 = wall_now();
+			map.updateMapEstimation();
+			t[with_var] = wall_now()-t0;
+		}
+		t_solve[k] = t[0];
+		t_mvar[k] = std::max(0.0, t[1]-t[0]);
+	}
+	m_mrpt_solve    = TPowerLaw::Fit(nm[0],t_solve[0], nm[1],t_solve[1], 1.2, 2.0);
+	m_mrpt_variance = TPowerLaw::Fit(nm[0],t_mvar[0],  nm[1],t_mvar[1],  1.5, 3.0);
+}
+
+double CResourcePlanner::estimateUnknowns(const TPlanInput &in, const std::string &storage) const
+{
+	const double total = double(in.geom.size_x)*in.geom.size_y;
+	const double block_side = TPlanInput::BLOCK*in.geom.resolution;
+	if (storage=="sparse")
+	{
+		// Materialized CSparseDemGrid blocks: those with data plus a margin
+		const size_t R = CSparseDemGrid::BLOCK/TPlanInput::BLOCK;
+		const size_t sx = (in.blocks_x+R-1)/R, sy = (in.blocks_y+R-1)/R;
+		std::vector<uint8_t> occ(sx*sy, 0);
+		for (size_t by=0;by<in.blocks_y;by++)
+			for (size_t bx=0;bx<in.blocks_x;bx++)
+				if (in.block_has_data[bx+by*in.blocks_x]) occ[bx/R+(by/R)*sx] = 1;
+		const size_t margin = std::max(1, int(std::ceil(in.mask_dist/(CSparseDemGrid::BLOCK*in.geom.resolution))));
+		return std::min(total, double(count_dilated(occ,sx,sy,margin))*CSparseDemGrid::BLOCK*CSparseDemGrid::BLOCK);
+	}
+	double n = total;
+	if (in.mask_dist>0) // Upper bound: whole 8x8 blocks within reach of the data
+		n = std::min(n, double(count_dilated(in.block_has_data, in.blocks_x, in.blocks_y, size_t(std::ceil(in.mask_dist/block_side))))*TPlanInput::BLOCK*TPlanInput::BLOCK);
+	if (in.aoi_area>0)
+		n = std::min(n, in.aoi_area/(in.geom.resolution*in.geom.resolution));
+	return n;
+}
+
+TPlanEstimate CResourcePlanner::estimate(const TPlanInput &in, const TPlanStrategy &s) const
+{
+	TPlanEstimate e;
+	e.strategy = s;
+	const double total = double(in.geom.size_x)*in.geom.size_y;
+	const bool masked = in.mask_dist>0 || in.aoi_area>0;
+	const bool mrpt = s.solver=="mrpt", mixed = s.solver=="mixed";
+	e.feasible = !(mrpt && (masked || s.storage!="dense"));
+
+	// Unknowns & sparsity: 4-neighbor prior, lower triangle incl. the diagonal
+	const double n = mrpt ? total : estimateUnknowns(in, s.storage);
+	e.unknowns = n;
+	e.nnz_Q = 3*n;
+	e.nnz_L = factorNonZeros(n);
+
+	// Grid storage (and the transient mask, with mask-dist):
+	if (s.storage=="dense") e.grid_bytes = total*sizeof(TRandomFieldCell);
+	else if (s.storage=="soa") e.grid_bytes = total*2*sizeof(double);
+	else if (s.storage=="compact") e.grid_bytes = total*2*sizeof(float);
+	else e.grid_bytes = n*sizeof(TRandomFieldCell);
+	const bool uses_mask = masked && s.storage!="sparse";
+	const double mask_bytes = uses_mask ? total : 0;
+	const double mask_build_bytes = uses_mask && in.mask_dist>0 ? 5*total : 0; // has_data + float distances
+
+	// Solver, for the steps of CGmrfDemSolver::solve():
+	const double Qbytes = e.nnz_Q*SPMAT_BYTES_PER_NNZ + 4*n;
+	const double Qbytes_f32 = e.nnz_Q*SPMAT_F32_BYTES_PER_NNZ + 4*n;
+	double state = 5*8*n + (uses_mask || s.storage=="sparse" ? 8*n : 0); // per-unknown vectors
+	const double assemble = e.nnz_Q*TRIPLET_BYTES + 2*Qbytes + 16*n;
+	const double ldlt_aux = 36*n; // D, permutations, etree, column counts
+	const double var_bytes = in.skip_variance ? 0 : 8*e.nnz_L + 8*n;
+	double factor;
+	if (mixed) // A (double) + A (float) + P*A*P^T (float) + float L + refinement vectors
+		factor = Qbytes + Qbytes_f32 + Qbytes_f32 + SPMAT_F32_BYTES_PER_NNZ*e.nnz_L + ldlt_aux + 4*8*n + var_bytes;
+	else if (mrpt) // As native, without the selected inverse (one solve per cell)
+		factor = 2*Qbytes + SPMAT_BYTES_PER_NNZ*e.nnz_L + ldlt_aux + 16*n;
+	else
+		factor = 2*Qbytes + SPMAT_BYTES_PER_NNZ*e.nnz_L + ldlt_aux + 16*n + var_bytes;
+	if (mrpt) state += MRPT_PRIOR_BYTES*n + MRPT_OBS_BYTES*in.num_obs;
+
+	e.peak_bytes = double(in.baseline_bytes) + e.grid_bytes + mask_bytes +
+		std::max(mask_build_bytes, state + std::max(assemble, factor));
+
+	// Times:
+	if (mrpt) {
+		e.factor_s = m_mrpt_solve.at(n);
+		e.variance_s = in.skip_variance ? 0 : m_mrpt_variance.at(n);
+	}
+	else {
+		e.factor_s = mixed ? m_factor_f32.at(n) : m_factor.at(n);
+		e.variance_s = in.skip_variance ? 0 : m_variance.at(n);
+	}
+	e.total_s = e.factor_s+e.variance_s;
+	return e;
+}
+
+std::vector<TPlanStrategy> CResourcePlanner::alternatives(const TPlanStrategy &requested, bool masked)
+{
+	std::vector<TPlanStrategy> r(1, requested);
+	const char *solvers[] = { "mrpt", "native", "mixed" };
+	const char *storages[] = { "dense", "soa", "compact" };
+	for (int st=0;st<3;st++)
+		for (int so=0;so<3;so++)
+		{
+			TPlanStrategy s(solvers[so], requested.storage=="sparse" ? "sparse" : storages[st]);
+			if (s.solver=="mrpt" && (masked || s.storage!="dense")) continue;
+			bool dup = false;
+			for (size_t i=0;i<r.size();i++) dup = dup || r[i].name()==s.name();
+			if (!dup) r.push_back(s);
+		}
+	return r;
+}
+
+static std::string fmt_time(double s)
+{
+	char buf[32];
+	if (s<120) snprintf(buf,sizeof(buf),"%.1f s",s);
+	else if (s<7200) snprintf(buf,sizeof(buf),"%.1f min",s/60);
+	else snprintf(buf,sizeof(buf),"%.1f h",s/3600);
+	return buf;
+}
+
+void CResourcePlanner::printTable(const TPlanInput &in, const std::vector<TPlanEstimate> &estimates, double budget_bytes)
+{
+	const double GB = 1024.0*1024.0*1024.0;
+	const double total = double(in.geom.size_x)*in.geom.size_y;
+	size_t occupied = 0;
+	for (size_t i=0;i<in.block_has_data.size();i++) occupied += in.block_has_data[i];
+	const double data_cells = double(occupied)*TPlanInput::BLOCK*TPlanInput::BLOCK;
+	printf("[P] Grid: %u x %u cells (%.3e) at %.3f m. Observations: %.3e\n", (unsigned)in.geom.size_x, (unsigned)in.geom.size_y, total, in.geom.resolution, double(in.num_obs));
+	printf("[P] Area with data: %.1f%% of the grid (%.2f points/cell, from %.1f%% of the points)\n",
+		total>0 ? 100.0*std::min(total,data_cells)/total : 0.0, data_cells>0 ? in.num_obs/data_cells : 0.0, 100.0*in.sample_ratio);
+	printf("[P] Memory in use (points): %.2f GB%s\n", in.baseline_bytes/GB, in.skip_variance ? "  Variance: skipped" : "");
+	printf("[P] %-16s %10s %10s %10s %6s %10s %10s %10s %10s %s\n", "solver/storage", "unknowns", "nnz(Q)", "nnz(L)", "fill", "grid GB", "peak GB", "factor", "variance", "stage [6]");
+	for (size_t i=0;i<estimates.size();i++)
+	{
+		const TPlanEstimate &e = estimates[i];
+		printf("[P] %-16s %10.3e %10.3e %10.3e %6.1f %10.2f %10.2f %10s %10s %s%s\n", e.strategy.name().c_str(), e.unknowns, e.nnz_Q, e.nnz_L,
+			e.nnz_Q>0 ? e.nnz_L/e.nnz_Q : 0.0, e.grid_bytes/GB, e.peak_bytes/GB, fmt_time(e.factor_s).c_str(), fmt_time(e.variance_s).c_str(), fmt_time(e.total_s).c_str(),
+			budget_bytes>0 && e.peak_bytes>budget_bytes ? "  (over budget)" : "");
+	}
+	if (budget_bytes>0) printf("[P] Memory budget: %.2f GB\n", budget_bytes/GB);
+}
+
+uint64_t CResourcePlanner::PhysicalMemory()
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX ms;
+	ms.dwLength = sizeof(ms);
+	return GlobalMemoryStatusEx(&ms) ? uint64_t(ms.ullTotalPhys) : 0;
+#else
+	const long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGE_SIZE);
+	return pages>0 && page_size>0 ? uint64_t(pages)*uint64_t(page_size) : 0;
+#endif
+}
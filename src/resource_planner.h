@@ -0,0 +1,116 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/math/CMatrix.h>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include "active_mask.h"
+#include "xyz_loader.h"
+
+/** What the planner knows about a job once its points are loaded and the
+  * grid geometry is fixed (stages [1]-[3]), before any grid is allocated */
+struct TPlanInput
+{
+	TPlanInput() : num_obs(0), mask_dist(0), aoi_area(0), skip_variance(false), baseline_bytes(0), blocks_x(0), blocks_y(0), sample_ratio(1) {}
+	TGridGeometry geom;
+	size_t num_obs;         //!< Points to be inserted in the DEM
+	double mask_dist;       //!< --mask-dist (<=0: none)
+	double aoi_area;        //!< Area of the AOI polygon [m^2] (0: no AOI)
+	bool   skip_variance;
+	uint64_t baseline_bytes; //!< Memory already in use (points, checkpoints...)
+
+	/** Non-zero for each 8x8 cell block (row-major, `blocks_x` per row) with
+	  * data, from a sample of the points. See sampleOccupancy(). */
+	std::vector<uint8_t> block_has_data;
+	size_t blocks_x, blocks_y;
+	double sample_ratio;    //!< Fraction of the points that were sampled
+
+	static const size_t BLOCK = 8;
+	/** Flags the blocks of `geom` with data, from at most `max_samples` of the XY points */
+	void sampleOccupancy(const TPointsView &xyz, size_t max_samples = 2000000);
+};
+
+/** A way of running stages [4]-[6], as selected by --solver and --grid-storage */
+struct TPlanStrategy
+{
+	TPlanStrategy() {}
+	TPlanStrategy(const std::string &solver_, const std::string &storage_) : solver(solver_), storage(storage_) {}
+	std::string solver;   //!< mrpt, native, mixed
+	std::string storage;  //!< dense, soa, compact, sparse
+	std::string name() const { return solver+"/"+storage; }
+};
+
+struct TPlanEstimate
+{
+	TPlanEstimate() : unknowns(0), nnz_Q(0), nnz_L(0), grid_bytes(0), peak_bytes(0), factor_s(0), variance_s(0), total_s(0), feasible(true) {}
+	TPlanStrategy strategy;
+	double unknowns;          //!< Cells in the linear system
+	double nnz_Q, nnz_L;      //!< Nonzeros of the precision matrix (lower triangle) and of its factor
+	double grid_bytes;        //!< DEM grid storage
+	double peak_bytes;        //!< Whole process, including TPlanInput::baseline_bytes
+	double factor_s, variance_s, total_s; //!< Predicted wall times of stage [6] [s]
+	bool   feasible;          //!< False if not applicable with the given options (e.g. mrpt with a mask)
+};
+
+/** Predicts the unknowns, precision matrix and factor sizes, variance cost,
+  * peak memory and runtime of each solver/storage strategy for a job, before
+  * allocating anything, so that jobs that would exhaust the memory of the node
+  * can be rejected (or switched to a leaner strategy) up front.
+  *
+  * Factor fill is modeled as n*(c0*log2(n)+c1*log2(n)^2), which matches the
+  * growth of the AMD ordering of 2D grid graphs, and run times as power laws
+  * of n. All constants are calibrated on this machine with small native and
+  * MRPT solves (see calibrate()), so estimates are extrapolations: expect
+  * errors of tens of percent, not orders of magnitude.
+  */
+class CResourcePlanner
+{
+public:
+	CResourcePlanner();
+
+	/** Measures the fill and time constants with small native and MRPT solves (~1 s).
+	  * Without calibration, constants measured on a 2016 desktop CPU are used. */
+	void calibrate();
+
+	/** Unknowns of the native solver: all cells, or those of the mask/AOI/sparse blocks */
+	double estimateUnknowns(const TPlanInput &in, const std::string &storage) const;
+
+	TPlanEstimate estimate(const TPlanInput &in, const TPlanStrategy &s) const;
+
+	/** All strategies that produce the same outputs as `requested` (i.e. not
+	  * switching to or from sparse storage), with `requested` first */
+	static std::vector<TPlanStrategy> alternatives(const TPlanStrategy &requested, bool masked);
+
+	/** Prints a table of `estimates` (and the budget, if >0) to the console */
+	static void printTable(const TPlanInput &in, const std::vector<TPlanEstimate> &estimates, double budget_bytes);
+
+	/** Physical memory of the machine [bytes] (0 if unknown), for default budgets */
+	static uint64_t PhysicalMemory();
+
+private:
+	/** t = t1*(n/n1)^beta */
+	struct TPowerLaw
+	{
+		TPowerLaw(double t1_=0, double n1_=1, double beta_=1.5) : t1(t1_), n1(n1_), beta(beta_) {}
+		double t1, n1, beta;
+		double at(double n) const;
+		/** Fits from two measurements, with beta clamped to [beta_min,beta_max] */
+		static TPowerLaw Fit(double n1, double t1, double n2, double t2, double beta_min, double beta_max);
+	};
+
+	double m_fill_c0, m_fill_c1;
+	TPowerLaw m_factor, m_variance;      //!< Native, double precision
+	TPowerLaw m_factor_f32;              //!< Mixed: float32 factor + refinement
+	TPowerLaw m_mrpt_solve, m_mrpt_variance;
+
+	double factorNonZeros(double n) const;
+};
@@ -0,0 +1,83 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <limits>
+#include "aligned_buffer.h"
+#include "active_mask.h"
+#include "dem_predict.h"
+
+/** Dense DEM grid in a structure-of-arrays layout: one contiguous, 64-byte
+  * aligned plane for the means and another one for the std, row-major
+  * (cx + cy*size_x). Sweeps over the mean (writers, predictions, statistics)
+  * only touch the bytes they need, and the planes are exposed as spans for
+  * vectorized kernels. Means are stored relative to `z_origin`, so that float32
+  * planes keep mm precision. Cells never set hold NaN (no-data).
+  */
+template <typename T>
+class CSoADemGrid
+{
+public:
+	typedef T value_type;
+
+	CSoADemGrid() : m_z_origin(0) {}
+
+	void setSize(const TGridGeometry &g, double z_origin = 0)
+	{
+		m_geom = g;
+		m_z_origin = z_origin;
+		m_mean.assign(g.size_x*g.size_y, std::numeric_limits<T>::quiet_NaN());
+		m_std.assign(g.size_x*g.size_y, std::numeric_limits<T>::quiet_NaN());
+	}
+
+	const TGridGeometry &getGeometry() const { return m_geom; }
+	double getZOrigin() const { return m_z_origin; }
+
+	/** Sets the cell with linear index `c` (cx+cy*size_x) */
+	inline void setCell(size_t c, double mean, double std)
+	{
+		m_mean[c] = static_cast<T>(mean-m_z_origin);
+		m_std[c]  = static_cast<T>(std);
+	}
+	inline void setCellMean(size_t c, double mean) { m_mean[c] = static_cast<T>(mean-m_z_origin); }
+	inline void setCellStd(size_t c, double std) { m_std[c] = static_cast<T>(std); }
+	inline double getCellMean(size_t c) const { return m_z_origin + m_mean[c]; }
+	inline double getCellStd(size_t c) const { return m_std[c]; }
+
+	/** The whole planes. Means are relative to getZOrigin() */
+	TSpan<T> meanPlane() { return TSpan<T>(m_mean); }
+	TSpan<T> stdPlane() { return TSpan<T>(m_std); }
+	TSpan<const T> meanPlane() const { return TSpan<const T>(m_mean); }
+	TSpan<const T> stdPlane() const { return TSpan<const T>(m_std); }
+
+	/** Row `cy` of each plane */
+	TSpan<const T> meanRow(size_t cy) const { return meanPlane().subspan(cy*m_geom.size_x, m_geom.size_x); }
+	TSpan<const T> stdRow(size_t cy) const { return stdPlane().subspan(cy*m_geom.size_x, m_geom.size_x); }
+
+	TDemGridView getView() const
+	{
+		TDemGridView v;
+		v.x_min = m_geom.x_min; v.y_min = m_geom.y_min; v.resolution = m_geom.resolution;
+		v.size_x = m_geom.size_x; v.size_y = m_geom.size_y;
+		v.mean = reinterpret_cast<const char*>(m_mean.empty() ? NULL : &m_mean[0]);
+		v.std  = reinterpret_cast<const char*>(m_std.empty() ? NULL : &m_std[0]);
+		v.stride = sizeof(T);
+		v.is_float32 = sizeof(T)==sizeof(float);
+		v.z_origin = m_z_origin;
+		return v;
+	}
+
+private:
+	TGridGeometry m_geom;
+	double m_z_origin;
+	aligned_vector<T> m_mean, m_std;
+};
+
+/** Compact SoA grid: float32 planes, 8 bytes/cell against the 40 of a TRandomFieldCell */
+typedef CSoADemGrid<float> CCompactDemGrid;
@@ -0,0 +1,140 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cstddef>
+#include <algorithm>
+
+/** A 2D grid with the same cell-access API as mrpt::maps::CDynamicGridMap2D
+  * (setSize(), x2idx(), cellByIndex(), cellByPos()...), but whose cells are only
+  * allocated in fixed-size blocks of BLOCK x BLOCK cells, kept in a hash map.
+  * Cells of blocks that were never materialized with insertBlock() do not
+  * exist (cellByIndex() returns NULL), so long diagonal strips (roads,
+  * rivers...) take memory in proportion to their area, not to their bbox.
+  */
+template <class T, unsigned BLOCK_BITS = 6>
+class CSparseBlockGrid
+{
+public:
+	static const size_t BLOCK = size_t(1)<<BLOCK_BITS; //!< Block side length, in cells
+
+	CSparseBlockGrid() : m_x_min(0), m_x_max(0), m_y_min(0), m_y_max(0), m_resolution(1), m_size_x(0), m_size_y(0) {}
+
+	/** Sets the grid limits and removes all blocks. Limits are rounded to
+	  * multiples of the resolution, as CDynamicGridMap2D does. */
+	void setSize(double x_min, double x_max, double y_min, double y_max, double resolution)
+	{
+		m_resolution = resolution;
+		m_x_min = resolution*std::floor(x_min/resolution+0.5);
+		m_y_min = resolution*std::floor(y_min/resolution+0.5);
+		m_x_max = resolution*std::floor(x_max/resolution+0.5);
+		m_y_max = resolution*std::floor(y_max/resolution+0.5);
+		m_size_x = static_cast<size_t>(std::floor((m_x_max-m_x_min)/resolution+0.5));
+		m_size_y = static_cast<size_t>(std::floor((m_y_max-m_y_min)/resolution+0.5));
+		m_blocks.clear();
+	}
+
+	inline size_t getSizeX() const { return m_size_x; }
+	inline size_t getSizeY() const { return m_size_y; }
+	inline double getXMin() const { return m_x_min; }
+	inline double getXMax() const { return m_x_max; }
+	inline double getYMin() const { return m_y_min; }
+	inline double getYMax() const { return m_y_max; }
+	inline double getResolution() const { return m_resolution; }
+
+	inline int x2idx(double x) const { return static_cast<int>( (x-m_x_min)/m_resolution ); }
+	inline int y2idx(double y) const { return static_cast<int>( (y-m_y_min)/m_resolution ); }
+	inline double idx2x(size_t cx) const { return m_x_min+(cx+0.5)*m_resolution; }
+	inline double idx2y(size_t cy) const { return m_y_min+(cy+0.5)*m_resolution; }
+
+	inline size_t getBlocksX() const { return (m_size_x+BLOCK-1)>>BLOCK_BITS; }
+	inline size_t getBlocksY() const { return (m_size_y+BLOCK-1)>>BLOCK_BITS; }
+	inline size_t getBlockCount() const { return m_blocks.size(); }
+
+	/** Allocates block (bx,by), if it does not exist yet, filling it with `def` */
+	void insertBlock(size_t bx, size_t by, const T &def)
+	{
+		if (bx>=getBlocksX() || by>=getBlocksY()) return;
+		std::vector<T> &b = m_blocks[blockKey(bx,by)];
+		if (b.empty()) b.assign(BLOCK*BLOCK, def);
+	}
+	bool hasBlock(size_t bx, size_t by) const { return m_blocks.count(blockKey(bx,by))!=0; }
+
+	inline T *cellByIndex(size_t cx, size_t cy)
+	{
+		if (cx>=m_size_x || cy>=m_size_y) return NULL;
+		typename TBlocks::iterator it = m_blocks.find(blockKey(cx>>BLOCK_BITS,cy>>BLOCK_BITS));
+		return it==m_blocks.end() ? NULL : &it->second[inBlockIndex(cx,cy)];
+	}
+	inline const T *cellByIndex(size_t cx, size_t cy) const
+	{
+		if (cx>=m_size_x || cy>=m_size_y) return NULL;
+		typename TBlocks::const_iterator it = m_blocks.find(blockKey(cx>>BLOCK_BITS,cy>>BLOCK_BITS));
+		return it==m_blocks.end() ? NULL : &it->second[inBlockIndex(cx,cy)];
+	}
+	inline T *cellByPos(double x, double y)
+	{
+		const int cx = x2idx(x), cy = y2idx(y);
+		return (cx<0 || cy<0) ? NULL : cellByIndex(cx,cy);
+	}
+	inline const T *cellByPos(double x, double y) const
+	{
+		const int cx = x2idx(x), cy = y2idx(y);
+		return (cx<0 || cy<0) ? NULL : cellByIndex(cx,cy);
+	}
+
+	/** Calls `f(bx,by,cells)` for each materialized block. `cells` holds
+	  * BLOCK*BLOCK cells, row-major; those beyond the grid limits are padding. */
+	template <class FUNC> void forEachBlock(FUNC f)
+	{
+		for (typename TBlocks::iterator it=m_blocks.begin();it!=m_blocks.end();++it)
+			f(size_t(it->first % getBlocksX()), size_t(it->first / getBlocksX()), &it->second[0]);
+	}
+	template <class FUNC> void forEachBlock(FUNC f) const
+	{
+		for (typename TBlocks::const_iterator it=m_blocks.begin();it!=m_blocks.end();++it)
+			f(size_t(it->first % getBlocksX()), size_t(it->first / getBlocksX()), &it->second[0]);
+	}
+
+	/** Linear indices (cx+cy*size_x) of all the cells inside the grid limits
+	  * in materialized blocks, in ascending order. */
+	void getCellList(std::vector<size_t> &cells) const
+	{
+		cells.clear();
+		cells.reserve(m_blocks.size()*BLOCK*BLOCK);
+		forEachBlock([&](size_t bx, size_t by, const T*) {
+			for (size_t j=0;j<BLOCK;j++)
+			{
+				const size_t cy = (by<<BLOCK_BITS)+j;
+				if (cy>=m_size_y) break;
+				for (size_t i=0;i<BLOCK;i++)
+				{
+					const size_t cx = (bx<<BLOCK_BITS)+i;
+					if (cx>=m_size_x) break;
+					cells.push_back(cx+cy*m_size_x);
+				}
+			}
+		});
+		std::sort(cells.begin(),cells.end());
+	}
+
+private:
+	typedef std::unordered_map<uint64_t, std::vector<T> > TBlocks;
+
+	double m_x_min, m_x_max, m_y_min, m_y_max, m_resolution;
+	size_t m_size_x, m_size_y;
+	TBlocks m_blocks;
+
+	inline uint64_t blockKey(size_t bx, size_t by) const { return uint64_t(bx) + uint64_t(by)*getBlocksX(); }
+	static inline size_t inBlockIndex(size_t cx, size_t cy) { return (cx & (BLOCK-1)) + ((cy & (BLOCK-1))<<BLOCK_BITS); }
+};
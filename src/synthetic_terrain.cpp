@@ -0,0 +1,141 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "synthetic_terrain.h"
+#include "parallel_for.h"
+#include <random>
+#include <cmath>
+
+TSurveyFootprint footprint_from_string(const std::string &s)
+{
+	if (s=="rect") return footprintRect;
+	if (s=="disc") return footprintDisc;
+	if (s=="corridor") return footprintCorridor;
+	THROW_EXCEPTION(std::string("Unknown footprint: ")+s);
+}
+
+// Area of the footprint, as a fraction of the square:
+static double footprint_area_fraction(TSurveyFootprint f)
+{
+	switch (f)
+	{
+	case footprintDisc: return M_PI/4;
+	case footprintCorridor: return 1.0-0.9*0.9;
+	default: return 1.0;
+	};
+}
+
+// Integer hash (lowbias32) -> uniform value in [-1,1]
+static inline double hash_to_unit(uint32_t x)
+{
+	x ^= x >> 16; x *= 0x7feb352dU;
+	x ^= x >> 15; x *= 0x846ca68bU;
+	x ^= x >> 16;
+	return x*(2.0/4294967295.0)-1.0;
+}
+
+CSyntheticTerrain::CSyntheticTerrain(const TSyntheticTerrainOptions &opts) : m_opts(opts)
+{
+	ASSERT_(opts.density>0 && opts.hurst>0 && opts.gap_fraction>=0 && opts.gap_fraction<1);
+	// Size the square so that the surveyed area (footprint minus gaps) holds
+	// `num_points` at the requested density:
+	const double surveyed = footprint_area_fraction(opts.footprint)*(1.0-opts.gap_fraction);
+	m_side = std::sqrt(opts.num_points/(opts.density*surveyed));
+
+	// Gaps: 20 equal circles, placed at random within the footprint
+	// (overlaps make the actual gap area slightly smaller):
+	if (opts.gap_fraction>0)
+	{
+		const size_t nGaps = 20;
+		const double footprint_area = footprint_area_fraction(opts.footprint)*m_side*m_side;
+		const double r2 = opts.gap_fraction*footprint_area/(nGaps*M_PI);
+		std::mt19937 rng(opts.seed ^ 0x9e3779b9U);
+		std::uniform_real_distribution<double> u(0,m_side);
+		while (m_gap_x.size()<nGaps)
+		{
+			const double x=u(rng), y=u(rng);
+			if (!isSurveyed(x,y)) continue;
+			m_gap_x.push_back(x); m_gap_y.push_back(y); m_gap_r2.push_back(r2);
+		}
+	}
+}
+
+double CSyntheticTerrain::valueNoise(double x, double y, uint32_t octave) const
+{
+	const double fx = std::floor(x), fy = std::floor(y);
+	const int32_t ix = int32_t(fx), iy = int32_t(fy);
+	double tx = x-fx, ty = y-fy;
+	tx = tx*tx*(3-2*tx); // Smoothstep
+	ty = ty*ty*(3-2*ty);
+	const uint32_t base = m_opts.seed*0x27d4eb2dU + octave*0x165667b1U;
+	const double v00 = hash_to_unit(base + uint32_t(ix)*0x9e3779b1U + uint32_t(iy)*0x85ebca77U);
+	const double v10 = hash_to_unit(base + uint32_t(ix+1)*0x9e3779b1U + uint32_t(iy)*0x85ebca77U);
+	const double v01 = hash_to_unit(base + uint32_t(ix)*0x9e3779b1U + uint32_t(iy+1)*0x85ebca77U);
+	const double v11 = hash_to_unit(base + uint32_t(ix+1)*0x9e3779b1U + uint32_t(iy+1)*0x85ebca77U);
+	return (v00*(1-tx)+v10*tx)*(1-ty) + (v01*(1-tx)+v11*tx)*ty;
+}
+
+double CSyntheticTerrain::height(double x, double y) const
+{
+	const double gain = std::pow(2.0,-m_opts.hurst);
+	double freq = 1.0/m_opts.wavelength, amp = 0.5*m_opts.amplitude, z = 0;
+	for (unsigned k=0;k<m_opts.octaves;k++)
+	{
+		z += amp*valueNoise(x*freq, y*freq, k);
+		freq *= 2; amp *= gain;
+	}
+	return z;
+}
+
+bool CSyntheticTerrain::isSurveyed(double x, double y) const
+{
+	const double h = 0.5*m_side;
+	switch (m_opts.footprint)
+	{
+	case footprintDisc:
+		if ((x-h)*(x-h)+(y-h)*(y-h) > h*h) return false;
+		break;
+	case footprintCorridor:
+		if (std::abs(x-y) > 0.1*m_side) return false;
+		break;
+	default:
+		break;
+	};
+	for (size_t i=0;i<m_gap_x.size();i++)
+	{
+		const double dx=x-m_gap_x[i], dy=y-m_gap_y[i];
+		if (dx*dx+dy*dy<m_gap_r2[i]) return false;
+	}
+	return true;
+}
+
+void CSyntheticTerrain::generatePoints(mrpt::math::CMatrix &xyz) const
+{
+	const size_t N = m_opts.num_points;
+	xyz.setSize(N,3);
+	// Fixed-size blocks, each with its own RNG stream:
+	const size_t BLOCK = 1<<16;
+	const size_t nBlocks = (N+BLOCK-1)/BLOCK;
+	parallel_for(nBlocks, [&](size_t b0, size_t b1)
+	{
+		for (size_t b=b0;b<b1;b++)
+		{
+			std::mt19937 rng(m_opts.seed + 0x632be5abU*uint32_t(b+1));
+			std::uniform_real_distribution<double> u(0,m_side);
+			std::normal_distribution<double> noise(0, m_opts.noise_std>0 ? m_opts.noise_std : 1.0);
+			for (size_t i=b*BLOCK;i<std::min(N,(b+1)*BLOCK);i++)
+			{
+				double x,y;
+				do { x=u(rng); y=u(rng); } while (!isSurveyed(x,y));
+				xyz(i,0) = x;
+				xyz(i,1) = y;
+				xyz(i,2) = height(x,y) + (m_opts.noise_std>0 ? noise(rng) : 0.0);
+			}
+		}
+	}, 1);
+}
@@ -0,0 +1,76 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/math/CMatrix.h>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/** Footprint of a synthetic survey within its square bbox */
+enum TSurveyFootprint
+{
+	footprintRect = 0,  //!< The whole square
+	footprintDisc,      //!< Inscribed disc
+	footprintCorridor   //!< Strip along the diagonal, |x-y|<10% of the side (roads, rivers...)
+};
+
+TSurveyFootprint footprint_from_string(const std::string &s);
+
+struct TSyntheticTerrainOptions
+{
+	TSyntheticTerrainOptions() :
+		num_points(1000000), density(2.0), amplitude(50.0), wavelength(500.0),
+		hurst(0.8), octaves(10), noise_std(0.05), gap_fraction(0.0),
+		footprint(footprintRect), seed(1234)
+	{}
+
+	size_t   num_points;
+	double   density;       //!< Points per m^2: sets the side of the surveyed square
+	double   amplitude;     //!< Height range of the largest octave [m]
+	double   wavelength;    //!< Wavelength of the largest octave [m]
+	double   hurst;         //!< Hurst exponent in (0,1]: lower = rougher
+	unsigned octaves;
+	double   noise_std;     //!< Gaussian noise added to the Z of each point [m]
+	double   gap_fraction;  //!< Fraction of the footprint covered by circular data gaps
+	TSurveyFootprint footprint;
+	uint32_t seed;
+};
+
+/** Procedural fractal terrain (fractional Brownian motion: a sum of octaves of
+  * smooth value noise, octave k with 2^k times the frequency and 2^(-k*H) times
+  * the amplitude of the first one), which can be evaluated at any (x,y) without
+  * storing any grid, so it doubles as the exact ground truth of the DEM.
+  */
+class CSyntheticTerrain
+{
+public:
+	explicit CSyntheticTerrain(const TSyntheticTerrainOptions &opts);
+
+	const TSyntheticTerrainOptions &getOptions() const { return m_opts; }
+	/** Side of the surveyed square [m], from num_points/density */
+	double getSide() const { return m_side; }
+
+	/** Noise-free terrain height at (x,y) */
+	double height(double x, double y) const;
+
+	/** Whether (x,y) lies inside the footprint and outside all gaps */
+	bool isSurveyed(double x, double y) const;
+
+	/** Samples num_points surveyed points (X Y Z, with noise) into `xyz`, in parallel.
+	  * The result only depends on the options, not on the number of threads. */
+	void generatePoints(mrpt::math::CMatrix &xyz) const;
+
+private:
+	TSyntheticTerrainOptions m_opts;
+	double m_side;
+	std::vector<double> m_gap_x, m_gap_y, m_gap_r2;
+
+	double valueNoise(double x, double y, uint32_t octave) const;
+};
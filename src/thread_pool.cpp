@@ -0,0 +1,246 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "thread_pool.h"
+#include <algorithm>
+#include <chrono>
+#if defined(__linux__)
+#	include <pthread.h>
+#	include <sched.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#endif
+
+// Index of the worker running in this thread (-1: not a pool worker)
+static thread_local int tl_worker_idx = -1;
+
+// Binds the calling thread to the k-th CPU (modulo) of `cpus`
+static void pin_current_thread(const std::vector<int> &cpus, size_t k)
+{
+#if defined(__linux__)
+	if (cpus.empty()) return;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpus[k % cpus.size()], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)cpus; (void)k;
+#endif
+}
+
+static int current_tid()
+{
+#if defined(__linux__)
+	return int(syscall(SYS_gettid));
+#else
+	return 0;
+#endif
+}
+
+// CPUs the process may run on, in increasing order
+static std::vector<int> allowed_cpus()
+{
+	std::vector<int> cpus;
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set)==0)
+		for (int c=0;c<CPU_SETSIZE;c++)
+			if (CPU_ISSET(c,&set)) cpus.push_back(c);
+#endif
+	return cpus;
+}
+
+CThreadPool &CThreadPool::Instance()
+{
+	static CThreadPool pool;
+	return pool;
+}
+
+CThreadPool::CThreadPool() : m_pending(0), m_next_queue(0), m_stop(false), m_pinned(false)
+{
+	setup(0, false);
+}
+
+CThreadPool::~CThreadPool()
+{
+	stop();
+}
+
+void CThreadPool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lk(m_wake_mtx);
+		m_stop = true;
+	}
+	m_wake_cv.notify_all();
+	for (size_t i=0;i<m_workers.size();i++) m_workers[i].join();
+	m_workers.clear();
+	m_queues.clear();
+}
+
+void CThreadPool::setup(size_t num_threads, bool pin_threads)
+{
+	stop();
+	if (!num_threads) num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	m_stop = false;
+	m_pending = 0;
+	m_pinned = pin_threads;
+	std::vector<int> cpus;
+	if (pin_threads) {
+		cpus = allowed_cpus();
+		pin_current_thread(cpus, 0);
+	}
+	for (size_t i=1;i<num_threads;i++)
+		m_queues.push_back(std::unique_ptr<TQueue>(new TQueue));
+	m_tids.assign(num_threads, 0);
+	m_tids[0] = current_tid();
+	size_t registered = 1;
+	for (size_t i=1;i<num_threads;i++)
+		m_workers.push_back(std::thread([this,i,cpus,&registered]()
+		{
+			if (!cpus.empty()) pin_current_thread(cpus, i);
+			{
+				std::lock_guard<std::mutex> lk(m_tids_mtx);
+				m_tids[i] = current_tid();
+				registered++;
+			}
+			m_tids_cv.notify_all();
+			workerLoop(i-1);
+		}));
+	// Wait for all workers to report their ids:
+	std::unique_lock<std::mutex> lk(m_tids_mtx);
+	m_tids_cv.wait(lk, [&]() { return registered==num_threads; });
+}
+
+std::vector<int> CThreadPool::getThreadIds() const
+{
+	std::vector<int> r;
+#if defined(__linux__)
+	r = m_tids;
+#endif
+	return r;
+}
+
+void CThreadPool::submit(const std::function<void()> &task)
+{
+	if (m_queues.empty()) {
+		task();
+		return;
+	}
+	// Workers push to their own deque; other threads spread tasks round-robin:
+	// Counted before it is pushed, so that popTask() never decrements first:
+	const size_t q = tl_worker_idx>=0 ? size_t(tl_worker_idx) : (m_next_queue++ % m_queues.size());
+	{
+		std::lock_guard<std::mutex> lk(m_wake_mtx);
+		m_pending++;
+	}
+	{
+		std::lock_guard<std::mutex> lk(m_queues[q]->mtx);
+		m_queues[q]->tasks.push_back(task);
+	}
+	m_wake_cv.notify_one();
+}
+
+bool CThreadPool::popTask(int self, std::function<void()> &task)
+{
+	const size_t nQ = m_queues.size();
+	if (!nQ) return false;
+	if (self>=0)
+	{
+		TQueue &q = *m_queues[self];
+		std::lock_guard<std::mutex> lk(q.mtx);
+		if (!q.tasks.empty()) {
+			task.swap(q.tasks.back());
+			q.tasks.pop_back();
+			m_pending--;
+			return true;
+		}
+	}
+	// Steal from the others, oldest tasks first:
+	const size_t start = self>=0 ? size_t(self)+1 : 0;
+	for (size_t k=0;k<nQ;k++)
+	{
+		TQueue &q = *m_queues[(start+k) % nQ];
+		std::lock_guard<std::mutex> lk(q.mtx);
+		if (!q.tasks.empty()) {
+			task.swap(q.tasks.front());
+			q.tasks.pop_front();
+			m_pending--;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CThreadPool::runPendingTask()
+{
+	std::function<void()> task;
+	if (!popTask(tl_worker_idx, task)) return false;
+	task();
+	return true;
+}
+
+void CThreadPool::workerLoop(size_t idx)
+{
+	tl_worker_idx = int(idx);
+	std::function<void()> task;
+	for (;;)
+	{
+		if (popTask(int(idx), task)) {
+			task();
+			task = std::function<void()>();
+			continue;
+		}
+		std::unique_lock<std::mutex> lk(m_wake_mtx);
+		m_wake_cv.wait(lk, [this]() { return m_stop || m_pending>0; });
+		if (m_stop) return;
+	}
+}
+
+void CTaskGroup::run(const std::function<void()> &task)
+{
+	m_pending++;
+	CThreadPool::Instance().submit([this,task]()
+	{
+		try { task(); }
+		catch (...) {
+			std::lock_guard<std::mutex> lk(m_err_mtx);
+			if (!m_error) m_error = std::current_exception();
+		}
+		std::lock_guard<std::mutex> lk(m_done_mtx);
+		if (--m_pending==0) m_done_cv.notify_all();
+	});
+}
+
+void CTaskGroup::wait()
+{
+	// Help with pool tasks while there are any, then sleep: the tasks still
+	// pending are running on other threads (e.g. a factorization, a writer).
+	// Sleeps are bounded, to help again with tasks those may have spawned.
+	CThreadPool &pool = CThreadPool::Instance();
+	while (m_pending>0 && pool.runPendingTask()) {}
+	{
+		// Also taken when nothing was pending, so that the last task has
+		// released the mutex before the group may be destroyed:
+		std::unique_lock<std::mutex> lk(m_done_mtx);
+		while (!m_done_cv.wait_for(lk, std::chrono::milliseconds(10), [this]() { return m_pending==0; }))
+		{
+			lk.unlock();
+			while (m_pending>0 && pool.runPendingTask()) {}
+			lk.lock();
+		}
+	}
+	std::exception_ptr err;
+	{
+		std::lock_guard<std::mutex> lk(m_err_mtx);
+		std::swap(err, m_error);
+	}
+	if (err) std::rethrow_exception(err);
+}
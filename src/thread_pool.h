@@ -0,0 +1,105 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <cstddef>
+
+/** Process-wide work-stealing thread pool shared by all pipeline stages.
+  * Each worker owns a task deque: it pops its own tasks LIFO (cache-warm) and,
+  * when empty, steals FIFO from the others. Threads waiting for a CTaskGroup
+  * run pending tasks meanwhile, so tasks may submit and wait for sub-tasks
+  * without deadlocks.
+  *
+  * The concurrency (see setup()) counts the calling thread: a pool of N
+  * threads starts N-1 workers. With pinning, thread k is bound to the k-th CPU
+  * of the process affinity mask, so jobs started under `taskset` with
+  * disjoint CPU sets never share cores.
+  */
+class CThreadPool
+{
+public:
+	/** The pool; started with one thread per hardware thread on first use */
+	static CThreadPool &Instance();
+
+	/** (Re)starts the pool with `num_threads` threads (0: hardware concurrency).
+	  * Must not be called while tasks are running. */
+	void setup(size_t num_threads, bool pin_threads);
+
+	/** Number of threads working on tasks, including the caller of CTaskGroup::wait() */
+	size_t getConcurrency() const { return m_workers.size()+1; }
+	bool isPinned() const { return m_pinned; }
+
+	/** OS thread ids (Linux TIDs; empty elsewhere) of the thread that called
+	  * setup() and of each worker, e.g. to attach per-thread profilers */
+	std::vector<int> getThreadIds() const;
+
+	/** Queues a task. Without workers, it is run inline. */
+	void submit(const std::function<void()> &task);
+
+	/** Runs one pending task, if any, in the calling thread */
+	bool runPendingTask();
+
+	~CThreadPool();
+
+private:
+	CThreadPool();
+	CThreadPool(const CThreadPool &);
+	CThreadPool &operator=(const CThreadPool &);
+
+	struct TQueue
+	{
+		std::mutex mtx;
+		std::deque<std::function<void()> > tasks;
+	};
+
+	void stop();
+	void workerLoop(size_t idx);
+	bool popTask(int self, std::function<void()> &task);
+
+	std::vector<std::thread> m_workers;
+	std::vector<std::unique_ptr<TQueue> > m_queues;
+	std::mutex m_wake_mtx;
+	std::condition_variable m_wake_cv;
+	std::vector<int> m_tids;
+	std::mutex m_tids_mtx;
+	std::condition_variable m_tids_cv;
+	std::atomic<size_t> m_pending, m_next_queue;
+	bool m_stop, m_pinned;
+};
+
+/** A set of tasks submitted to the CThreadPool that can be waited for.
+  * The first exception thrown by a task is rethrown by wait(). */
+class CTaskGroup
+{
+public:
+	CTaskGroup() : m_pending(0) {}
+	~CTaskGroup() { try { wait(); } catch (...) {} }
+
+	void run(const std::function<void()> &task);
+
+	/** Blocks until all tasks have finished, running pending pool tasks
+	  * meanwhile; once none is left to run, sleeps until the last one ends */
+	void wait();
+
+private:
+	std::atomic<size_t> m_pending;
+	std::mutex m_done_mtx;
+	std::condition_variable m_done_cv; //!< Signalled when m_pending reaches 0
+	std::mutex m_err_mtx;
+	std::exception_ptr m_error;
+};
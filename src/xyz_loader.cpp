@@ -0,0 +1,200 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#include "xyz_loader.h"
+#include "parallel_for.h"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <memory>
+
+using namespace std;
+
+TPointsBBox compute_bbox(const TPointsView &xyz, TPointsXYMoments *moments)
+{
+	const size_t N = xyz.rows();
+	std::vector<TPointsBBox> partial(CThreadPool::Instance().getConcurrency());
+	std::vector<TPointsXYMoments> partial_mom(moments ? partial.size() : 0);
+	const size_t nParts = partial.size();
+	parallel_for(nParts, [&](size_t p0, size_t p1)
+	{
+		for (size_t p=p0;p<p1;p++)
+		{
+			TPointsBBox bb;
+			for (size_t i=N*p/nParts;i<N*(p+1)/nParts;i++)
+				bb.update(xyz(i,0),xyz(i,1),xyz(i,2));
+			partial[p] = bb;
+			if (moments)
+				for (size_t i=N*p/nParts;i<N*(p+1)/nParts;i++)
+					partial_mom[p].update(xyz(i,0),xyz(i,1));
+		}
+	}, 1);
+	TPointsBBox bbox;
+	for (size_t p=0;p<nParts;p++) bbox.merge(partial[p]);
+	if (moments) {
+		*moments = TPointsXYMoments();
+		for (size_t p=0;p<nParts;p++) moments->merge(partial_mom[p]);
+	}
+	return bbox;
+}
+
+namespace
+{
+	// Result of parsing one chunk of the file:
+	struct TParsedChunk
+	{
+		TParsedChunk() : nRows(0), nCols(0), bad_line(0) {}
+		std::vector<float> values; //!< Row-major
+		size_t nRows, nCols;
+		size_t bad_line;           //!< 1-based line (within the chunk) with a column count mismatch, or 0
+		TPointsBBox bbox;
+		TPointsXYMoments moments;
+	};
+
+	inline bool is_sep(char c) { return c==' ' || c=='\t' || c==',' || c=='\r'; }
+
+	void parse_chunk(const char *p, const char *end, TParsedChunk &out, bool with_moments)
+	{
+		std::vector<double> row; // Grows to the widest line
+		size_t line = 0;
+		while (p<end)
+		{
+			line++;
+			const char *eol = static_cast<const char*>(memchr(p,'\n',end-p));
+			if (!eol) eol = end;
+
+			while (p<eol && is_sep(*p)) p++;
+			if (p<eol && *p!='%' && *p!='#')
+			{
+				size_t nc = 0;
+				while (p<eol)
+				{
+					char *next;
+					const double v = strtod(p,&next);
+					if (next==p) break; // Not a number: ignore rest of line
+					if (nc<row.size()) row[nc]=v;
+					else row.push_back(v);
+					nc++;
+					p=next;
+					while (p<eol && is_sep(*p)) p++;
+				}
+				if (nc)
+				{
+					if (!out.nCols) out.nCols=nc;
+					if (nc!=out.nCols) {
+						if (!out.bad_line) out.bad_line=line;
+					}
+					else
+					{
+						for (size_t c=0;c<nc;c++) out.values.push_back(static_cast<float>(row[c]));
+						if (nc>=3) out.bbox.update(row[0],row[1],row[2]);
+						if (with_moments && nc>=2) out.moments.update(row[0],row[1]);
+						out.nRows++;
+					}
+				}
+			}
+			p = eol+1;
+		}
+	}
+}
+
+void load_xyz_file(const std::string &file, mrpt::math::CMatrix &xyz, TPointsBBox &bbox, TPointsXYMoments *moments)
+{
+	// The file is read in newline-aligned blocks, each parsed (with its bbox
+	// accumulation) by a pool task of its own: reading block k+1 overlaps
+	// parsing of block k, and at most a few blocks of raw text are in memory
+	// at any time. Tasks never block, so that other jobs sharing the pool
+	// can run them while waiting for their own.
+	const size_t BLOCK_SIZE = 4<<20;
+
+	FILE *f = fopen(file.c_str(),"rb");
+	if (!f) THROW_EXCEPTION(std::string("Cannot open input file: ")+file);
+
+	std::vector<std::unique_ptr<TParsedChunk> > chunks;
+	std::vector<std::unique_ptr<std::vector<char> > > texts; // Raw text of each chunk, until parsed
+	const size_t max_in_flight = 2*CThreadPool::Instance().getConcurrency();
+	std::atomic<size_t> in_flight(0);
+	CTaskGroup parsers; // Declared last: its destructor waits for the tasks
+
+	bool read_error = false;
+	std::vector<char> carry; // Partial last line of the previous block
+	for (bool eof=false; !eof; )
+	{
+		std::unique_ptr<std::vector<char> > text(new std::vector<char>);
+		text->swap(carry);
+		const size_t off = text->size();
+		text->resize(off+BLOCK_SIZE);
+		const size_t nRead = fread(&(*text)[off],1,BLOCK_SIZE,f);
+		text->resize(off+nRead);
+		eof = nRead<BLOCK_SIZE;
+		if (eof && ferror(f)) read_error = true;
+		if (!eof)
+		{
+			size_t cut = text->size();
+			while (cut>0 && (*text)[cut-1]!='\n') cut--;
+			carry.assign(text->begin()+cut, text->end());
+			text->resize(cut);
+		}
+		if (text->empty()) continue;
+
+		chunks.push_back(std::unique_ptr<TParsedChunk>(new TParsedChunk));
+		TParsedChunk *out = chunks.back().get();
+		// If too many blocks wait to be parsed, parse this one here instead:
+		if (in_flight>=max_in_flight || CThreadPool::Instance().getConcurrency()<2)
+		{
+			parse_chunk(&(*text)[0], &(*text)[0]+text->size(), *out, moments!=NULL);
+			continue;
+		}
+		texts.push_back(std::move(text));
+		std::vector<char> *t = texts.back().get();
+		in_flight++;
+		parsers.run([t, out, moments, &in_flight]()
+		{
+			parse_chunk(&(*t)[0], &(*t)[0]+t->size(), *out, moments!=NULL);
+			std::vector<char>().swap(*t);
+			in_flight--;
+		});
+	}
+	fclose(f);
+	parsers.wait();
+	texts.clear();
+	if (read_error) THROW_EXCEPTION(std::string("Error reading input file: ")+file);
+	const size_t nChunks = chunks.size();
+
+	// Merge: check consistent columns, compute row offsets & bbox:
+	size_t nCols = 0, nRows = 0;
+	std::vector<size_t> row_offset(nChunks);
+	bbox = TPointsBBox();
+	if (moments) *moments = TPointsXYMoments();
+	for (size_t c=0;c<nChunks;c++)
+	{
+		const TParsedChunk &ch = *chunks[c];
+		if (ch.bad_line || (ch.nCols && nCols && ch.nCols!=nCols))
+			THROW_EXCEPTION(std::string("Inconsistent number of columns in input file: ")+file);
+		if (ch.nCols) nCols=ch.nCols;
+		row_offset[c]=nRows;
+		nRows+=ch.nRows;
+		bbox.merge(ch.bbox);
+		if (moments) moments->merge(ch.moments);
+	}
+
+	xyz.setSize(nRows,nCols);
+	parallel_for(nChunks, [&](size_t c0, size_t c1)
+	{
+		for (size_t c=c0;c<c1;c++)
+		{
+			TParsedChunk &ch = *chunks[c];
+			for (size_t r=0;r<ch.nRows;r++)
+				for (size_t k=0;k<nCols;k++)
+					xyz(row_offset[c]+r,k) = ch.values[r*nCols+k];
+			std::vector<float>().swap(ch.values);
+		}
+	}, 1);
+}
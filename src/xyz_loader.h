@@ -0,0 +1,108 @@
+/* +---------------------------------------------------------------------------+
+   |                                DEM-GMRF                                   |
+   |                    https://github.com/3DLAB-UAL/dem-gmrf                  |
+   |                                                                           |
+   | Copyright (c) 2016, J.L.Blanco - University of Almeria                    |
+   | Released under GNU GPL v3 License. See LICENSE file                       |
+   +---------------------------------------------------------------------------+ */
+
+#pragma once
+
+#include <mrpt/math/CMatrix.h>
+#include <string>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+/** Read-only view of a point cloud as `float` rows of X Y Z [S] with arbitrary
+  * row/column strides, so that points held by the caller (a CMatrix, a numpy
+  * array, a service's buffers...) are processed in place, without copies. */
+struct TPointsView
+{
+	const float *data;
+	size_t n, ncols;
+	ptrdiff_t row_stride, col_stride; //!< In elements
+
+	TPointsView() : data(NULL), n(0), ncols(0), row_stride(0), col_stride(1) {}
+	TPointsView(const mrpt::math::CMatrix &m) :
+		data(m.data()), n(m.rows()), ncols(m.cols()), row_stride(m.rowStride()), col_stride(m.colStride()) {}
+	TPointsView(const float *data_, size_t n_, size_t ncols_, ptrdiff_t row_stride_, ptrdiff_t col_stride_ = 1) :
+		data(data_), n(n_), ncols(ncols_), row_stride(row_stride_), col_stride(col_stride_) {}
+
+	inline size_t rows() const { return n; }
+	inline size_t cols() const { return ncols; }
+	inline float operator()(size_t i, size_t k) const { return data[ptrdiff_t(i)*row_stride + ptrdiff_t(k)*col_stride]; }
+};
+
+/** Axis-aligned bounding box of a point cloud. Heights with |z|>=1e6 (no-data
+  * markers such as 1e+38) are ignored for the Z limits. */
+struct TPointsBBox
+{
+	double minx, maxx, miny, maxy, minz, maxz;
+
+	TPointsBBox() :
+		minx(std::numeric_limits<double>::max()), maxx(-std::numeric_limits<double>::max()),
+		miny(std::numeric_limits<double>::max()), maxy(-std::numeric_limits<double>::max()),
+		minz(std::numeric_limits<double>::max()), maxz(-std::numeric_limits<double>::max())
+	{}
+
+	/** Branch-free update (compiles to min/max/blend instructions) */
+	inline void update(double x, double y, double z)
+	{
+		const bool valid_z = std::abs(z)<1e6;
+		const double z_lo = valid_z ? z : std::numeric_limits<double>::max();
+		const double z_hi = valid_z ? z : -std::numeric_limits<double>::max();
+		minx = std::min(minx,x); maxx = std::max(maxx,x);
+		miny = std::min(miny,y); maxy = std::max(maxy,y);
+		minz = std::min(minz,z_lo); maxz = std::max(maxz,z_hi);
+	}
+	inline void merge(const TPointsBBox &o)
+	{
+		minx = std::min(minx,o.minx); maxx = std::max(maxx,o.maxx);
+		miny = std::min(miny,o.miny); maxy = std::max(maxy,o.maxy);
+		minz = std::min(minz,o.minz); maxz = std::max(maxz,o.maxz);
+	}
+};
+
+/** Mean and covariance of the XY coordinates of a point cloud, accumulated
+  * with Welford's update and mergeable (Chan et al.) across threads. */
+struct TPointsXYMoments
+{
+	double n, mx, my, Cxx, Cxy, Cyy; //!< C**: co-moments (sums of products of deviations)
+
+	TPointsXYMoments() : n(0), mx(0), my(0), Cxx(0), Cxy(0), Cyy(0) {}
+
+	inline void update(double x, double y)
+	{
+		n+=1;
+		const double dx = x-mx, dy = y-my;
+		mx += dx/n; my += dy/n;
+		Cxx += dx*(x-mx); Cyy += dy*(y-my); Cxy += dx*(y-my);
+	}
+	inline void merge(const TPointsXYMoments &o)
+	{
+		if (!o.n) return;
+		const double N = n+o.n, dx = o.mx-mx, dy = o.my-my, f = n*o.n/N;
+		Cxx += o.Cxx + dx*dx*f; Cyy += o.Cyy + dy*dy*f; Cxy += o.Cxy + dx*dy*f;
+		mx += dx*o.n/N; my += dy*o.n/N;
+		n = N;
+	}
+	/** Angle [rad] of the principal (major) axis of the XY cloud w.r.t. +X */
+	double principalAxisAngle() const { return 0.5*std::atan2(2*Cxy, Cxx-Cyy); }
+};
+
+/** Computes the bbox of the first three columns of `xyz` and, optionally, the
+  * moments of its XY columns, in parallel. */
+TPointsBBox compute_bbox(const TPointsView &xyz, TPointsXYMoments *moments = NULL);
+
+/** Loads a plain text XYZ[S] file (one point per row, values separated by
+  * whitespaces or commas; lines starting with `%` or `#` are comments) into
+  * `xyz`, one row per point. The file is streamed in newline-aligned blocks
+  * that several threads parse while the next ones are being read, and the bbox
+  * of the points is accumulated by each thread while parsing, so no extra pass
+  * over the data is needed. The same
+  * holds for the XY moments, if `moments` is not NULL.
+  * \exception std::exception On I/O error or rows with inconsistent column count.
+  */
+void load_xyz_file(const std::string &file, mrpt::math::CMatrix &xyz, TPointsBBox &bbox, TPointsXYMoments *moments = NULL);